@@ -0,0 +1,390 @@
+/**
+ * This file is © 2015 Mesosphere, Inc. ("Mesosphere"). Mesosphere
+ * licenses this file to you solely pursuant to the agreement between
+ * Mesosphere and you (if any).  If there is no such agreement between
+ * Mesosphere, the following terms apply (and you may not use this
+ * file except in compliance with such terms):
+ *
+ * 1) Subject to your compliance with the following terms, Mesosphere
+ * hereby grants you a nonexclusive, limited, personal,
+ * non-sublicensable, non-transferable, royalty-free license to use
+ * this file solely for your internal business purposes.
+ *
+ * 2) You may not (and agree not to, and not to authorize or enable
+ * others to), directly or indirectly:
+ *   (a) copy, distribute, rent, lease, timeshare, operate a service
+ *   bureau, or otherwise use for the benefit of a third party, this
+ *   file; or
+ *
+ *   (b) remove any proprietary notices from this file.  Except as
+ *   expressly set forth herein, as between you and Mesosphere,
+ *   Mesosphere retains all right, title and interest in and to this
+ *   file.
+ *
+ * 3) Unless required by applicable law or otherwise agreed to in
+ * writing, Mesosphere provides this file on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied,
+ * including, without limitation, any warranties or conditions of
+ * TITLE, NON-INFRINGEMENT, MERCHANTABILITY, or FITNESS FOR A
+ * PARTICULAR PURPOSE.
+ *
+ * 4) In no event and under no legal theory, whether in tort
+ * (including negligence), contract, or otherwise, unless required by
+ * applicable law (such as deliberate and grossly negligent acts) or
+ * agreed to in writing, shall Mesosphere be liable to you for
+ * damages, including any direct, indirect, special, incidental, or
+ * consequential damages of any character arising as a result of these
+ * terms or out of the use or inability to use this file (including
+ * but not limited to damages for loss of goodwill, work stoppage,
+ * computer failure or malfunction, or any and all other commercial
+ * damages or losses), even if Mesosphere has been advised of the
+ * possibility of such damages.
+ */
+
+// Drives the network isolator module through prepare(), isolate() and
+// cleanup() of many containers, the way an agent does, and reports how
+// long prepare() took, mostly the IPAM allocation, and how many heap
+// allocations the process made per call. Meant to run against
+// stand_in_plugin.py, e.g. with and without hedging:
+//
+//   isolator_benchmark --containers=2000 --concurrency=8 \
+//     --ipam='benchmarks/stand_in_plugin.py --latency=lognormal:20:1' \
+//     --isolator=benchmarks/stand_in_plugin.py \
+//     --parameter=ipam_hedge_percentile=95
+//
+// --parameter, which may be repeated, passes any other module parameter.
+// The containers are isolated with the benchmark's own pid, so the
+// isolator must be a plug-in, not the built-in virtualizer.
+// The first --warmup containers, 20 by default, are left out of the
+// results, so that hedging has the latencies it needs.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <mesos/mesos.hpp>
+
+#include <mesos/module/isolator.hpp>
+
+#include <mesos/slave/isolator.hpp>
+
+#include <process/collect.hpp>
+#include <process/future.hpp>
+#include <process/process.hpp>
+
+#include <stout/numify.hpp>
+#include <stout/nothing.hpp>
+#include <stout/option.hpp>
+#include <stout/stringify.hpp>
+#include <stout/strings.hpp>
+
+using namespace mesos;
+
+using mesos::slave::ContainerConfig;
+using mesos::slave::ContainerLaunchInfo;
+using mesos::slave::Isolator;
+
+using process::Future;
+
+using std::string;
+using std::vector;
+
+typedef std::chrono::steady_clock Clock;
+
+extern mesos::modules::Module<Isolator> com_mesosphere_mesos_NetworkIsolator;
+
+
+// Heap allocations of the whole process, by any thread, counted by
+// replacing the global operator new. The array and sized forms end up
+// here too.
+static std::atomic<uint64_t> allocations(0);
+
+
+void* operator new(size_t size)
+{
+  allocations++;
+
+  void* pointer = ::malloc(size == 0 ? 1 : size);
+  if (pointer == NULL) {
+    throw std::bad_alloc();
+  }
+
+  return pointer;
+}
+
+
+void operator delete(void* pointer) noexcept
+{
+  ::free(pointer);
+}
+
+
+struct Flags
+{
+  Flags() : containers(1000), concurrency(8), warmup(20) {}
+
+  size_t containers;
+  size_t concurrency;
+  size_t warmup;
+  Parameters parameters;
+};
+
+
+static void usage(const char* argv0)
+{
+  std::cerr << "Usage: " << argv0 << " --ipam=<command> "
+            << "--isolator=<command> [--containers=<n>] "
+            << "[--concurrency=<n>] [--warmup=<n>] "
+            << "[--parameter=<key>=<value>...]" << std::endl;
+  ::exit(1);
+}
+
+
+static void parameter(Flags* flags, const string& key, const string& value)
+{
+  Parameter* parameter = flags->parameters.add_parameter();
+  parameter->set_key(key);
+  parameter->set_value(value);
+}
+
+
+static Flags parse(int argc, char** argv)
+{
+  Flags flags;
+
+  for (int i = 1; i < argc; i++) {
+    const string arg = argv[i];
+    const size_t equals = arg.find('=');
+    if (!strings::startsWith(arg, "--") || equals == string::npos) {
+      usage(argv[0]);
+    }
+
+    const string name = arg.substr(2, equals - 2);
+    const string value = arg.substr(equals + 1);
+
+    if (name == "ipam") {
+      parameter(&flags, "ipam_command", value);
+    } else if (name == "isolator") {
+      parameter(&flags, "isolator_command", value);
+    } else if (name == "parameter" && value.find('=') != string::npos) {
+      parameter(
+          &flags,
+          value.substr(0, value.find('=')),
+          value.substr(value.find('=') + 1));
+    } else if (name == "containers" || name == "concurrency" ||
+               name == "warmup") {
+      Try<size_t> count = numify<size_t>(value);
+      if (count.isError()) {
+        usage(argv[0]);
+      }
+      if (name == "containers") {
+        flags.containers = count.get();
+      } else if (name == "concurrency") {
+        flags.concurrency = count.get();
+      } else {
+        flags.warmup = count.get();
+      }
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  if (flags.parameters.parameter().size() < 2 || flags.concurrency == 0) {
+    usage(argv[0]);
+  }
+
+  return flags;
+}
+
+
+// What the containerizer hands the isolator for an executor asking for
+// one IPv4 address in a netgroup, with a label.
+static ContainerConfig config(size_t i)
+{
+  ContainerConfig config;
+  config.set_directory("/tmp");
+
+  ExecutorInfo* executor = config.mutable_executorinfo();
+  executor->mutable_executor_id()->set_value("executor-" + stringify(i));
+  executor->mutable_framework_id()->set_value("benchmark");
+  executor->mutable_command()->set_value("true");
+
+  ContainerInfo* container = executor->mutable_container();
+  container->set_type(ContainerInfo::MESOS);
+
+  NetworkInfo* network = container->add_network_infos();
+  network->add_ip_addresses()->set_protocol(NetworkInfo::IPv4);
+  network->add_groups("prod");
+
+  Label* label = network->mutable_labels()->add_labels();
+  label->set_key("app");
+  label->set_value("benchmark");
+
+  return config;
+}
+
+
+static ContainerID containerId(size_t i)
+{
+  ContainerID id;
+  id.set_value("benchmark-" + stringify(i));
+  return id;
+}
+
+
+// Waits for 'futures', returning false if any of them failed.
+static bool await(const vector<Future<Nothing>>& futures, const string& what)
+{
+  Future<vector<Nothing>> collected = process::collect(futures);
+  collected.await();
+  if (!collected.isReady()) {
+    std::cerr << "Failed to " << what << " containers: "
+              << (collected.isFailed() ? collected.failure() : "discarded")
+              << std::endl;
+    return false;
+  }
+
+  return true;
+}
+
+
+static double percentile(const vector<double>& sorted, double p)
+{
+  return sorted[std::min(sorted.size() - 1, (size_t) (sorted.size() * p))];
+}
+
+
+int main(int argc, char** argv)
+{
+  const Flags flags = parse(argc, argv);
+
+  process::initialize();
+
+  Isolator* isolator =
+    com_mesosphere_mesos_NetworkIsolator.create(flags.parameters);
+  if (isolator == NULL) {
+    std::cerr << "Failed to create the isolator" << std::endl;
+    return 1;
+  }
+
+  // Milliseconds each prepare() took; written by the isolator actor,
+  // each slot by one callback.
+  vector<double> latencies(flags.containers);
+
+  // Made while the containers past the warmup went through each call.
+  uint64_t prepareAllocations = 0;
+  uint64_t isolateAllocations = 0;
+  uint64_t cleanupAllocations = 0;
+  size_t measured = 0;
+
+  const Clock::time_point start = Clock::now();
+
+  for (size_t first = 0; first < flags.containers;
+       first += flags.concurrency) {
+    const size_t last =
+      std::min(first + flags.concurrency, flags.containers);
+
+    // Built ahead, not to count their allocations.
+    vector<ContainerID> ids;
+    vector<ContainerConfig> configs;
+    for (size_t i = first; i < last; i++) {
+      ids.push_back(containerId(i));
+      configs.push_back(config(i));
+    }
+
+    uint64_t allocated = allocations;
+
+    vector<Future<Nothing>> prepares;
+    for (size_t i = first; i < last; i++) {
+      const Clock::time_point started = Clock::now();
+      double* latency = &latencies[i];
+
+      prepares.push_back(
+          isolator->prepare(ids[i - first], configs[i - first])
+        .then([=](const Option<ContainerLaunchInfo>&) {
+          *latency = std::chrono::duration<double, std::milli>(
+              Clock::now() - started).count();
+          return Nothing();
+        }));
+    }
+
+    if (!await(prepares, "prepare")) {
+      return 1;
+    }
+
+    const bool counted = first >= flags.warmup;
+    if (counted) {
+      prepareAllocations += allocations - allocated;
+      measured += last - first;
+    }
+
+    allocated = allocations;
+
+    vector<Future<Nothing>> isolates;
+    for (size_t i = first; i < last; i++) {
+      isolates.push_back(isolator->isolate(ids[i - first], ::getpid()));
+    }
+
+    if (!await(isolates, "isolate")) {
+      return 1;
+    }
+
+    if (counted) {
+      isolateAllocations += allocations - allocated;
+    }
+
+    allocated = allocations;
+
+    vector<Future<Nothing>> cleanups;
+    for (size_t i = first; i < last; i++) {
+      cleanups.push_back(isolator->cleanup(ids[i - first]));
+    }
+
+    if (!await(cleanups, "clean up")) {
+      return 1;
+    }
+
+    if (counted) {
+      cleanupAllocations += allocations - allocated;
+    }
+  }
+
+  const double elapsed =
+    std::chrono::duration<double>(Clock::now() - start).count();
+
+  vector<double> sorted(
+      latencies.begin() + std::min(flags.warmup, latencies.size()),
+      latencies.end());
+  if (sorted.empty()) {
+    usage(argv[0]);
+  }
+  std::sort(sorted.begin(), sorted.end());
+
+  std::cout << flags.containers << " containers in " << elapsed << "s, "
+            << (size_t) (flags.containers / elapsed) << "/s" << std::endl
+            << "prepare() latency: p50 " << percentile(sorted, 0.5)
+            << "ms, p90 " << percentile(sorted, 0.9)
+            << "ms, p99 " << percentile(sorted, 0.99)
+            << "ms, max " << sorted.back() << "ms" << std::endl;
+
+  // Includes what the futures of the benchmark itself allocate, the
+  // same for every run.
+  if (measured > 0) {
+    std::cout << "heap allocations per prepare(): "
+              << (double) prepareAllocations / measured
+              << ", isolate(): " << (double) isolateAllocations / measured
+              << ", cleanup(): " << (double) cleanupAllocations / measured
+              << std::endl;
+  }
+
+  delete isolator;
+  return 0;
+}
@@ -0,0 +1,344 @@
+/**
+ * This file is © 2015 Mesosphere, Inc. ("Mesosphere"). Mesosphere
+ * licenses this file to you solely pursuant to the agreement between
+ * Mesosphere and you (if any).  If there is no such agreement between
+ * Mesosphere, the following terms apply (and you may not use this
+ * file except in compliance with such terms):
+ *
+ * 1) Subject to your compliance with the following terms, Mesosphere
+ * hereby grants you a nonexclusive, limited, personal,
+ * non-sublicensable, non-transferable, royalty-free license to use
+ * this file solely for your internal business purposes.
+ *
+ * 2) You may not (and agree not to, and not to authorize or enable
+ * others to), directly or indirectly:
+ *   (a) copy, distribute, rent, lease, timeshare, operate a service
+ *   bureau, or otherwise use for the benefit of a third party, this
+ *   file; or
+ *
+ *   (b) remove any proprietary notices from this file.  Except as
+ *   expressly set forth herein, as between you and Mesosphere,
+ *   Mesosphere retains all right, title and interest in and to this
+ *   file.
+ *
+ * 3) Unless required by applicable law or otherwise agreed to in
+ * writing, Mesosphere provides this file on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied,
+ * including, without limitation, any warranties or conditions of
+ * TITLE, NON-INFRINGEMENT, MERCHANTABILITY, or FITNESS FOR A
+ * PARTICULAR PURPOSE.
+ *
+ * 4) In no event and under no legal theory, whether in tort
+ * (including negligence), contract, or otherwise, unless required by
+ * applicable law (such as deliberate and grossly negligent acts) or
+ * agreed to in writing, shall Mesosphere be liable to you for
+ * damages, including any direct, indirect, special, incidental, or
+ * consequential damages of any character arising as a result of these
+ * terms or out of the use or inability to use this file (including
+ * but not limited to damages for loss of goodwill, work stoppage,
+ * computer failure or malfunction, or any and all other commercial
+ * damages or losses), even if Mesosphere has been advised of the
+ * possibility of such damages.
+ */
+
+// Compares the two plugin transports of the network isolator: pipes
+// polled through epoll, as the libprocess event loop does, and the
+// io_uring backend ('plugin_io_backend=io_uring'). Runs a stand-in
+// plugin many times, a number of calls at a time, and reports calls per
+// second and the system calls the agent side made per call, counted at
+// each call site. Forking and reaping are the same for both and counted
+// apart.
+//
+//   plugin_transport_benchmark [calls] [concurrency] [plugin...]
+//
+// The plugin defaults to cat(1), which echoes the request back, so that
+// the transport rather than the plugin dominates.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/wait.h>
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <process/owned.hpp>
+
+#include <stout/try.hpp>
+
+#include "isolator/uring.hpp"
+
+using mesos::uring::Ring;
+
+using std::string;
+using std::vector;
+
+static const char REQUEST[] =
+  "{\"command\": \"allocate\", \"args\": {\"hostname\": \"agent\", "
+  "\"num_ipv4\": 1, \"num_ipv6\": 0, \"uid\": \"0123456789abcdef\", "
+  "\"netgroups\": [\"prod\"], \"labels\": [{\"key\": \"app\", "
+  "\"value\": \"frontend\"}]}}";
+
+static const size_t RESPONSE_SIZE = 10 * 4096 + 1;
+
+
+struct Counts
+{
+  Counts() : spawn(0), transport(0) {}
+
+  // pipe2(), the write before forking, fork(), closing the child's ends
+  // and wait4(); the same for both transports.
+  uint64_t spawn;
+
+  // Reads, closes, epoll_ctl(), epoll_wait() and io_uring_enter().
+  uint64_t transport;
+};
+
+
+struct Call
+{
+  pid_t pid;
+  int fd;
+  string buffer;
+  size_t offset;
+};
+
+
+// Forks 'argv' with the request already in its stdin. Our end of its
+// stdout is non-blocking unless 'blocking'.
+static Call* spawn(char** argv, bool blocking, Counts* counts)
+{
+  int in[2];
+  int out[2];
+
+  counts->spawn += 4;
+  if (::pipe2(in, O_CLOEXEC) < 0 || ::pipe2(out, O_CLOEXEC) < 0 ||
+      ::write(in[1], REQUEST, sizeof(REQUEST) - 1) < 0 ||
+      ::close(in[1]) < 0) {
+    ::perror("pipe");
+    ::exit(1);
+  }
+
+  counts->spawn++;
+  pid_t pid = ::fork();
+  if (pid < 0) {
+    ::perror("fork");
+    ::exit(1);
+  }
+
+  if (pid == 0) {
+    ::dup2(in[0], STDIN_FILENO);
+    ::dup2(out[1], STDOUT_FILENO);
+    ::execvp(argv[0], argv);
+    ::_exit(127);
+  }
+
+  counts->spawn += 2;
+  ::close(in[0]);
+  ::close(out[1]);
+
+  if (!blocking) {
+    counts->spawn++;
+    ::fcntl(out[0], F_SETFL, O_NONBLOCK);
+  }
+
+  Call* call = new Call();
+  call->pid = pid;
+  call->fd = out[0];
+  call->buffer.resize(RESPONSE_SIZE);
+  call->offset = 0;
+  return call;
+}
+
+
+static void finish(Call* call, size_t* completed, Counts* counts)
+{
+  int status;
+  counts->spawn++;
+  ::waitpid(call->pid, &status, 0);
+
+  if (call->offset == 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    std::cerr << "Plugin failed" << std::endl;
+    ::exit(1);
+  }
+
+  delete call;
+  (*completed)++;
+}
+
+
+// What libprocess does for each io::read() of a plugin reply: try to
+// read, and wait for the pipe on the event loop when it is empty.
+static Counts runEpoll(char** argv, size_t calls, size_t concurrency)
+{
+  Counts counts;
+
+  int epfd = ::epoll_create1(EPOLL_CLOEXEC);
+
+  size_t started = 0;
+  size_t completed = 0;
+
+  while (completed < calls) {
+    for (; started < calls && started - completed < concurrency; started++) {
+      Call* call = spawn(argv, false, &counts);
+
+      struct epoll_event event;
+      event.events = EPOLLIN;
+      event.data.ptr = call;
+      counts.transport++;
+      ::epoll_ctl(epfd, EPOLL_CTL_ADD, call->fd, &event);
+    }
+
+    struct epoll_event events[64];
+    counts.transport++;
+    int ready = ::epoll_wait(epfd, events, 64, -1);
+
+    for (int i = 0; i < ready; i++) {
+      Call* call = static_cast<Call*>(events[i].data.ptr);
+
+      ssize_t length;
+      do {
+        counts.transport++;
+        length = ::read(
+            call->fd,
+            &call->buffer[call->offset],
+            call->buffer.size() - call->offset);
+        if (length > 0) {
+          call->offset += length;
+        }
+      } while (length > 0);
+
+      if (length == 0) {
+        counts.transport += 2;
+        ::epoll_ctl(epfd, EPOLL_CTL_DEL, call->fd, NULL);
+        ::close(call->fd);
+        finish(call, &completed, &counts);
+      }
+    }
+  }
+
+  ::close(epfd);
+  return counts;
+}
+
+
+static void readReply(
+    Ring* ring,
+    Call* call,
+    size_t* completed,
+    Counts* counts)
+{
+  Try<Nothing> read = ring->read(
+      call->fd,
+      &call->buffer[call->offset],
+      call->buffer.size() - call->offset,
+      [=](int result) {
+        if (result > 0) {
+          call->offset += result;
+          readReply(ring, call, completed, counts);
+          return;
+        }
+
+        if (ring->close(call->fd, [](int) {}).isError()) {
+          ::close(call->fd);
+        }
+        finish(call, completed, counts);
+      });
+
+  if (read.isError()) {
+    std::cerr << read.error() << std::endl;
+    ::exit(1);
+  }
+}
+
+
+// The io_uring backend: reads and closes of all calls in flight go to
+// the kernel together, and the ring's eventfd is what the event loop
+// waits for.
+static Counts runRing(char** argv, size_t calls, size_t concurrency)
+{
+  Counts counts;
+
+  Try<process::Owned<Ring>> ring = Ring::create(256);
+  if (ring.isError()) {
+    std::cerr << ring.error() << std::endl;
+    ::exit(1);
+  }
+
+  int epfd = ::epoll_create1(EPOLL_CLOEXEC);
+
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
+  ::epoll_ctl(epfd, EPOLL_CTL_ADD, ring.get()->eventfd(), &event);
+
+  size_t started = 0;
+  size_t completed = 0;
+
+  while (completed < calls) {
+    for (; started < calls && started - completed < concurrency; started++) {
+      readReply(
+          ring.get().get(), spawn(argv, true, &counts), &completed, &counts);
+    }
+
+    if (ring.get()->submit().isError()) {
+      ::perror("io_uring_enter");
+      ::exit(1);
+    }
+
+    struct epoll_event events[1];
+    counts.transport++;
+    if (::epoll_wait(epfd, events, 1, -1) == 1) {
+      ring.get()->reap();
+    }
+  }
+
+  // The closes queued by the last completions.
+  ring.get()->submit();
+
+  counts.transport += ring.get()->syscalls();
+
+  ::close(epfd);
+  return counts;
+}
+
+
+static void report(
+    const string& name,
+    size_t calls,
+    const Counts& counts,
+    const std::chrono::duration<double>& elapsed)
+{
+  std::cout << name << ": " << (size_t) (calls / elapsed.count())
+            << " calls/s, " << (double) counts.transport / calls
+            << " transport and " << (double) counts.spawn / calls
+            << " spawn syscalls per call" << std::endl;
+}
+
+
+int main(int argc, char** argv)
+{
+  const size_t calls = argc > 1 ? ::atoi(argv[1]) : 10000;
+  const size_t concurrency = argc > 2 ? ::atoi(argv[2]) : 32;
+
+  char* cat[] = { const_cast<char*>("cat"), NULL };
+  char** plugin = argc > 3 ? argv + 3 : cat;
+
+  typedef std::chrono::steady_clock Clock;
+
+  Clock::time_point start = Clock::now();
+  Counts epoll = runEpoll(plugin, calls, concurrency);
+  report("epoll", calls, epoll, Clock::now() - start);
+
+  start = Clock::now();
+  Counts ring = runRing(plugin, calls, concurrency);
+  report("io_uring", calls, ring, Clock::now() - start);
+
+  return 0;
+}
@@ -0,0 +1,202 @@
+/**
+ * This file is © 2015 Mesosphere, Inc. ("Mesosphere"). Mesosphere
+ * licenses this file to you solely pursuant to the agreement between
+ * Mesosphere and you (if any).  If there is no such agreement between
+ * Mesosphere, the following terms apply (and you may not use this
+ * file except in compliance with such terms):
+ *
+ * 1) Subject to your compliance with the following terms, Mesosphere
+ * hereby grants you a nonexclusive, limited, personal,
+ * non-sublicensable, non-transferable, royalty-free license to use
+ * this file solely for your internal business purposes.
+ *
+ * 2) You may not (and agree not to, and not to authorize or enable
+ * others to), directly or indirectly:
+ *   (a) copy, distribute, rent, lease, timeshare, operate a service
+ *   bureau, or otherwise use for the benefit of a third party, this
+ *   file; or
+ *
+ *   (b) remove any proprietary notices from this file.  Except as
+ *   expressly set forth herein, as between you and Mesosphere,
+ *   Mesosphere retains all right, title and interest in and to this
+ *   file.
+ *
+ * 3) Unless required by applicable law or otherwise agreed to in
+ * writing, Mesosphere provides this file on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied,
+ * including, without limitation, any warranties or conditions of
+ * TITLE, NON-INFRINGEMENT, MERCHANTABILITY, or FITNESS FOR A
+ * PARTICULAR PURPOSE.
+ *
+ * 4) In no event and under no legal theory, whether in tort
+ * (including negligence), contract, or otherwise, unless required by
+ * applicable law (such as deliberate and grossly negligent acts) or
+ * agreed to in writing, shall Mesosphere be liable to you for
+ * damages, including any direct, indirect, special, incidental, or
+ * consequential damages of any character arising as a result of these
+ * terms or out of the use or inability to use this file (including
+ * but not limited to damages for loss of goodwill, work stoppage,
+ * computer failure or malfunction, or any and all other commercial
+ * damages or losses), even if Mesosphere has been advised of the
+ * possibility of such damages.
+ */
+
+// Times plumb() of the built-in virtualizer: connecting a number of
+// containers at once, the way the isolator drains its queue of isolate
+// requests, against connecting them one plumb() call each. The
+// containers are children sitting in network namespaces of their own.
+//
+//   unshare -Urn plumb_benchmark [rounds] [containers...]
+//
+// unshare(1) gives the benchmark a user and network namespace of its
+// own to play the host in, so that it needs no privileges and leaves
+// the host alone. The containers default to 1, 10 and 100, timed over
+// 5 rounds each.
+
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/wait.h>
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <stout/foreach.hpp>
+#include <stout/stringify.hpp>
+#include <stout/try.hpp>
+
+#include "isolator/netlink.hpp"
+
+using mesos::netlink::Plumbing;
+
+using std::string;
+using std::vector;
+
+typedef std::chrono::steady_clock Clock;
+
+
+// Forks a child in a network namespace of its own, returning once the
+// namespace exists.
+static pid_t container()
+{
+  int ready[2];
+  if (::pipe(ready) < 0) {
+    ::perror("pipe");
+    ::exit(1);
+  }
+
+  pid_t pid = ::fork();
+  if (pid < 0) {
+    ::perror("fork");
+    ::exit(1);
+  }
+
+  if (pid == 0) {
+    ::close(ready[0]);
+    if (::unshare(CLONE_NEWNET) < 0) {
+      ::_exit(1);
+    }
+    ::close(ready[1]);
+    ::pause();
+    ::_exit(0);
+  }
+
+  // Readable once the child closed its end, or exited.
+  char byte;
+  ::close(ready[1]);
+  ::read(ready[0], &byte, 1);
+  ::close(ready[0]);
+
+  return pid;
+}
+
+
+static vector<Plumbing> containers(size_t count)
+{
+  vector<Plumbing> plumbings;
+
+  for (size_t i = 0; i < count; i++) {
+    Plumbing plumbing;
+    plumbing.pid = container();
+    plumbing.link = "bench" + stringify(i);
+    plumbing.addresses.push_back(
+        "10.2." + stringify(i / 250) + "." + stringify(i % 250 + 1));
+    plumbings.push_back(plumbing);
+  }
+
+  return plumbings;
+}
+
+
+static void check(const vector<Try<Nothing>>& results)
+{
+  foreach (const Try<Nothing>& result, results) {
+    if (result.isError()) {
+      std::cerr << "Failed to plumb: " << result.error() << std::endl;
+      ::exit(1);
+    }
+  }
+}
+
+
+// Microseconds per container it took to connect 'count' containers,
+// together or one at a time.
+static double run(size_t count, bool batched)
+{
+  const vector<Plumbing> plumbings = containers(count);
+
+  const Clock::time_point start = Clock::now();
+
+  if (batched) {
+    check(mesos::netlink::plumb(plumbings));
+  } else {
+    foreach (const Plumbing& plumbing, plumbings) {
+      check(mesos::netlink::plumb(vector<Plumbing>(1, plumbing)));
+    }
+  }
+
+  const double elapsed =
+    std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+
+  foreach (const Plumbing& plumbing, plumbings) {
+    mesos::netlink::unplumb(plumbing.link);
+    ::kill(plumbing.pid, SIGKILL);
+  }
+  while (::wait(NULL) > 0);
+
+  return elapsed / count;
+}
+
+
+int main(int argc, char** argv)
+{
+  const size_t rounds = argc > 1 ? ::atoi(argv[1]) : 5;
+
+  vector<size_t> counts;
+  for (int i = 2; i < argc; i++) {
+    counts.push_back(::atoi(argv[i]));
+  }
+  if (counts.empty()) {
+    counts = {1, 10, 100};
+  }
+
+  foreach (size_t count, counts) {
+    double batched = 0;
+    double single = 0;
+    for (size_t round = 0; round < rounds; round++) {
+      batched += run(count, true);
+      single += run(count, false);
+    }
+
+    std::cout << count << " containers: "
+              << (size_t) (batched / rounds) << "us per container batched, "
+              << (size_t) (single / rounds) << "us one at a time"
+              << std::endl;
+  }
+
+  return 0;
+}
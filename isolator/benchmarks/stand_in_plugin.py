@@ -0,0 +1,92 @@
+#!/usr/bin/env python
+"""
+Stand-in for the IPAM and Network Virtualizer plug-ins, for benchmarking
+the module without a datastore behind it. Answers every command of the
+plug-in API successfully, after a delay drawn from a latency
+distribution:
+
+    stand_in_plugin.py [--latency=<distribution>] [--commands=<a,b,...>]
+
+where <distribution>, in milliseconds, is one of
+
+    fixed:<ms>
+    uniform:<min>:<max>
+    lognormal:<median>:<sigma>
+    bimodal:<fast>:<slow>:<probability of slow>
+
+applied to the comma separated --commands only, all of them by default.
+`allocate` hands out random addresses in 10.0.0.0/8, and `claim_block`
+random /26s in it.
+"""
+import json
+import random
+import sys
+import time
+
+
+def parse_latency(spec):
+    fields = spec.split(":")
+    kind, values = fields[0], [float(value) for value in fields[1:]]
+
+    if kind == "fixed" and len(values) == 1:
+        return lambda: values[0]
+    if kind == "uniform" and len(values) == 2:
+        return lambda: random.uniform(values[0], values[1])
+    if kind == "lognormal" and len(values) == 2:
+        return lambda: values[0] * random.lognormvariate(0, values[1])
+    if kind == "bimodal" and len(values) == 3:
+        return lambda: (values[1] if random.random() < values[2]
+                        else values[0])
+
+    raise ValueError("Invalid latency distribution '%s'" % spec)
+
+
+def random_address(prefix=32):
+    address = (10 << 24) | random.getrandbits(24)
+    address &= ~((1 << (32 - prefix)) - 1)
+    return ".".join(str((address >> shift) & 0xff)
+                    for shift in (24, 16, 8, 0))
+
+
+def respond(request):
+    command = request.get("command")
+    args = request.get("args", {})
+
+    if command == "allocate":
+        return {"ipv4": [random_address()
+                         for _ in range(args.get("num_ipv4", 0))],
+                "ipv6": [],
+                "error": None}
+    if command == "claim_block":
+        return {"ipv4": ["%s/26" % random_address(26)], "error": None}
+    if command in ("reserve", "release", "release_block",
+                   "isolate", "cleanup"):
+        return {"error": None}
+
+    return {"error": "Unknown command '%s'" % command}
+
+
+def main(argv):
+    latency = lambda: 0.0
+    commands = None
+
+    for arg in argv:
+        if arg.startswith("--latency="):
+            latency = parse_latency(arg[len("--latency="):])
+        elif arg.startswith("--commands="):
+            commands = arg[len("--commands="):].split(",")
+        else:
+            sys.stderr.write(__doc__)
+            return 1
+
+    request = json.loads(sys.stdin.read())
+
+    if commands is None or request.get("command") in commands:
+        time.sleep(latency() / 1000.0)
+
+    sys.stdout.write(json.dumps(respond(request)))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv[1:]))
@@ -0,0 +1,1038 @@
+/**
+ * This file is © 2015 Mesosphere, Inc. ("Mesosphere"). Mesosphere
+ * licenses this file to you solely pursuant to the agreement between
+ * Mesosphere and you (if any).  If there is no such agreement between
+ * Mesosphere, the following terms apply (and you may not use this
+ * file except in compliance with such terms):
+ *
+ * 1) Subject to your compliance with the following terms, Mesosphere
+ * hereby grants you a nonexclusive, limited, personal,
+ * non-sublicensable, non-transferable, royalty-free license to use
+ * this file solely for your internal business purposes.
+ *
+ * 2) You may not (and agree not to, and not to authorize or enable
+ * others to), directly or indirectly:
+ *   (a) copy, distribute, rent, lease, timeshare, operate a service
+ *   bureau, or otherwise use for the benefit of a third party, this
+ *   file; or
+ *
+ *   (b) remove any proprietary notices from this file.  Except as
+ *   expressly set forth herein, as between you and Mesosphere,
+ *   Mesosphere retains all right, title and interest in and to this
+ *   file.
+ *
+ * 3) Unless required by applicable law or otherwise agreed to in
+ * writing, Mesosphere provides this file on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied,
+ * including, without limitation, any warranties or conditions of
+ * TITLE, NON-INFRINGEMENT, MERCHANTABILITY, or FITNESS FOR A
+ * PARTICULAR PURPOSE.
+ *
+ * 4) In no event and under no legal theory, whether in tort
+ * (including negligence), contract, or otherwise, unless required by
+ * applicable law (such as deliberate and grossly negligent acts) or
+ * agreed to in writing, shall Mesosphere be liable to you for
+ * damages, including any direct, indirect, special, incidental, or
+ * consequential damages of any character arising as a result of these
+ * terms or out of the use or inability to use this file (including
+ * but not limited to damages for loss of goodwill, work stoppage,
+ * computer failure or malfunction, or any and all other commercial
+ * damages or losses), even if Mesosphere has been advised of the
+ * possibility of such damages.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <utility>
+
+#include <stout/error.hpp>
+#include <stout/foreach.hpp>
+#include <stout/json.hpp>
+#include <stout/numify.hpp>
+#include <stout/os.hpp>
+#include <stout/path.hpp>
+#include <stout/strings.hpp>
+
+#include "ipam.hpp"
+
+using process::Owned;
+
+using std::string;
+using std::vector;
+
+namespace mesos {
+namespace ipam {
+
+static const char DEFAULT_STATE_DIR[] =
+  "/var/run/mesos/network_isolator/ipam";
+
+// Ranges are at most a /12, a million addresses; a 128KB bitmap.
+static const int MIN_PREFIX = 12;
+
+// The state file starts with a header identifying the boot it is from.
+static const char MAGIC[] = "IPAM1";
+static const size_t BOOT_ID_SIZE = 36;
+static const size_t HEADER_SIZE = 64;
+
+// The block store has a header with the block prefix, then a hostname
+// for each block.
+static const char BLOCKS_MAGIC[] = "BLOCKS1";
+static const size_t BLOCKS_HEADER_SIZE = 64;
+static const size_t BLOCKS_ENTRY_SIZE = 64;
+static const size_t MAX_BLOCKS = 65536;
+
+static const char BLOCKS_CHECKPOINT[] = "blocks.json";
+
+
+struct Network
+{
+  uint32_t address;
+  int prefix;
+};
+
+
+static Try<Network> parseCidr(const string& cidr, int minPrefix = 1)
+{
+  vector<string> parts = strings::split(cidr, "/");
+  if (parts.size() != 2) {
+    return Error("Invalid CIDR '" + cidr + "'");
+  }
+
+  struct in_addr address;
+  if (::inet_pton(AF_INET, parts[0].c_str(), &address) != 1) {
+    return Error("Invalid address in CIDR '" + cidr + "'");
+  }
+
+  Try<int> prefix = numify<int>(parts[1]);
+  if (prefix.isError() || prefix.get() < minPrefix || prefix.get() > 32) {
+    return Error(
+        "Invalid prefix in CIDR '" + cidr + "', expected /" +
+        stringify(minPrefix) + " to /32");
+  }
+
+  Network network;
+  network.prefix = prefix.get();
+  network.address = ntohl(address.s_addr) & (~0U << (32 - network.prefix));
+  return network;
+}
+
+
+static Try<uint32_t> parseAddress(const string& address)
+{
+  struct in_addr parsed;
+  if (::inet_pton(AF_INET, address.c_str(), &parsed) != 1) {
+    return Error("Invalid IPv4 address '" + address + "'");
+  }
+
+  return ntohl(parsed.s_addr);
+}
+
+
+static string format(uint32_t address)
+{
+  struct in_addr formatted;
+  formatted.s_addr = htonl(address);
+
+  char buffer[INET_ADDRSTRLEN];
+  ::inet_ntop(AF_INET, &formatted, buffer, sizeof(buffer));
+  return buffer;
+}
+
+
+// The name of the state file of a range or block.
+static string filename(const Network& network)
+{
+  return format(network.address) + "-" + stringify(network.prefix);
+}
+
+
+Try<Owned<Range>> Range::open(const string& cidr, const string& directory)
+{
+  Try<Network> network = parseCidr(cidr, MIN_PREFIX);
+  if (network.isError()) {
+    return Error(network.error());
+  }
+
+  // Point to point ranges have no network and broadcast addresses.
+  uint32_t first = network.get().address;
+  uint32_t size = 1U << (32 - network.get().prefix);
+  if (network.get().prefix < 31) {
+    first++;
+    size -= 2;
+  }
+
+  const string name =
+    format(network.get().address) + "/" + stringify(network.get().prefix);
+  const string path = path::join(directory, filename(network.get()));
+
+  Try<string> bootId = os::read("/proc/sys/kernel/random/boot_id");
+  if (bootId.isError()) {
+    return Error("Failed to read the boot ID: " + bootId.error());
+  }
+  const string boot = strings::trim(bootId.get()).substr(0, BOOT_ID_SIZE);
+
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return ErrnoError("Failed to open '" + path + "'");
+  }
+
+  if (::flock(fd, LOCK_EX | LOCK_NB) < 0) {
+    ErrnoError error("Failed to lock '" + path + "'");
+    ::close(fd);
+    return error;
+  }
+
+  const size_t length = HEADER_SIZE + (size + 7) / 8;
+
+  struct stat s;
+  if (::fstat(fd, &s) < 0 ||
+      (s.st_size == 0 && ::ftruncate(fd, length) < 0)) {
+    ErrnoError error("Failed to size '" + path + "'");
+    ::close(fd);
+    return error;
+  }
+
+  if (s.st_size != 0 && (size_t) s.st_size != length) {
+    ::close(fd);
+    return Error(
+        "'" + path + "' holds " + stringify(s.st_size) +
+        " bytes rather than " + stringify(length));
+  }
+
+  void* map =
+    ::mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    ErrnoError error("Failed to map '" + path + "'");
+    ::close(fd);
+    return error;
+  }
+
+  // Whatever was in use before a reboot is no more.
+  char* header = static_cast<char*>(map);
+  if (::memcmp(header, MAGIC, sizeof(MAGIC)) != 0 ||
+      ::memcmp(header + sizeof(MAGIC), boot.data(), boot.size()) != 0) {
+    ::memset(header, 0, length);
+    ::memcpy(header, MAGIC, sizeof(MAGIC));
+    ::memcpy(header + sizeof(MAGIC), boot.data(), boot.size());
+  }
+
+  return Owned<Range>(new Range(
+      name,
+      first,
+      size,
+      fd,
+      static_cast<uint8_t*>(map),
+      length));
+}
+
+
+Range::Range(
+    const string& cidr_,
+    uint32_t first_,
+    uint32_t size_,
+    int fd_,
+    uint8_t* map_,
+    size_t length_)
+  : cidr(cidr_),
+    first(first_),
+    size(size_),
+    fd(fd_),
+    map(map_),
+    length(length_),
+    bitmap(map_ + HEADER_SIZE),
+    queued(size_, false),
+    unused(0)
+{
+  for (uint32_t offset = 0; offset < size; offset++) {
+    if (!used(offset)) {
+      free.push_back(offset);
+      queued[offset] = true;
+      unused++;
+    }
+  }
+}
+
+
+Range::~Range()
+{
+  ::munmap(map, length);
+  ::close(fd);
+}
+
+
+Option<uint32_t> Range::allocate()
+{
+  while (!free.empty()) {
+    uint32_t offset = free.front();
+    free.pop_front();
+    queued[offset] = false;
+
+    if (!used(offset)) {
+      bitmap[offset / 8] |= 1 << (offset % 8);
+      unused--;
+      return first + offset;
+    }
+  }
+
+  return None();
+}
+
+
+bool Range::reserve(uint32_t address)
+{
+  uint32_t offset = address - first;
+  if (used(offset)) {
+    return false;
+  }
+
+  bitmap[offset / 8] |= 1 << (offset % 8);
+  unused--;
+  return true;
+}
+
+
+void Range::release(uint32_t address)
+{
+  uint32_t offset = address - first;
+  if (!used(offset)) {
+    return;
+  }
+
+  bitmap[offset / 8] &= ~(1 << (offset % 8));
+  unused++;
+
+  // Released addresses go last, so that they rest a while before they
+  // are reused and stale ARP entries have a chance to expire.
+  if (!queued[offset]) {
+    free.push_back(offset);
+    queued[offset] = true;
+  }
+}
+
+
+Try<Owned<BlockStore>> BlockStore::open(
+    const string& cidr,
+    int prefix,
+    const string& directory)
+{
+  Try<Network> network = parseCidr(cidr);
+  if (network.isError()) {
+    return Error(network.error());
+  }
+
+  if (prefix < network.get().prefix ||
+      prefix - network.get().prefix > 16) {
+    return Error(
+        "Blocks of '" + cidr + "' must be /" +
+        stringify(network.get().prefix) + " to /" +
+        stringify(std::min(network.get().prefix + 16, 32)));
+  }
+
+  const size_t count = (size_t) 1 << (prefix - network.get().prefix);
+  const size_t length = BLOCKS_HEADER_SIZE + count * BLOCKS_ENTRY_SIZE;
+  const string path =
+    path::join(directory, "blocks-" + filename(network.get()));
+
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return ErrnoError("Failed to open '" + path + "'");
+  }
+
+  // Other agents may be opening the store at the same time.
+  if (::flock(fd, LOCK_EX) < 0) {
+    ErrnoError error("Failed to lock '" + path + "'");
+    ::close(fd);
+    return error;
+  }
+
+  struct stat s;
+  if (::fstat(fd, &s) < 0 ||
+      (s.st_size == 0 && ::ftruncate(fd, length) < 0)) {
+    ErrnoError error("Failed to size '" + path + "'");
+    ::close(fd);
+    return error;
+  }
+
+  void* map = MAP_FAILED;
+  if (s.st_size == 0 || (size_t) s.st_size == length) {
+    map = ::mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+
+  char* header = static_cast<char*>(map);
+  if (map != MAP_FAILED && s.st_size == 0) {
+    ::memcpy(header, BLOCKS_MAGIC, sizeof(BLOCKS_MAGIC));
+    header[sizeof(BLOCKS_MAGIC)] = prefix;
+  }
+
+  if (map == MAP_FAILED ||
+      ::memcmp(header, BLOCKS_MAGIC, sizeof(BLOCKS_MAGIC)) != 0 ||
+      header[sizeof(BLOCKS_MAGIC)] != prefix) {
+    if (map != MAP_FAILED) {
+      ::munmap(map, length);
+    }
+    ::close(fd);
+    return Error(
+        "'" + path + "' does not hold /" + stringify(prefix) +
+        " blocks of '" + cidr + "'");
+  }
+
+  ::flock(fd, LOCK_UN);
+
+  return Owned<BlockStore>(new BlockStore(
+      network.get().address,
+      prefix,
+      count,
+      fd,
+      header,
+      length));
+}
+
+
+BlockStore::BlockStore(
+    uint32_t network_,
+    int prefix_,
+    size_t count_,
+    int fd_,
+    char* map_,
+    size_t length_)
+  : prefix(prefix_),
+    network(network_),
+    count(count_),
+    fd(fd_),
+    map(map_),
+    length(length_) {}
+
+
+BlockStore::~BlockStore()
+{
+  ::munmap(map, length);
+  ::close(fd);
+}
+
+
+char* BlockStore::entry(size_t index)
+{
+  return map + BLOCKS_HEADER_SIZE + index * BLOCKS_ENTRY_SIZE;
+}
+
+
+Try<string> BlockStore::claim(const string& hostname)
+{
+  if (hostname.empty()) {
+    return Error("No hostname to claim a block for");
+  }
+
+  if (::flock(fd, LOCK_EX) < 0) {
+    return ErrnoError("Failed to lock the block store");
+  }
+
+  Option<size_t> claimed;
+  for (size_t index = 0; index < count; index++) {
+    char* owner = entry(index);
+    if (owner[0] == '\0') {
+      ::strncpy(owner, hostname.c_str(), BLOCKS_ENTRY_SIZE - 1);
+      claimed = index;
+      break;
+    }
+  }
+
+  ::flock(fd, LOCK_UN);
+
+  if (claimed.isNone()) {
+    return Error("Out of blocks");
+  }
+
+  return format(network + (claimed.get() << (32 - prefix))) + "/" +
+    stringify(prefix);
+}
+
+
+Try<Nothing> BlockStore::release(const string& block)
+{
+  Try<Network> parsed = parseCidr(block);
+  if (parsed.isError()) {
+    return Error(parsed.error());
+  }
+
+  const uint32_t offset = parsed.get().address - network;
+  if (parsed.get().prefix != prefix || (offset >> (32 - prefix)) >= count) {
+    return Error("'" + block + "' is not a block of the store");
+  }
+
+  if (::flock(fd, LOCK_EX) < 0) {
+    return ErrnoError("Failed to lock the block store");
+  }
+
+  ::memset(entry(offset >> (32 - prefix)), 0, BLOCKS_ENTRY_SIZE);
+
+  ::flock(fd, LOCK_UN);
+
+  return Nothing();
+}
+
+
+Try<Owned<Allocator>> Allocator::create(const string& spec)
+{
+  string directory = DEFAULT_STATE_DIR;
+  vector<std::pair<string, string>> cidrs;
+  Option<string> blockPool;
+  int blockPrefix = 26;
+
+  foreach (const string& option, strings::tokenize(spec, ",")) {
+    size_t separator = option.find('=');
+    if (separator == string::npos) {
+      return Error("Invalid option '" + option + "', expected key=value");
+    }
+
+    const string key = option.substr(0, separator);
+    const string value = option.substr(separator + 1);
+
+    if (key == "state") {
+      directory = value;
+    } else if (key == "cidr") {
+      cidrs.push_back(std::make_pair("", value));
+    } else if (strings::startsWith(key, "cidr.")) {
+      cidrs.push_back(std::make_pair(key.substr(5), value));
+    } else if (key == "blocks") {
+      if (blockPool.isSome()) {
+        return Error("Only one block CIDR may be configured");
+      }
+      blockPool = value;
+    } else if (key == "block_size") {
+      Try<int> prefix = numify<int>(value);
+      if (prefix.isError() || prefix.get() < 1 || prefix.get() > 32) {
+        return Error("Invalid block size '" + value + "'");
+      }
+      blockPrefix = prefix.get();
+    } else {
+      return Error("Unknown option '" + key + "'");
+    }
+  }
+
+  vector<string> all;
+  for (size_t i = 0; i < cidrs.size(); i++) {
+    all.push_back(cidrs[i].second);
+  }
+  if (blockPool.isSome()) {
+    all.push_back(blockPool.get());
+  }
+
+  if (all.empty()) {
+    return Error("No CIDR configured");
+  }
+
+  // Overlapping ranges would hand out the same addresses twice.
+  for (size_t i = 0; i < all.size(); i++) {
+    Try<Network> network = parseCidr(all[i]);
+    if (network.isError()) {
+      return Error(network.error());
+    }
+
+    for (size_t j = 0; j < i; j++) {
+      Network other = parseCidr(all[j]).get();
+      int prefix = std::min(network.get().prefix, other.prefix);
+      uint32_t mask = ~0U << (32 - prefix);
+      if ((network.get().address & mask) == (other.address & mask)) {
+        return Error("CIDRs '" + all[j] + "' and '" + all[i] + "' overlap");
+      }
+    }
+  }
+
+  Try<Nothing> mkdir = os::mkdir(directory);
+  if (mkdir.isError()) {
+    return Error("Failed to create '" + directory + "': " + mkdir.error());
+  }
+
+  Owned<Allocator> allocator(new Allocator());
+
+  for (size_t i = 0; i < cidrs.size(); i++) {
+    Try<Owned<Range>> range = Range::open(cidrs[i].second, directory);
+    if (range.isError()) {
+      return Error(range.error());
+    }
+
+    allocator->ranges.push_back(range.get());
+    allocator->netgroups[cidrs[i].first].push_back(range.get().get());
+  }
+
+  if (blockPool.isSome()) {
+    Try<Owned<BlockStore>> blocks =
+      BlockStore::open(blockPool.get(), blockPrefix, directory);
+    if (blocks.isError()) {
+      return Error(blocks.error());
+    }
+
+    allocator->blocks = blocks.get();
+  }
+
+  return allocator;
+}
+
+
+Try<vector<string>> Allocator::allocate(
+    const string& uid,
+    const vector<string>& groups,
+    size_t count)
+{
+  const vector<Range*>* candidates = NULL;
+  foreach (const string& group, groups) {
+    if (netgroups.contains(group)) {
+      candidates = &netgroups.at(group);
+      break;
+    }
+  }
+
+  if (candidates == NULL && netgroups.contains("")) {
+    candidates = &netgroups.at("");
+  }
+
+  if (candidates == NULL) {
+    return Error(
+        "No CIDR configured for netgroups " + strings::join(" ", groups));
+  }
+
+  vector<std::pair<Range*, uint32_t>> taken;
+  foreach (Range* range, *candidates) {
+    while (taken.size() < count) {
+      Option<uint32_t> address = range->allocate();
+      if (address.isNone()) {
+        break;
+      }
+      taken.push_back(std::make_pair(range, address.get()));
+    }
+  }
+
+  if (taken.size() < count) {
+    for (size_t i = 0; i < taken.size(); i++) {
+      taken[i].first->release(taken[i].second);
+    }
+    return Error("Out of addresses");
+  }
+
+  vector<string> addresses;
+  for (size_t i = 0; i < taken.size(); i++) {
+    take(uid, taken[i].second);
+    addresses.push_back(format(taken[i].second));
+  }
+
+  return addresses;
+}
+
+
+Try<Nothing> Allocator::reserve(
+    const string& uid,
+    const vector<string>& addresses)
+{
+  vector<std::pair<Range*, uint32_t>> taken;
+  Option<Error> error;
+
+  foreach (const string& address, addresses) {
+    Try<uint32_t> parsed = parseAddress(address);
+    if (parsed.isError()) {
+      error = Error(parsed.error());
+      break;
+    }
+
+    Range* range = find(parsed.get());
+    if (range == NULL) {
+      continue;
+    }
+
+    // Reserving again for the same uid is no conflict.
+    if (owners.contains(parsed.get()) && owners.at(parsed.get()) == uid) {
+      continue;
+    }
+
+    if (!range->reserve(parsed.get())) {
+      error = Error("'" + address + "' is in use");
+      break;
+    }
+    taken.push_back(std::make_pair(range, parsed.get()));
+  }
+
+  if (error.isSome()) {
+    for (size_t i = 0; i < taken.size(); i++) {
+      taken[i].first->release(taken[i].second);
+    }
+    return error.get();
+  }
+
+  for (size_t i = 0; i < taken.size(); i++) {
+    take(uid, taken[i].second);
+  }
+
+  return Nothing();
+}
+
+
+Try<Nothing> Allocator::release(const vector<string>& addresses)
+{
+  vector<string> invalid;
+
+  foreach (const string& address, addresses) {
+    // No IPv6 address was ever handed out.
+    if (address.find(':') != string::npos) {
+      continue;
+    }
+
+    Try<uint32_t> parsed = parseAddress(address);
+    if (parsed.isError()) {
+      invalid.push_back(address);
+      continue;
+    }
+
+    Range* range = find(parsed.get());
+    if (range == NULL) {
+      continue;
+    }
+
+    range->release(parsed.get());
+
+    if (owners.contains(parsed.get())) {
+      vector<uint32_t>& lease = leases[owners.at(parsed.get())];
+      lease.erase(std::remove(lease.begin(), lease.end(), parsed.get()),
+                  lease.end());
+      if (lease.empty()) {
+        leases.erase(owners.at(parsed.get()));
+      }
+      owners.erase(parsed.get());
+    }
+  }
+
+  if (!invalid.empty()) {
+    return Error("Invalid IPv4 addresses " + strings::join(" ", invalid));
+  }
+
+  return Nothing();
+}
+
+
+void Allocator::release(const string& uid)
+{
+  if (!leases.contains(uid)) {
+    return;
+  }
+
+  foreach (uint32_t address, leases.at(uid)) {
+    find(address)->release(address);
+    owners.erase(address);
+  }
+
+  leases.erase(uid);
+}
+
+
+Try<string> Allocator::claimBlock(const string& hostname, size_t size)
+{
+  if (blocks.get() == NULL) {
+    return Error("No block CIDR configured");
+  }
+
+  if (size != (size_t) 1 << (32 - blocks->prefix)) {
+    return Error(
+        "Blocks are /" + stringify(blocks->prefix) + ", not of " +
+        stringify(size) + " addresses");
+  }
+
+  return blocks->claim(hostname);
+}
+
+
+Try<Nothing> Allocator::releaseBlock(const string& block)
+{
+  if (blocks.get() == NULL) {
+    return Error("No block CIDR configured");
+  }
+
+  return blocks->release(block);
+}
+
+
+Range* Allocator::find(uint32_t address)
+{
+  foreach (const Owned<Range>& range, ranges) {
+    if (range->contains(address)) {
+      return range.get();
+    }
+  }
+
+  return NULL;
+}
+
+
+void Allocator::take(const string& uid, uint32_t address)
+{
+  owners[address] = uid;
+  leases[uid].push_back(address);
+}
+
+Try<Owned<Blocks>> Blocks::recover(const string& directory)
+{
+  Try<Nothing> mkdir = os::mkdir(directory);
+  if (mkdir.isError()) {
+    return Error("Failed to create '" + directory + "': " + mkdir.error());
+  }
+
+  Owned<Blocks> blocks(new Blocks(directory));
+
+  const string checkpoint = path::join(directory, BLOCKS_CHECKPOINT);
+  if (!os::exists(checkpoint)) {
+    return blocks;
+  }
+
+  Try<string> read = os::read(checkpoint);
+  if (read.isError()) {
+    return Error("Failed to read '" + checkpoint + "': " + read.error());
+  }
+
+  Try<JSON::Object> object = JSON::parse<JSON::Object>(read.get());
+  if (object.isError()) {
+    return Error("Failed to parse '" + checkpoint + "': " + object.error());
+  }
+
+  foreachpair (const string& block,
+               const JSON::Value& netgroups,
+               object.get().values) {
+    if (!netgroups.is<JSON::String>()) {
+      return Error("Invalid netgroups of block '" + block + "'");
+    }
+
+    Try<Owned<Range>> range = Range::open(block, directory);
+    if (range.isError()) {
+      return Error(range.error());
+    }
+
+    const string& groups = netgroups.as<JSON::String>().value;
+    blocks->ranges[groups].push_back(range.get());
+    blocks->owners[range.get()->cidr] = groups;
+  }
+
+  return blocks;
+}
+
+
+Try<Nothing> Blocks::add(const string& netgroups, const string& block)
+{
+  Try<Owned<Range>> range = Range::open(block, directory);
+  if (range.isError()) {
+    return Error(range.error());
+  }
+
+  const string cidr = range.get()->cidr;
+  ranges[netgroups].push_back(range.get());
+  owners[cidr] = netgroups;
+
+  Try<Nothing> checkpointed = checkpoint();
+  if (checkpointed.isError()) {
+    remove(cidr);
+    return Error(checkpointed.error());
+  }
+
+  return Nothing();
+}
+
+
+Try<Nothing> Blocks::remove(const string& block)
+{
+  if (!owners.contains(block)) {
+    return Nothing();
+  }
+
+  vector<Owned<Range>>& held = ranges[owners.at(block)];
+  for (size_t i = 0; i < held.size(); i++) {
+    if (held[i]->cidr == block) {
+      held.erase(held.begin() + i);
+      break;
+    }
+  }
+
+  if (held.empty()) {
+    ranges.erase(owners.at(block));
+  }
+  owners.erase(block);
+
+  // The range is closed by now, so its state can go.
+  os::rm(path::join(directory, filename(parseCidr(block).get())));
+
+  return checkpoint();
+}
+
+
+Option<vector<string>> Blocks::allocate(const string& netgroups, size_t count)
+{
+  if (!ranges.contains(netgroups)) {
+    return None();
+  }
+
+  vector<std::pair<Range*, uint32_t>> taken;
+  foreach (const Owned<Range>& range, ranges.at(netgroups)) {
+    while (taken.size() < count) {
+      Option<uint32_t> address = range->allocate();
+      if (address.isNone()) {
+        break;
+      }
+      taken.push_back(std::make_pair(range.get(), address.get()));
+    }
+  }
+
+  if (taken.size() < count) {
+    for (size_t i = 0; i < taken.size(); i++) {
+      taken[i].first->release(taken[i].second);
+    }
+    return None();
+  }
+
+  vector<string> addresses;
+  for (size_t i = 0; i < taken.size(); i++) {
+    addresses.push_back(format(taken[i].second));
+  }
+
+  return addresses;
+}
+
+
+Try<vector<string>> Blocks::reserve(const vector<string>& addresses)
+{
+  vector<std::pair<Range*, uint32_t>> taken;
+  vector<string> others;
+  Option<Error> error;
+
+  foreach (const string& address, addresses) {
+    Try<uint32_t> parsed = parseAddress(address);
+    Range* range = parsed.isSome() ? find(parsed.get()) : NULL;
+    if (range == NULL) {
+      others.push_back(address);
+      continue;
+    }
+
+    if (!range->reserve(parsed.get())) {
+      error = Error("'" + address + "' is in use");
+      break;
+    }
+    taken.push_back(std::make_pair(range, parsed.get()));
+  }
+
+  if (error.isSome()) {
+    for (size_t i = 0; i < taken.size(); i++) {
+      taken[i].first->release(taken[i].second);
+    }
+    return error.get();
+  }
+
+  return others;
+}
+
+
+vector<string> Blocks::release(
+    const vector<string>& addresses,
+    vector<string>* emptied)
+{
+  vector<string> others;
+
+  foreach (const string& address, addresses) {
+    Try<uint32_t> parsed = parseAddress(address);
+    Range* range = parsed.isSome() ? find(parsed.get()) : NULL;
+    if (range == NULL) {
+      others.push_back(address);
+      continue;
+    }
+
+    range->release(parsed.get());
+
+    if (range->available() == range->size &&
+        std::find(emptied->begin(), emptied->end(), range->cidr) ==
+          emptied->end()) {
+      emptied->push_back(range->cidr);
+    }
+  }
+
+  return others;
+}
+
+
+size_t Blocks::available(const string& netgroups) const
+{
+  size_t available = 0;
+  if (ranges.contains(netgroups)) {
+    foreach (const Owned<Range>& range, ranges.at(netgroups)) {
+      available += range->available();
+    }
+  }
+
+  return available;
+}
+
+
+bool Blocks::empty(const string& block) const
+{
+  if (!owners.contains(block)) {
+    return false;
+  }
+
+  foreach (const Owned<Range>& range, ranges.at(owners.at(block))) {
+    if (range->cidr == block) {
+      return range->available() == range->size;
+    }
+  }
+
+  return false;
+}
+
+
+Option<string> Blocks::netgroups(const string& block) const
+{
+  if (!owners.contains(block)) {
+    return None();
+  }
+
+  return owners.at(block);
+}
+
+
+Range* Blocks::find(uint32_t address) const
+{
+  foreachvalue (const vector<Owned<Range>>& held, ranges) {
+    foreach (const Owned<Range>& range, held) {
+      if (range->contains(address)) {
+        return range.get();
+      }
+    }
+  }
+
+  return NULL;
+}
+
+
+Try<Nothing> Blocks::checkpoint()
+{
+  JSON::Object object;
+  foreachpair (const string& block, const string& netgroups, owners) {
+    object.values[block] = netgroups;
+  }
+
+  // Written aside and renamed, so that it is never seen half written.
+  const string path = path::join(directory, BLOCKS_CHECKPOINT);
+  Try<Nothing> write = os::write(path + ".tmp", stringify(object));
+  if (write.isError()) {
+    return Error("Failed to write '" + path + "': " + write.error());
+  }
+
+  if (::rename((path + ".tmp").c_str(), path.c_str()) < 0) {
+    return ErrnoError("Failed to rename '" + path + ".tmp'");
+  }
+
+  return Nothing();
+}
+
+} // namespace ipam {
+} // namespace mesos {
@@ -0,0 +1,299 @@
+/**
+ * This file is © 2015 Mesosphere, Inc. ("Mesosphere"). Mesosphere
+ * licenses this file to you solely pursuant to the agreement between
+ * Mesosphere and you (if any).  If there is no such agreement between
+ * Mesosphere, the following terms apply (and you may not use this
+ * file except in compliance with such terms):
+ *
+ * 1) Subject to your compliance with the following terms, Mesosphere
+ * hereby grants you a nonexclusive, limited, personal,
+ * non-sublicensable, non-transferable, royalty-free license to use
+ * this file solely for your internal business purposes.
+ *
+ * 2) You may not (and agree not to, and not to authorize or enable
+ * others to), directly or indirectly:
+ *   (a) copy, distribute, rent, lease, timeshare, operate a service
+ *   bureau, or otherwise use for the benefit of a third party, this
+ *   file; or
+ *
+ *   (b) remove any proprietary notices from this file.  Except as
+ *   expressly set forth herein, as between you and Mesosphere,
+ *   Mesosphere retains all right, title and interest in and to this
+ *   file.
+ *
+ * 3) Unless required by applicable law or otherwise agreed to in
+ * writing, Mesosphere provides this file on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied,
+ * including, without limitation, any warranties or conditions of
+ * TITLE, NON-INFRINGEMENT, MERCHANTABILITY, or FITNESS FOR A
+ * PARTICULAR PURPOSE.
+ *
+ * 4) In no event and under no legal theory, whether in tort
+ * (including negligence), contract, or otherwise, unless required by
+ * applicable law (such as deliberate and grossly negligent acts) or
+ * agreed to in writing, shall Mesosphere be liable to you for
+ * damages, including any direct, indirect, special, incidental, or
+ * consequential damages of any character arising as a result of these
+ * terms or out of the use or inability to use this file (including
+ * but not limited to damages for loss of goodwill, work stoppage,
+ * computer failure or malfunction, or any and all other commercial
+ * damages or losses), even if Mesosphere has been advised of the
+ * possibility of such damages.
+ */
+
+#ifndef __IPAM_HPP__
+#define __IPAM_HPP__
+
+#include <stdint.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <process/owned.hpp>
+
+#include <stout/hashmap.hpp>
+#include <stout/nothing.hpp>
+#include <stout/option.hpp>
+#include <stout/try.hpp>
+
+namespace mesos {
+namespace ipam {
+
+// The IPv4 addresses of a CIDR, minus its network and broadcast
+// addresses, tracked with one bit each in a file mapped into memory.
+// Bits are set before an address is handed out, so the page cache has
+// them should the agent die; a file from before the last boot is
+// started afresh, as no container survives a reboot.
+class Range
+{
+public:
+  // Opens, creating it if needed, the state of 'cidr' in 'directory'.
+  // The file is locked for as long as the range is open.
+  static Try<process::Owned<Range>> open(
+      const std::string& cidr,
+      const std::string& directory);
+
+  ~Range();
+
+  bool contains(uint32_t address) const
+  {
+    return address >= first && address - first < size;
+  }
+
+  // Takes the free address that has been free the longest, if any.
+  Option<uint32_t> allocate();
+
+  // Takes 'address' unless it is in use already.
+  bool reserve(uint32_t address);
+
+  void release(uint32_t address);
+
+  // How many addresses are free.
+  size_t available() const
+  {
+    return unused;
+  }
+
+  const std::string cidr;
+  const uint32_t first;
+  const uint32_t size;
+
+private:
+  Range(
+      const std::string& cidr,
+      uint32_t first,
+      uint32_t size,
+      int fd,
+      uint8_t* map,
+      size_t length);
+
+  Range(const Range&) = delete;
+  Range& operator=(const Range&) = delete;
+
+  bool used(uint32_t offset) const
+  {
+    return bitmap[offset / 8] & (1 << (offset % 8));
+  }
+
+  const int fd;
+  uint8_t* const map;
+  const size_t length;
+  uint8_t* const bitmap;
+
+  // Offsets to hand out, oldest release first. An offset reserved since
+  // it was queued stays queued and is skipped once it comes up.
+  std::deque<uint32_t> free;
+  std::vector<bool> queued;
+  size_t unused;
+};
+
+
+// The blocks of a CIDR, each recorded with the hostname of the agent
+// that claimed it, in a file that several agents may share in place of
+// the datastore of a shared IPAM. The file is locked while it changes.
+class BlockStore
+{
+public:
+  static Try<process::Owned<BlockStore>> open(
+      const std::string& cidr,
+      int prefix,
+      const std::string& directory);
+
+  ~BlockStore();
+
+  // Claims a free block for 'hostname' and returns its CIDR.
+  Try<std::string> claim(const std::string& hostname);
+
+  Try<Nothing> release(const std::string& block);
+
+  const int prefix;
+
+private:
+  BlockStore(
+      uint32_t network,
+      int prefix,
+      size_t count,
+      int fd,
+      char* map,
+      size_t length);
+
+  BlockStore(const BlockStore&) = delete;
+  BlockStore& operator=(const BlockStore&) = delete;
+
+  // The hostname a block is claimed for, empty if free.
+  char* entry(size_t index);
+
+  const uint32_t network;
+  const size_t count;
+  const int fd;
+  char* const map;
+  const size_t length;
+};
+
+
+// An IPAM of the agent's own, handing out addresses from the ranges
+// configured per netgroup, e.g. with the specification
+// "cidr=10.0.0.0/16,cidr.prod=10.1.0.0/24,state=/var/run/ipam".
+// Ranges of the "" netgroup serve requests for no configured netgroup.
+// With "blocks=10.2.0.0/16,block_size=26" it also hands out blocks of
+// a CIDR shared through the state directory.
+class Allocator
+{
+public:
+  static Try<process::Owned<Allocator>> create(const std::string& spec);
+
+  // Allocates 'count' addresses for 'uid' from the ranges of the first
+  // of 'netgroups' that has any, all or none of them.
+  Try<std::vector<std::string>> allocate(
+      const std::string& uid,
+      const std::vector<std::string>& netgroups,
+      size_t count);
+
+  // Takes 'addresses' for 'uid', all or none of them. Addresses outside
+  // of every range are not ours to track and are just accepted.
+  Try<Nothing> reserve(
+      const std::string& uid,
+      const std::vector<std::string>& addresses);
+
+  // Releases 'addresses', whichever uid they were taken for.
+  Try<Nothing> release(const std::vector<std::string>& addresses);
+
+  // Releases the addresses taken for 'uid' since the agent started.
+  void release(const std::string& uid);
+
+  // Claims a block of 'size' addresses for the agent on 'hostname' and
+  // returns its CIDR.
+  Try<std::string> claimBlock(const std::string& hostname, size_t size);
+
+  Try<Nothing> releaseBlock(const std::string& block);
+
+private:
+  Allocator() {}
+
+  Allocator(const Allocator&) = delete;
+  Allocator& operator=(const Allocator&) = delete;
+
+  Range* find(uint32_t address);
+
+  void take(const std::string& uid, uint32_t address);
+
+  std::vector<process::Owned<Range>> ranges;
+  hashmap<std::string, std::vector<Range*>> netgroups;
+
+  // Which uid each address in use was taken for, and the other way
+  // around.
+  hashmap<uint32_t, std::string> owners;
+  hashmap<std::string, std::vector<uint32_t>> leases;
+
+  process::Owned<BlockStore> blocks;
+};
+
+
+// The address blocks an agent has claimed, by the netgroups they were
+// claimed for, handing out their addresses locally. Which blocks are
+// held is recorded in 'directory' along with the state of each.
+class Blocks
+{
+public:
+  static Try<process::Owned<Blocks>> recover(const std::string& directory);
+
+  // Starts handing out the addresses of 'block' for 'netgroups'.
+  Try<Nothing> add(const std::string& netgroups, const std::string& block);
+
+  // Stops handing out the addresses of 'block', forgetting about it.
+  Try<Nothing> remove(const std::string& block);
+
+  // Takes 'count' addresses from the blocks for 'netgroups', all or
+  // none of them.
+  Option<std::vector<std::string>> allocate(
+      const std::string& netgroups,
+      size_t count);
+
+  // Takes those of 'addresses' that are in a block, all or none of
+  // them, and returns the others.
+  Try<std::vector<std::string>> reserve(
+      const std::vector<std::string>& addresses);
+
+  // Releases those of 'addresses' that are in a block and returns the
+  // others. Blocks left with no address in use end up in 'emptied'.
+  std::vector<std::string> release(
+      const std::vector<std::string>& addresses,
+      std::vector<std::string>* emptied);
+
+  // How many addresses the blocks for 'netgroups' have free.
+  size_t available(const std::string& netgroups) const;
+
+  // Whether 'block' is held and has no address in use.
+  bool empty(const std::string& block) const;
+
+  // The netgroups 'block' was claimed for, if held.
+  Option<std::string> netgroups(const std::string& block) const;
+
+  size_t size() const
+  {
+    return owners.size();
+  }
+
+private:
+  explicit Blocks(const std::string& directory_) : directory(directory_) {}
+
+  Blocks(const Blocks&) = delete;
+  Blocks& operator=(const Blocks&) = delete;
+
+  Range* find(uint32_t address) const;
+
+  Try<Nothing> checkpoint();
+
+  const std::string directory;
+
+  hashmap<std::string, std::vector<process::Owned<Range>>> ranges;
+
+  // The netgroups of each block.
+  hashmap<std::string, std::string> owners;
+};
+
+} // namespace ipam {
+} // namespace mesos {
+
+#endif // #ifdef __IPAM_HPP__
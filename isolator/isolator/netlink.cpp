@@ -0,0 +1,1658 @@
+/**
+ * This file is © 2015 Mesosphere, Inc. ("Mesosphere"). Mesosphere
+ * licenses this file to you solely pursuant to the agreement between
+ * Mesosphere and you (if any).  If there is no such agreement between
+ * Mesosphere, the following terms apply (and you may not use this
+ * file except in compliance with such terms):
+ *
+ * 1) Subject to your compliance with the following terms, Mesosphere
+ * hereby grants you a nonexclusive, limited, personal,
+ * non-sublicensable, non-transferable, royalty-free license to use
+ * this file solely for your internal business purposes.
+ *
+ * 2) You may not (and agree not to, and not to authorize or enable
+ * others to), directly or indirectly:
+ *   (a) copy, distribute, rent, lease, timeshare, operate a service
+ *   bureau, or otherwise use for the benefit of a third party, this
+ *   file; or
+ *
+ *   (b) remove any proprietary notices from this file.  Except as
+ *   expressly set forth herein, as between you and Mesosphere,
+ *   Mesosphere retains all right, title and interest in and to this
+ *   file.
+ *
+ * 3) Unless required by applicable law or otherwise agreed to in
+ * writing, Mesosphere provides this file on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied,
+ * including, without limitation, any warranties or conditions of
+ * TITLE, NON-INFRINGEMENT, MERCHANTABILITY, or FITNESS FOR A
+ * PARTICULAR PURPOSE.
+ *
+ * 4) In no event and under no legal theory, whether in tort
+ * (including negligence), contract, or otherwise, unless required by
+ * applicable law (such as deliberate and grossly negligent acts) or
+ * agreed to in writing, shall Mesosphere be liable to you for
+ * damages, including any direct, indirect, special, incidental, or
+ * consequential damages of any character arising as a result of these
+ * terms or out of the use or inability to use this file (including
+ * but not limited to damages for loss of goodwill, work stoppage,
+ * computer failure or malfunction, or any and all other commercial
+ * damages or losses), even if Mesosphere has been advised of the
+ * possibility of such damages.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+
+#include <linux/if_ether.h>
+#include <linux/pkt_cls.h>
+#include <linux/pkt_sched.h>
+#include <linux/veth.h>
+
+#include <net/if.h>
+#include <net/if_arp.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+
+#include <algorithm>
+
+#include <stout/check.hpp>
+#include <stout/error.hpp>
+#include <stout/foreach.hpp>
+#include <stout/hashmap.hpp>
+#include <stout/os.hpp>
+#include <stout/stringify.hpp>
+
+#include "netlink.hpp"
+
+using process::Owned;
+
+using std::pair;
+using std::string;
+using std::vector;
+
+namespace mesos {
+namespace netlink {
+
+// Large enough for a page worth of dump messages.
+static const size_t RECEIVE_BUFFER_SIZE = 32 * 1024;
+
+// Requests sent with one sendmsg(2). The kernel takes no more than the
+// socket send buffer at once, and drops replies that do not fit in the
+// receive buffer, a few KB each for links, rather than block.
+static const size_t BATCH_SIZE = 64 * 1024;
+static const size_t BATCH_MESSAGES = 32;
+
+// The container side of the built-in virtualizer.
+static const char CONTAINER_LINK[] = "eth0";
+static const char GATEWAY[] = "169.254.1.1";
+
+// Traffic is let through in bursts of up to 20ms worth at the limited
+// rate, but no less than a full size TSO packet, and up to 50ms more
+// worth is queued.
+static const uint64_t SHAPING_BURSTS_PER_SECOND = 50;
+static const uint64_t SHAPING_MIN_BURST = 64 * 1024;
+static const uint64_t SHAPING_QUEUES_PER_SECOND = 20;
+
+// The packet scheduler counts time in units of 64ns (PSCHED_SHIFT), and
+// rate tables describe packets of up to this many bytes.
+static const uint64_t PSCHED_TICK_NS = 64;
+static const unsigned int RATE_TABLE_MTU = 2047;
+
+// The handle of the prio qdisc installed by prioritize(), and the
+// priority of the u32 filters attached to it.
+static const uint32_t PRIO_HANDLE = TC_H_MAKE(0x10 << 16, 0);
+static const uint32_t FILTER_PRIORITY = 10;
+
+// The hash table u32 creates for its filters of a priority; filter
+// handles are nodes in it.
+static const uint32_t U32_ROOT_TABLE = 0x800;
+
+// The ingress qdisc of a host veth, where limit() polices what the
+// container sends, with a single filter.
+static const uint32_t INGRESS_HANDLE = TC_H_MAKE(TC_H_INGRESS, 0);
+static const uint32_t POLICER_PRIORITY = 1;
+static const uint32_t POLICER_FILTER = 1;
+
+
+Message::Message(uint16_t type, uint16_t flags, size_t headerSize)
+  : data(NLMSG_SPACE(headerSize), 0)
+{
+  struct nlmsghdr* header = get();
+  header->nlmsg_len = NLMSG_LENGTH(headerSize);
+  header->nlmsg_type = type;
+  header->nlmsg_flags = NLM_F_REQUEST | flags;
+}
+
+
+void Message::append(uint16_t type, const void* value, size_t length)
+{
+  const size_t offset = NLMSG_ALIGN(get()->nlmsg_len);
+  data.resize(offset + RTA_SPACE(length), 0);
+
+  struct rtattr* attribute =
+    reinterpret_cast<struct rtattr*>(data.data() + offset);
+  attribute->rta_type = type;
+  attribute->rta_len = RTA_LENGTH(length);
+  memcpy(RTA_DATA(attribute), value, length);
+
+  get()->nlmsg_len = data.size();
+}
+
+
+void Message::append(uint16_t type, uint32_t value)
+{
+  append(type, &value, sizeof(value));
+}
+
+
+void Message::append(uint16_t type, const string& value)
+{
+  append(type, value.c_str(), value.size() + 1);
+}
+
+
+void Message::nest(uint16_t type, size_t headerSize)
+{
+  const size_t offset = NLMSG_ALIGN(get()->nlmsg_len);
+  data.resize(offset + RTA_SPACE(headerSize), 0);
+
+  reinterpret_cast<struct rtattr*>(data.data() + offset)->rta_type = type;
+  nests.push_back(offset);
+
+  get()->nlmsg_len = data.size();
+}
+
+
+void Message::unnest()
+{
+  const size_t offset = nests.back();
+  nests.pop_back();
+
+  reinterpret_cast<struct rtattr*>(data.data() + offset)->rta_len =
+    data.size() - offset;
+}
+
+
+// Moves the calling thread into the network namespace 'netns' and
+// returns the one it was in, for leave().
+static Try<int> enter(const string& netns)
+{
+  // setns(2) only moves the calling thread, so this is where we return.
+  const string self =
+    "/proc/self/task/" + stringify(::syscall(SYS_gettid)) + "/ns/net";
+
+  int original = ::open(self.c_str(), O_RDONLY | O_CLOEXEC);
+  if (original < 0) {
+    return ErrnoError("Failed to open '" + self + "'");
+  }
+
+  int target = ::open(netns.c_str(), O_RDONLY | O_CLOEXEC);
+  if (target < 0) {
+    ErrnoError error("Failed to open '" + netns + "'");
+    os::close(original);
+    return error;
+  }
+
+  if (::setns(target, CLONE_NEWNET) < 0) {
+    ErrnoError error("Failed to enter '" + netns + "'");
+    os::close(target);
+    os::close(original);
+    return error;
+  }
+
+  os::close(target);
+  return original;
+}
+
+
+static void leave(int original)
+{
+  // Whatever libprocess runs next on this thread expects the agent's
+  // namespace; there is no sane way to carry on without it.
+  if (::setns(original, CLONE_NEWNET) < 0) {
+    PLOG(FATAL) << "Failed to return to the original network namespace";
+  }
+  os::close(original);
+}
+
+
+Try<Owned<Socket>> Socket::open(const Option<string>& netns)
+{
+  int original = -1;
+
+  if (netns.isSome()) {
+    Try<int> entered = enter(netns.get());
+    if (entered.isError()) {
+      return Error(entered.error());
+    }
+    original = entered.get();
+  }
+
+  int fd = ::socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+  int error = errno;
+
+  if (netns.isSome()) {
+    leave(original);
+  }
+
+  if (fd < 0) {
+    errno = error;
+    return ErrnoError("Failed to create netlink socket");
+  }
+
+#ifdef NETLINK_CAP_ACK
+  // Keep failure acknowledgements from echoing the whole request.
+  int enable = 1;
+  ::setsockopt(fd, SOL_NETLINK, NETLINK_CAP_ACK, &enable, sizeof(enable));
+#endif
+
+  return Owned<Socket>(new Socket(fd));
+}
+
+
+Socket::Socket(int fd_)
+  : fd(fd_),
+    seq(0) {}
+
+
+Socket::~Socket()
+{
+  os::close(fd);
+}
+
+
+Try<Nothing> Socket::request(Message& message)
+{
+  Try<vector<int>> errors = transact(vector<Message*>(1, &message));
+  if (errors.isError()) {
+    return Error(errors.error());
+  } else if (errors.get().front() != 0) {
+    errno = errors.get().front();
+    return ErrnoError("Netlink request failed");
+  }
+
+  return Nothing();
+}
+
+
+Try<string> Socket::query(Message& message)
+{
+  vector<string> replies;
+  Try<vector<int>> errors =
+    transact(vector<Message*>(1, &message), &replies);
+  if (errors.isError()) {
+    return Error(errors.error());
+  } else if (errors.get().front() != 0) {
+    errno = errors.get().front();
+    return ErrnoError("Netlink request failed");
+  } else if (replies.front().empty()) {
+    return Error("No reply to netlink request");
+  }
+
+  return replies.front();
+}
+
+
+Try<vector<int>> Socket::transact(
+    const vector<Message*>& messages,
+    vector<string>* replies)
+{
+  vector<int> errors(messages.size(), 0);
+  if (replies != NULL) {
+    replies->assign(messages.size(), string());
+  }
+
+  size_t sent = 0;
+  while (sent < messages.size()) {
+    // The kernel works through the messages of a send one at a time and
+    // acknowledges each, carrying on past failures.
+    vector<struct iovec> batch;
+    size_t size = 0;
+    const uint32_t first = seq + 1;
+
+    for (size_t i = sent; i < messages.size(); i++) {
+      struct nlmsghdr* header = messages[i]->get();
+      if (!batch.empty() &&
+          (size + header->nlmsg_len > BATCH_SIZE ||
+           batch.size() == BATCH_MESSAGES)) {
+        break;
+      }
+
+      header->nlmsg_flags |= NLM_F_ACK;
+      header->nlmsg_seq = ++seq;
+
+      struct iovec iov;
+      iov.iov_base = header;
+      iov.iov_len = header->nlmsg_len;
+      batch.push_back(iov);
+      size += header->nlmsg_len;
+    }
+
+    struct sockaddr_nl kernel;
+    memset(&kernel, 0, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_name = &kernel;
+    message.msg_namelen = sizeof(kernel);
+    message.msg_iov = batch.data();
+    message.msg_iovlen = batch.size();
+
+    if (::sendmsg(fd, &message, 0) < 0) {
+      return ErrnoError("Failed to send netlink requests");
+    }
+
+    Try<Nothing> acknowledged = acknowledge(
+        first,
+        batch.size(),
+        errors.data() + sent,
+        replies != NULL ? replies->data() + sent : NULL);
+    if (acknowledged.isError()) {
+      return Error(acknowledged.error());
+    }
+
+    sent += batch.size();
+  }
+
+  return errors;
+}
+
+
+Try<Nothing> Socket::acknowledge(
+    uint32_t first,
+    size_t count,
+    int* errors,
+    string* replies)
+{
+  vector<char> buffer(RECEIVE_BUFFER_SIZE);
+
+  size_t pending = count;
+  while (pending > 0) {
+    int length = ::recv(fd, buffer.data(), buffer.size(), 0);
+    if (length < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return ErrnoError("Failed to receive netlink reply");
+    }
+
+    for (struct nlmsghdr* header =
+           reinterpret_cast<struct nlmsghdr*>(buffer.data());
+         NLMSG_OK(header, length);
+         header = NLMSG_NEXT(header, length)) {
+      const uint32_t index = header->nlmsg_seq - first;
+
+      // Replies to an earlier request that was given up on.
+      if (header->nlmsg_seq < first || index >= count) {
+        continue;
+      }
+
+      if (header->nlmsg_type == NLMSG_ERROR) {
+        // An error of zero is the acknowledgement.
+        errors[index] =
+          -static_cast<const struct nlmsgerr*>(NLMSG_DATA(header))->error;
+        pending--;
+      } else if (replies != NULL) {
+        replies[index] =
+          string(reinterpret_cast<char*>(header), header->nlmsg_len);
+      }
+    }
+  }
+
+  return Nothing();
+}
+
+
+Try<vector<string>> Socket::dump(uint16_t type, unsigned char family)
+{
+  Message message(type, NLM_F_DUMP, sizeof(struct rtgenmsg));
+  message.header<struct rtgenmsg>()->rtgen_family = family;
+  return dump(message);
+}
+
+
+Try<vector<string>> Socket::dump(Message& message)
+{
+  struct nlmsghdr* header = message.get();
+  header->nlmsg_seq = ++seq;
+
+  if (::send(fd, header, header->nlmsg_len, 0) < 0) {
+    return ErrnoError("Failed to send netlink dump request");
+  }
+
+  vector<string> messages;
+  Try<Nothing> received = receive(header->nlmsg_seq, &messages);
+  if (received.isError()) {
+    return Error(received.error());
+  }
+
+  return messages;
+}
+
+
+Try<Nothing> Socket::receive(uint32_t seq, vector<string>* messages)
+{
+  vector<char> buffer(RECEIVE_BUFFER_SIZE);
+
+  while (true) {
+    int length = ::recv(fd, buffer.data(), buffer.size(), 0);
+    if (length < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return ErrnoError("Failed to receive netlink reply");
+    }
+
+    for (struct nlmsghdr* header =
+           reinterpret_cast<struct nlmsghdr*>(buffer.data());
+         NLMSG_OK(header, length);
+         header = NLMSG_NEXT(header, length)) {
+      // Replies to an earlier request that was given up on.
+      if (header->nlmsg_seq != seq) {
+        continue;
+      }
+
+      if (header->nlmsg_type == NLMSG_DONE) {
+        return Nothing();
+      }
+
+      if (header->nlmsg_type == NLMSG_ERROR) {
+        const struct nlmsgerr* error =
+          static_cast<const struct nlmsgerr*>(NLMSG_DATA(header));
+
+        errno = -error->error;
+        return ErrnoError("Netlink dump failed");
+      }
+
+      if (messages != NULL) {
+        messages->push_back(
+            string(reinterpret_cast<char*>(header), header->nlmsg_len));
+      }
+    }
+  }
+}
+
+
+// Returns the attributes in the 'length' bytes at 'data'.
+static hashmap<uint16_t, string> attributes(const char* data, int length)
+{
+  const struct rtattr* attribute =
+    reinterpret_cast<const struct rtattr*>(data);
+
+  hashmap<uint16_t, string> result;
+  for (; RTA_OK(attribute, length); attribute = RTA_NEXT(attribute, length)) {
+    result[attribute->rta_type] = string(
+        static_cast<const char*>(RTA_DATA(attribute)),
+        RTA_PAYLOAD(attribute));
+  }
+  return result;
+}
+
+
+// Returns the attributes of 'message' following a family header of
+// 'headerSize' bytes.
+static hashmap<uint16_t, string> attributes(
+    const string& message,
+    size_t headerSize)
+{
+  const struct nlmsghdr* header =
+    reinterpret_cast<const struct nlmsghdr*>(message.data());
+
+  return attributes(
+      static_cast<const char*>(NLMSG_DATA(header)) + NLMSG_ALIGN(headerSize),
+      static_cast<int>(header->nlmsg_len - NLMSG_LENGTH(headerSize)));
+}
+
+
+// Returns the attributes nested in 'attribute'.
+static hashmap<uint16_t, string> attributes(const string& attribute)
+{
+  return attributes(attribute.data(), static_cast<int>(attribute.size()));
+}
+
+
+template <typename T>
+static const T* header(const string& message)
+{
+  return static_cast<const T*>(NLMSG_DATA(
+      reinterpret_cast<const struct nlmsghdr*>(message.data())));
+}
+
+
+static void copy(
+    const hashmap<uint16_t, string>& from,
+    uint16_t type,
+    Message* to)
+{
+  if (from.contains(type)) {
+    const string& value = from.at(type);
+    to->append(type, value.data(), value.size());
+  }
+}
+
+
+// Requests of one or more containers sent together, remembering which
+// container each is for.
+class Batch
+{
+public:
+  explicit Batch(size_t containers) : failures(containers) {}
+
+  // Returns where the reply to 'message' will be in 'replies'.
+  size_t add(size_t container, const string& what, const Message& message)
+  {
+    messages.push_back(message);
+    owners.push_back(container);
+    descriptions.push_back(what);
+    return messages.size() - 1;
+  }
+
+  // Sends the requests and records the first failure of each container;
+  // the replies to queries end up in 'replies'.
+  void send(Socket* socket)
+  {
+    vector<Message*> pointers;
+    foreach (Message& message, messages) {
+      pointers.push_back(&message);
+    }
+
+    Try<vector<int>> errors = socket->transact(pointers, &replies);
+    for (size_t i = 0; i < messages.size(); i++) {
+      if (errors.isError()) {
+        fail(owners[i], errors.error());
+      } else if (errors.get()[i] != 0) {
+        fail(owners[i],
+             "Failed to " + descriptions[i] + ": " +
+             ::strerror(errors.get()[i]));
+      }
+    }
+
+    messages.clear();
+    owners.clear();
+    descriptions.clear();
+  }
+
+  void fail(size_t container, const string& message)
+  {
+    if (failures[container].isNone()) {
+      failures[container] = message;
+    }
+  }
+
+  bool failed(size_t container) const
+  {
+    return failures[container].isSome();
+  }
+
+  vector<Option<string>> failures;
+  vector<string> replies;
+
+private:
+  vector<Message> messages;
+  vector<size_t> owners;
+  vector<string> descriptions;
+};
+
+
+static Message linkUp(int index)
+{
+  Message message(RTM_NEWLINK, 0, sizeof(struct ifinfomsg));
+  struct ifinfomsg* link = message.header<struct ifinfomsg>();
+  link->ifi_family = AF_UNSPEC;
+  link->ifi_index = index;
+  link->ifi_flags = IFF_UP;
+  link->ifi_change = IFF_UP;
+  return message;
+}
+
+
+static Message linkUp(const string& name)
+{
+  Message message = linkUp(0);
+  message.append(IFLA_IFNAME, name);
+  return message;
+}
+
+
+static Message getLink(const string& name)
+{
+  Message message(RTM_GETLINK, 0, sizeof(struct ifinfomsg));
+  message.header<struct ifinfomsg>()->ifi_family = AF_UNSPEC;
+  message.append(IFLA_IFNAME, name);
+  return message;
+}
+
+
+static Message newAddress(int index, const struct in_addr& address)
+{
+  Message message(
+      RTM_NEWADDR, NLM_F_CREATE | NLM_F_REPLACE, sizeof(struct ifaddrmsg));
+  struct ifaddrmsg* header = message.header<struct ifaddrmsg>();
+  header->ifa_family = AF_INET;
+  header->ifa_prefixlen = 32;
+  header->ifa_scope = RT_SCOPE_UNIVERSE;
+  header->ifa_index = index;
+
+  message.append(IFA_LOCAL, &address, sizeof(address));
+  message.append(IFA_ADDRESS, &address, sizeof(address));
+  return message;
+}
+
+
+// A route to 'destination', a /32 or the default route if none, through
+// link 'index' and 'gateway' if given.
+static Message newRoute(
+    int index,
+    const Option<struct in_addr>& destination,
+    const Option<struct in_addr>& gateway)
+{
+  Message message(
+      RTM_NEWROUTE, NLM_F_CREATE | NLM_F_REPLACE, sizeof(struct rtmsg));
+  struct rtmsg* header = message.header<struct rtmsg>();
+  header->rtm_family = AF_INET;
+  header->rtm_table = RT_TABLE_MAIN;
+  header->rtm_protocol = RTPROT_STATIC;
+  header->rtm_type = RTN_UNICAST;
+  header->rtm_scope = gateway.isSome() ? RT_SCOPE_UNIVERSE : RT_SCOPE_LINK;
+
+  if (destination.isSome()) {
+    header->rtm_dst_len = 32;
+    message.append(RTA_DST, &destination.get(), sizeof(struct in_addr));
+  }
+  if (gateway.isSome()) {
+    message.append(RTA_GATEWAY, &gateway.get(), sizeof(struct in_addr));
+  }
+  message.append(RTA_OIF, (uint32_t) index);
+  return message;
+}
+
+
+static Message newVeth(const string& link, const string& peer, pid_t pid)
+{
+  Message message(
+      RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL, sizeof(struct ifinfomsg));
+  message.header<struct ifinfomsg>()->ifi_family = AF_UNSPEC;
+  message.append(IFLA_IFNAME, link);
+
+  message.nest(IFLA_LINKINFO);
+  message.append(IFLA_INFO_KIND, string("veth"));
+  message.nest(IFLA_INFO_DATA);
+  message.nest(VETH_INFO_PEER, sizeof(struct ifinfomsg));
+  message.append(IFLA_IFNAME, peer);
+  message.append(IFLA_NET_NS_PID, (uint32_t) pid);
+  message.unnest();
+  message.unnest();
+  message.unnest();
+  return message;
+}
+
+
+static Message delLink(const string& name)
+{
+  Message message(RTM_DELLINK, 0, sizeof(struct ifinfomsg));
+  message.header<struct ifinfomsg>()->ifi_family = AF_UNSPEC;
+  message.append(IFLA_IFNAME, name);
+  return message;
+}
+
+
+// The index of 'link' in the namespace of 'socket'.
+static Try<int> linkIndex(Socket* socket, const string& link)
+{
+  Message lookup = getLink(link);
+  Try<string> reply = socket->query(lookup);
+  if (reply.isError()) {
+    return Error("Failed to look up '" + link + "': " + reply.error());
+  }
+
+  return header<struct ifinfomsg>(reply.get())->ifi_index;
+}
+
+
+// The time sending 'bytes' takes at 'rate' bytes per second, in packet
+// scheduler ticks.
+static uint32_t ticks(uint64_t bytes, uint64_t rate)
+{
+  return std::min<uint64_t>(
+      bytes * 1000000000ULL / rate / PSCHED_TICK_NS, UINT32_MAX);
+}
+
+
+// The bytes let through at once when limiting to 'rate'.
+static uint64_t burst(uint64_t rate)
+{
+  return std::max(rate / SHAPING_BURSTS_PER_SECOND, SHAPING_MIN_BURST);
+}
+
+
+// Fills in 'spec' and the rate 'table' for 'rate' bytes per second, as
+// tc(8) does. Older kernels insist on a rate table, newer ones ignore
+// it.
+static void rateTable(
+    uint64_t rate,
+    struct tc_ratespec* spec,
+    uint32_t table[256])
+{
+  spec->rate = rate;
+  spec->cell_align = -1;
+  while ((RATE_TABLE_MTU >> spec->cell_log) > 255) {
+    spec->cell_log++;
+  }
+
+  for (size_t i = 0; i < 256; i++) {
+    table[i] = ticks((i + 1) << spec->cell_log, rate);
+  }
+}
+
+
+// A token bucket filter as the root qdisc of link 'index', sending at
+// most 'rate' bytes per second.
+static Message newTbf(int index, uint64_t rate)
+{
+  Message message(
+      RTM_NEWQDISC, NLM_F_CREATE | NLM_F_REPLACE, sizeof(struct tcmsg));
+  struct tcmsg* header = message.header<struct tcmsg>();
+  header->tcm_family = AF_UNSPEC;
+  header->tcm_ifindex = index;
+  header->tcm_handle = TC_H_MAKE(1 << 16, 0);
+  header->tcm_parent = TC_H_ROOT;
+
+  message.append(TCA_KIND, string("tbf"));
+
+  // The rate of a tc_ratespec is 32 bits, some 34Gbit/s.
+  rate = std::min<uint64_t>(rate, UINT32_MAX);
+
+  struct tc_tbf_qopt options;
+  memset(&options, 0, sizeof(options));
+  uint32_t table[256];
+  rateTable(rate, &options.rate, table);
+  options.buffer = ticks(burst(rate), rate);
+  options.limit = std::min<uint64_t>(
+      burst(rate) + rate / SHAPING_QUEUES_PER_SECOND, UINT32_MAX);
+
+  message.nest(TCA_OPTIONS);
+  message.append(TCA_TBF_PARMS, &options, sizeof(options));
+  message.append(TCA_TBF_RTAB, table, sizeof(table));
+  message.unnest();
+  return message;
+}
+
+
+// The ingress qdisc of link 'index', for filters on what it receives.
+static Message newIngress(int index)
+{
+  Message message(
+      RTM_NEWQDISC, NLM_F_CREATE | NLM_F_REPLACE, sizeof(struct tcmsg));
+  struct tcmsg* header = message.header<struct tcmsg>();
+  header->tcm_family = AF_UNSPEC;
+  header->tcm_ifindex = index;
+  header->tcm_handle = INGRESS_HANDLE;
+  header->tcm_parent = TC_H_INGRESS;
+
+  message.append(TCA_KIND, string("ingress"));
+  return message;
+}
+
+
+// A u32 filter on the ingress qdisc of link 'index' matching all
+// packets, with a policer dropping those beyond 'rate' bytes per second.
+static Message newPolicer(int index, uint64_t rate)
+{
+  Message message(
+      RTM_NEWTFILTER, NLM_F_CREATE | NLM_F_REPLACE, sizeof(struct tcmsg));
+  struct tcmsg* header = message.header<struct tcmsg>();
+  header->tcm_family = AF_UNSPEC;
+  header->tcm_ifindex = index;
+  header->tcm_parent = INGRESS_HANDLE;
+  header->tcm_handle = (U32_ROOT_TABLE << 20) | POLICER_FILTER;
+  header->tcm_info = TC_H_MAKE(POLICER_PRIORITY << 16, htons(ETH_P_ALL));
+
+  message.append(TCA_KIND, string("u32"));
+
+  rate = std::min<uint64_t>(rate, UINT32_MAX);
+
+  // A key with an empty mask, which every packet matches.
+  char match[sizeof(struct tc_u32_sel) + sizeof(struct tc_u32_key)];
+  memset(match, 0, sizeof(match));
+
+  struct tc_u32_sel* selector = reinterpret_cast<struct tc_u32_sel*>(match);
+  selector->flags = TC_U32_TERMINAL;
+  selector->nkeys = 1;
+
+  // Packets of any size, GSO ones included, pass while there are tokens
+  // for them; the burst is at least that of a full size one.
+  struct tc_police police;
+  memset(&police, 0, sizeof(police));
+  uint32_t table[256];
+  rateTable(rate, &police.rate, table);
+  police.action = TC_ACT_SHOT;
+  police.burst = ticks(burst(rate), rate);
+  police.mtu = UINT32_MAX;
+
+  message.nest(TCA_OPTIONS);
+  message.append(TCA_U32_SEL, match, sizeof(match));
+  message.nest(TCA_U32_ACT);
+  message.nest(1);
+  message.append(TCA_ACT_KIND, string("police"));
+  message.nest(TCA_ACT_OPTIONS);
+  message.append(TCA_POLICE_TBF, &police, sizeof(police));
+  message.append(TCA_POLICE_RATE, table, sizeof(table));
+  message.unnest();
+  message.unnest();
+  message.unnest();
+  message.unnest();
+  return message;
+}
+
+
+// Brings back the default root qdisc of link 'index'.
+static Message delRootQdisc(int index)
+{
+  Message message(RTM_DELQDISC, 0, sizeof(struct tcmsg));
+  struct tcmsg* header = message.header<struct tcmsg>();
+  header->tcm_family = AF_UNSPEC;
+  header->tcm_ifindex = index;
+  header->tcm_parent = TC_H_ROOT;
+  return message;
+}
+
+
+// Removes the ingress qdisc of link 'index', with its filters.
+static Message delIngress(int index)
+{
+  Message message(RTM_DELQDISC, 0, sizeof(struct tcmsg));
+  struct tcmsg* header = message.header<struct tcmsg>();
+  header->tcm_family = AF_UNSPEC;
+  header->tcm_ifindex = index;
+  header->tcm_handle = INGRESS_HANDLE;
+  header->tcm_parent = TC_H_INGRESS;
+  return message;
+}
+
+
+// Limits what 'link' sends to 'rate' bytes per second, or lifts the limit.
+static Try<Nothing> shape(
+    Socket* socket,
+    const string& link,
+    const Option<uint64_t>& rate)
+{
+  Try<int> index = linkIndex(socket, link);
+  if (index.isError()) {
+    return Error(index.error());
+  }
+
+  if (rate.isSome()) {
+    Message message = newTbf(index.get(), rate.get());
+    Try<Nothing> result = socket->request(message);
+    if (result.isError()) {
+      return Error("Failed to shape '" + link + "': " + result.error());
+    }
+    return Nothing();
+  }
+
+  // Fails if there is no limit in the first place.
+  Message message = delRootQdisc(index.get());
+  Try<Nothing> result = socket->request(message);
+  if (result.isError() && errno != ENOENT && errno != EINVAL) {
+    return Error(
+        "Failed to remove the limit of '" + link + "': " + result.error());
+  }
+
+  return Nothing();
+}
+
+
+// Drops what 'link' receives beyond 'rate' bytes per second, or lifts
+// the limit.
+static Try<Nothing> police(
+    Socket* socket,
+    const string& link,
+    const Option<uint64_t>& rate)
+{
+  Try<int> index = linkIndex(socket, link);
+  if (index.isError()) {
+    return Error(index.error());
+  }
+
+  if (rate.isSome()) {
+    // Adding the qdisc again leaves it, and the filter, as they are;
+    // the filter is then replaced in place.
+    Message ingress = newIngress(index.get());
+    Message policer = newPolicer(index.get(), rate.get());
+
+    Try<Nothing> result = socket->request(ingress);
+    if (result.isSome()) {
+      result = socket->request(policer);
+    }
+
+    if (result.isError()) {
+      return Error("Failed to police '" + link + "': " + result.error());
+    }
+    return Nothing();
+  }
+
+  Message message = delIngress(index.get());
+  Try<Nothing> result = socket->request(message);
+  if (result.isError() && errno != ENOENT && errno != EINVAL) {
+    return Error(
+        "Failed to remove the policer of '" + link + "': " + result.error());
+  }
+
+  return Nothing();
+}
+
+
+// A u32 filter of the prio qdisc on link 'index' sending IPv4 packets
+// from 'address' to 'band', under node 'id' of the root hash table.
+static Message newFilter(
+    int index,
+    uint32_t id,
+    const struct in_addr& address,
+    uint32_t band)
+{
+  Message message(
+      RTM_NEWTFILTER, NLM_F_CREATE | NLM_F_REPLACE, sizeof(struct tcmsg));
+  struct tcmsg* header = message.header<struct tcmsg>();
+  header->tcm_family = AF_UNSPEC;
+  header->tcm_ifindex = index;
+  header->tcm_parent = PRIO_HANDLE;
+  header->tcm_handle = (U32_ROOT_TABLE << 20) | id;
+  header->tcm_info = TC_H_MAKE(FILTER_PRIORITY << 16, htons(ETH_P_IP));
+
+  message.append(TCA_KIND, string("u32"));
+
+  // A selector with a single key, matching the source address 12 bytes
+  // into the header.
+  char match[sizeof(struct tc_u32_sel) + sizeof(struct tc_u32_key)];
+  memset(match, 0, sizeof(match));
+
+  struct tc_u32_sel* selector = reinterpret_cast<struct tc_u32_sel*>(match);
+  selector->flags = TC_U32_TERMINAL;
+  selector->nkeys = 1;
+
+  struct tc_u32_key* key =
+    reinterpret_cast<struct tc_u32_key*>(match + sizeof(struct tc_u32_sel));
+  key->mask = 0xffffffff;
+  key->val = address.s_addr;
+  key->off = 12;
+
+  message.nest(TCA_OPTIONS);
+  message.append(TCA_U32_CLASSID, TC_H_MAKE(PRIO_HANDLE, band));
+  message.append(TCA_U32_SEL, match, sizeof(match));
+  message.unnest();
+  return message;
+}
+
+
+static Message delFilter(int index, uint32_t id)
+{
+  Message message(RTM_DELTFILTER, 0, sizeof(struct tcmsg));
+  struct tcmsg* header = message.header<struct tcmsg>();
+  header->tcm_family = AF_UNSPEC;
+  header->tcm_ifindex = index;
+  header->tcm_parent = PRIO_HANDLE;
+  header->tcm_handle = (U32_ROOT_TABLE << 20) | id;
+  header->tcm_info = TC_H_MAKE(FILTER_PRIORITY << 16, htons(ETH_P_IP));
+
+  message.append(TCA_KIND, string("u32"));
+  return message;
+}
+
+
+static Try<struct in_addr> parse(const string& address)
+{
+  struct in_addr result;
+  if (::inet_pton(AF_INET, address.c_str(), &result) != 1) {
+    return Error("Invalid IPv4 address '" + address + "'");
+  }
+  return result;
+}
+
+
+Try<Nothing> adopt(const string& netns, pid_t pid)
+{
+  Try<Owned<Socket>> source = Socket::open(netns);
+  if (source.isError()) {
+    return Error(source.error());
+  }
+
+  Try<Owned<Socket>> target =
+    Socket::open("/proc/" + stringify(pid) + "/ns/net");
+  if (target.isError()) {
+    return Error(target.error());
+  }
+
+  Try<vector<string>> links = source.get()->dump(RTM_GETLINK, AF_UNSPEC);
+  if (links.isError()) {
+    return Error("Failed to list links: " + links.error());
+  }
+
+  // Links to move, by index in 'netns'.
+  hashmap<int, string> names;
+  foreach (const string& message, links.get()) {
+    const struct ifinfomsg* link = header<struct ifinfomsg>(message);
+    hashmap<uint16_t, string> values =
+      attributes(message, sizeof(struct ifinfomsg));
+
+    if (link->ifi_type != ARPHRD_LOOPBACK && values.contains(IFLA_IFNAME)) {
+      names[link->ifi_index] = values[IFLA_IFNAME].c_str();
+    }
+  }
+
+  Try<vector<string>> addresses = source.get()->dump(RTM_GETADDR, AF_INET);
+  if (addresses.isError()) {
+    return Error("Failed to list addresses: " + addresses.error());
+  }
+
+  Try<vector<string>> routes = source.get()->dump(RTM_GETROUTE, AF_INET);
+  if (routes.isError()) {
+    return Error("Failed to list routes: " + routes.error());
+  }
+
+  Batch batch(1);
+
+  foreachpair (int index, const string& name, names) {
+    Message message(RTM_NEWLINK, 0, sizeof(struct ifinfomsg));
+    message.header<struct ifinfomsg>()->ifi_family = AF_UNSPEC;
+    message.header<struct ifinfomsg>()->ifi_index = index;
+    message.append(IFLA_NET_NS_PID, (uint32_t) pid);
+
+    batch.add(0, "move link '" + name + "'", message);
+  }
+
+  batch.send(source.get().get());
+  if (batch.failed(0)) {
+    return Error(batch.failures[0].get());
+  }
+
+  // Links may get another index in their new namespace.
+  links = target.get()->dump(RTM_GETLINK, AF_UNSPEC);
+  if (links.isError()) {
+    return Error("Failed to list links: " + links.error());
+  }
+
+  hashmap<string, int> indexes;
+  foreach (const string& message, links.get()) {
+    const struct ifinfomsg* link = header<struct ifinfomsg>(message);
+    hashmap<uint16_t, string> values =
+      attributes(message, sizeof(struct ifinfomsg));
+
+    if (link->ifi_type == ARPHRD_LOOPBACK) {
+      batch.add(0, "set up loopback", linkUp(link->ifi_index));
+    } else if (values.contains(IFLA_IFNAME)) {
+      indexes[values[IFLA_IFNAME].c_str()] = link->ifi_index;
+    }
+  }
+
+  foreachvalue (const string& name, names) {
+    if (!indexes.contains(name)) {
+      return Error("Link '" + name + "' is missing after the move");
+    }
+
+    batch.add(0, "set up '" + name + "'", linkUp(indexes[name]));
+  }
+
+  foreach (const string& address, addresses.get()) {
+    const struct ifaddrmsg* from = header<struct ifaddrmsg>(address);
+    if (!names.contains(from->ifa_index)) {
+      continue;
+    }
+
+    Message message(
+        RTM_NEWADDR, NLM_F_CREATE | NLM_F_REPLACE, sizeof(struct ifaddrmsg));
+    struct ifaddrmsg* to = message.header<struct ifaddrmsg>();
+    *to = *from;
+    to->ifa_index = indexes[names[from->ifa_index]];
+
+    hashmap<uint16_t, string> values =
+      attributes(address, sizeof(struct ifaddrmsg));
+    copy(values, IFA_LOCAL, &message);
+    copy(values, IFA_ADDRESS, &message);
+    copy(values, IFA_BROADCAST, &message);
+
+    batch.add(0, "add address", message);
+  }
+
+  // Routes to a gateway need the link scope route to it in place, and
+  // the kernel creates the routes for the addresses themselves.
+  vector<string> sorted;
+  foreach (const string& route, routes.get()) {
+    const struct rtmsg* from = header<struct rtmsg>(route);
+    if (from->rtm_table == RT_TABLE_MAIN &&
+        from->rtm_protocol != RTPROT_KERNEL) {
+      sorted.push_back(route);
+    }
+  }
+
+  std::stable_sort(
+      sorted.begin(),
+      sorted.end(),
+      [](const string& left, const string& right) {
+        return header<struct rtmsg>(left)->rtm_scope >
+          header<struct rtmsg>(right)->rtm_scope;
+      });
+
+  foreach (const string& route, sorted) {
+    hashmap<uint16_t, string> values =
+      attributes(route, sizeof(struct rtmsg));
+
+    if (!values.contains(RTA_OIF)) {
+      continue;
+    }
+
+    int index = *reinterpret_cast<const uint32_t*>(values[RTA_OIF].data());
+    if (!names.contains(index)) {
+      continue;
+    }
+
+    Message message(
+        RTM_NEWROUTE, NLM_F_CREATE | NLM_F_REPLACE, sizeof(struct rtmsg));
+    struct rtmsg* to = message.header<struct rtmsg>();
+    *to = *header<struct rtmsg>(route);
+
+    // Dumps also report state such as RTNH_F_LINKDOWN, which the kernel
+    // refuses in requests.
+    to->rtm_flags &= RTNH_F_ONLINK;
+
+    copy(values, RTA_DST, &message);
+    copy(values, RTA_GATEWAY, &message);
+    copy(values, RTA_PREFSRC, &message);
+    copy(values, RTA_PRIORITY, &message);
+    message.append(RTA_OIF, (uint32_t) indexes[names[index]]);
+
+    batch.add(0, "add route", message);
+  }
+
+  batch.send(target.get().get());
+  if (batch.failed(0)) {
+    return Error(batch.failures[0].get());
+  }
+
+  return Nothing();
+}
+
+
+vector<Try<Nothing>> plumb(const vector<Plumbing>& containers)
+{
+  Batch batch(containers.size());
+
+  vector<vector<struct in_addr>> addresses(containers.size());
+  for (size_t i = 0; i < containers.size(); i++) {
+    foreach (const string& address, containers[i].addresses) {
+      Try<struct in_addr> parsed = parse(address);
+      if (parsed.isError()) {
+        batch.fail(i, parsed.error());
+      } else {
+        addresses[i].push_back(parsed.get());
+      }
+    }
+  }
+
+  Try<struct in_addr> gateway = parse(GATEWAY);
+  CHECK_SOME(gateway);
+
+  vector<bool> created(containers.size(), false);
+
+  Try<Owned<Socket>> host = Socket::open();
+  if (host.isError()) {
+    for (size_t i = 0; i < containers.size(); i++) {
+      batch.fail(i, host.error());
+    }
+  } else {
+    // Host side, all containers at once: create the links, set them up
+    // and look up their indexes, then route the addresses to them.
+    for (size_t i = 0; i < containers.size(); i++) {
+      if (!batch.failed(i)) {
+        const Plumbing& container = containers[i];
+        batch.add(
+            i,
+            "create veth pair",
+            newVeth(container.link, CONTAINER_LINK, container.pid));
+      }
+    }
+    batch.send(host.get().get());
+
+    vector<Option<size_t>> lookups(containers.size());
+    for (size_t i = 0; i < containers.size(); i++) {
+      if (batch.failed(i)) {
+        continue;
+      }
+
+      created[i] = true;
+
+      // Answer the container's ARP requests for the gateway.
+      const string proxyArp =
+        "/proc/sys/net/ipv4/conf/" + containers[i].link + "/proxy_arp";
+      Try<Nothing> write = os::write(proxyArp, "1");
+      if (write.isError()) {
+        batch.fail(
+            i, "Failed to write '" + proxyArp + "': " + write.error());
+        continue;
+      }
+
+      batch.add(i, "set up '" + containers[i].link + "'",
+                linkUp(containers[i].link));
+      lookups[i] = batch.add(i, "look up '" + containers[i].link + "'",
+                             getLink(containers[i].link));
+    }
+    batch.send(host.get().get());
+
+    for (size_t i = 0; i < containers.size(); i++) {
+      if (batch.failed(i)) {
+        continue;
+      }
+
+      const int index =
+        header<struct ifinfomsg>(batch.replies[lookups[i].get()])->ifi_index;
+      foreach (const struct in_addr& address, addresses[i]) {
+        batch.add(i, "add host route", newRoute(index, address, None()));
+      }
+    }
+    batch.send(host.get().get());
+  }
+
+  // Container side, one namespace at a time.
+  for (size_t i = 0; i < containers.size(); i++) {
+    if (batch.failed(i)) {
+      continue;
+    }
+
+    Try<Owned<Socket>> container =
+      Socket::open("/proc/" + stringify(containers[i].pid) + "/ns/net");
+    if (container.isError()) {
+      batch.fail(i, container.error());
+      continue;
+    }
+
+    // The peer was named, not numbered, on creation.
+    batch.add(i, "look up container link", getLink(CONTAINER_LINK));
+    batch.send(container.get().get());
+    if (batch.failed(i)) {
+      continue;
+    }
+
+    const int index = header<struct ifinfomsg>(batch.replies[0])->ifi_index;
+
+    // A fresh network namespace has its loopback down, at index 1.
+    batch.add(i, "set up loopback", linkUp(1));
+    batch.add(i, "set up container link", linkUp(index));
+    foreach (const struct in_addr& address, addresses[i]) {
+      batch.add(i, "add address", newAddress(index, address));
+    }
+    batch.add(i, "add gateway route", newRoute(index, gateway.get(), None()));
+    batch.add(i, "add default route", newRoute(index, None(), gateway.get()));
+    batch.send(container.get().get());
+  }
+
+  vector<Try<Nothing>> results;
+  for (size_t i = 0; i < containers.size(); i++) {
+    if (!batch.failed(i)) {
+      results.push_back(Nothing());
+      continue;
+    }
+
+    // Leave nothing half done behind.
+    if (created[i]) {
+      unplumb(containers[i].link);
+    }
+    results.push_back(Error(batch.failures[i].get()));
+  }
+
+  return results;
+}
+
+
+Try<Nothing> unplumb(const string& link)
+{
+  Try<Owned<Socket>> host = Socket::open();
+  if (host.isError()) {
+    return Error(host.error());
+  }
+
+  Message message = delLink(link);
+  Try<Nothing> result = host.get()->request(message);
+  if (result.isError() && errno != ENODEV) {
+    return Error("Failed to delete '" + link + "': " + result.error());
+  }
+
+  return Nothing();
+}
+
+
+Try<Nothing> limit(
+    Socket* container,
+    const string& link,
+    const Option<uint64_t>& rate)
+{
+  Try<Owned<Socket>> host = Socket::open();
+  if (host.isError()) {
+    return Error(host.error());
+  }
+
+  // What the host end of the pair sends, the container receives.
+  Try<Nothing> ingress = shape(host.get().get(), link, rate);
+  if (ingress.isError()) {
+    return ingress;
+  }
+
+  // What the container sends is held to the limit on the host, out of
+  // its reach; shaping it in the container as well spares well-behaved
+  // traffic the drops.
+  Try<Nothing> egress = police(host.get().get(), link, rate);
+  if (egress.isError()) {
+    return egress;
+  }
+
+  return shape(container, CONTAINER_LINK, rate);
+}
+
+
+// The filters of the prio qdisc on link 'index' that classify() added,
+// by id, with the source address each matches.
+static Try<hashmap<uint32_t, string>> filters(Socket* socket, int index)
+{
+  Message query(RTM_GETTFILTER, NLM_F_DUMP, sizeof(struct tcmsg));
+  query.header<struct tcmsg>()->tcm_family = AF_UNSPEC;
+  query.header<struct tcmsg>()->tcm_ifindex = index;
+  query.header<struct tcmsg>()->tcm_parent = PRIO_HANDLE;
+
+  Try<vector<string>> dump = socket->dump(query);
+  if (dump.isError()) {
+    return Error(dump.error());
+  }
+
+  hashmap<uint32_t, string> result;
+  foreach (const string& message, dump.get()) {
+    const struct tcmsg* filter = header<struct tcmsg>(message);
+    const uint32_t id = filter->tcm_handle & 0xfff;
+
+    // u32 reports its hash table too, as node 0.
+    if (filter->tcm_ifindex != index ||
+        TC_H_MAJ(filter->tcm_info) != FILTER_PRIORITY << 16 ||
+        filter->tcm_handle != ((U32_ROOT_TABLE << 20) | id) ||
+        id == 0) {
+      continue;
+    }
+
+    hashmap<uint16_t, string> attributes =
+      netlink::attributes(message, sizeof(struct tcmsg));
+    if (!attributes.contains(TCA_OPTIONS)) {
+      continue;
+    }
+
+    attributes = netlink::attributes(attributes.at(TCA_OPTIONS));
+    if (!attributes.contains(TCA_U32_SEL) ||
+        attributes.at(TCA_U32_SEL).size() <
+          sizeof(struct tc_u32_sel) + sizeof(struct tc_u32_key)) {
+      continue;
+    }
+
+    const struct tc_u32_key* key = reinterpret_cast<const struct tc_u32_key*>(
+        attributes.at(TCA_U32_SEL).data() + sizeof(struct tc_u32_sel));
+
+    char address[INET_ADDRSTRLEN];
+    ::inet_ntop(AF_INET, &key->val, address, sizeof(address));
+    result[id] = address;
+  }
+
+  return result;
+}
+
+
+Try<hashmap<uint32_t, string>> prioritize(const string& device, bool replace)
+{
+  Try<Owned<Socket>> host = Socket::open();
+  if (host.isError()) {
+    return Error(host.error());
+  }
+
+  Try<int> index = linkIndex(host.get().get(), device);
+  if (index.isError()) {
+    return Error(index.error());
+  }
+
+  Message query(RTM_GETQDISC, NLM_F_DUMP, sizeof(struct tcmsg));
+  query.header<struct tcmsg>()->tcm_family = AF_UNSPEC;
+  query.header<struct tcmsg>()->tcm_ifindex = index.get();
+
+  Try<vector<string>> qdiscs = host.get()->dump(query);
+  if (qdiscs.isError()) {
+    return Error(
+        "Failed to list the qdiscs of '" + device + "': " + qdiscs.error());
+  }
+
+  Option<string> kind;
+  uint32_t handle = 0;
+  foreach (const string& message, qdiscs.get()) {
+    const struct tcmsg* qdisc = header<struct tcmsg>(message);
+    if (qdisc->tcm_ifindex != index.get() || qdisc->tcm_parent != TC_H_ROOT) {
+      continue;
+    }
+
+    hashmap<uint16_t, string> attributes =
+      netlink::attributes(message, sizeof(struct tcmsg));
+    kind = attributes.contains(TCA_KIND)
+      ? string(attributes.at(TCA_KIND).c_str())
+      : string();
+    handle = qdisc->tcm_handle;
+  }
+
+  // Set up by an earlier agent, along with the filters of the containers
+  // it left running.
+  if (kind.isSome() && kind.get() == "prio" && handle == PRIO_HANDLE) {
+    return filters(host.get().get(), index.get());
+  }
+
+  // Without a queue, there is nothing to lose.
+  if (kind.isSome() && kind.get() != "noqueue" && !replace) {
+    return Error(
+        "'" + device + "' has a root qdisc of its own, '" + kind.get() +
+        "', which is only replaced if asked to");
+  }
+
+  Message remove = delRootQdisc(index.get());
+  Try<Nothing> removed = host.get()->request(remove);
+  if (removed.isError() && errno != ENOENT && errno != EINVAL) {
+    return Error(
+        "Failed to remove the root qdisc of '" + device + "': " +
+        removed.error());
+  }
+
+  // Three bands, the default for prio; packets no filter matches are
+  // put in one by their TOS, mostly the middle one.
+  Message message(
+      RTM_NEWQDISC, NLM_F_CREATE | NLM_F_REPLACE, sizeof(struct tcmsg));
+  struct tcmsg* header = message.header<struct tcmsg>();
+  header->tcm_family = AF_UNSPEC;
+  header->tcm_ifindex = index.get();
+  header->tcm_handle = PRIO_HANDLE;
+  header->tcm_parent = TC_H_ROOT;
+
+  struct tc_prio_qopt options;
+  options.bands = 3;
+  const uint8_t priomap[TC_PRIO_MAX + 1] =
+    { 1, 2, 2, 2, 1, 2, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1 };
+  memcpy(options.priomap, priomap, sizeof(priomap));
+
+  message.append(TCA_KIND, string("prio"));
+  message.append(TCA_OPTIONS, &options, sizeof(options));
+
+  Try<Nothing> result = host.get()->request(message);
+  if (result.isError()) {
+    return Error(
+        "Failed to set up the prio qdisc of '" + device + "': " +
+        result.error());
+  }
+
+  return hashmap<uint32_t, string>();
+}
+
+
+Try<Nothing> classify(
+    const string& device,
+    uint32_t id,
+    const string& address,
+    uint32_t band)
+{
+  Try<struct in_addr> source = parse(address);
+  if (source.isError()) {
+    return Error(source.error());
+  }
+
+  Try<Owned<Socket>> host = Socket::open();
+  if (host.isError()) {
+    return Error(host.error());
+  }
+
+  Try<int> index = linkIndex(host.get().get(), device);
+  if (index.isError()) {
+    return Error(index.error());
+  }
+
+  Message message = newFilter(index.get(), id, source.get(), band);
+  Try<Nothing> result = host.get()->request(message);
+  if (result.isError()) {
+    return Error(
+        "Failed to add a filter for " + address + " to '" + device + "': " +
+        result.error());
+  }
+
+  return Nothing();
+}
+
+
+Try<Nothing> unclassify(const string& device, uint32_t id)
+{
+  Try<Owned<Socket>> host = Socket::open();
+  if (host.isError()) {
+    return Error(host.error());
+  }
+
+  Try<int> index = linkIndex(host.get().get(), device);
+  if (index.isError()) {
+    return Error(index.error());
+  }
+
+  Message message = delFilter(index.get(), id);
+  Try<Nothing> result = host.get()->request(message);
+  if (result.isError() && errno != ENOENT) {
+    return Error(
+        "Failed to remove filter " + stringify(id) + " of '" + device +
+        "': " + result.error());
+  }
+
+  return Nothing();
+}
+
+
+Try<Nothing> sysctl(
+    const string& netns,
+    const vector<pair<string, string>>& settings)
+{
+  Try<int> original = enter(netns);
+  if (original.isError()) {
+    return Error(original.error());
+  }
+
+  // The /proc/sys/net files opened here are those of the namespace
+  // entered, whichever namespace /proc was mounted from.
+  Option<Error> error;
+  typedef pair<string, string> Setting;
+  foreach (const Setting& setting, settings) {
+    int fd = ::open(setting.first.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+      error = ErrnoError("Failed to open '" + setting.first + "'");
+      break;
+    }
+
+    ssize_t length =
+      ::write(fd, setting.second.data(), setting.second.size());
+    if (length != static_cast<ssize_t>(setting.second.size())) {
+      error = ErrnoError(
+          "Failed to write '" + setting.second + "' to '" + setting.first +
+          "'");
+      os::close(fd);
+      break;
+    }
+
+    os::close(fd);
+  }
+
+  leave(original.get());
+
+  if (error.isSome()) {
+    return error.get();
+  }
+
+  return Nothing();
+}
+
+
+Try<hashmap<string, struct rtnl_link_stats64>> links(Socket* socket)
+{
+  Try<vector<string>> links = socket->dump(RTM_GETLINK, AF_UNSPEC);
+  if (links.isError()) {
+    return Error("Failed to list links: " + links.error());
+  }
+
+  hashmap<string, struct rtnl_link_stats64> result;
+  foreach (const string& message, links.get()) {
+    if (header<struct ifinfomsg>(message)->ifi_type == ARPHRD_LOOPBACK) {
+      continue;
+    }
+
+    hashmap<uint16_t, string> values =
+      attributes(message, sizeof(struct ifinfomsg));
+
+    // Kernels before 2.6.35 only report 32 bit counters.
+    if (!values.contains(IFLA_IFNAME) ||
+        !values.contains(IFLA_STATS64) ||
+        values[IFLA_STATS64].size() < sizeof(struct rtnl_link_stats64)) {
+      continue;
+    }
+
+    struct rtnl_link_stats64 link;
+    memcpy(&link, values[IFLA_STATS64].data(), sizeof(link));
+
+    result[values[IFLA_IFNAME].c_str()] = link;
+  }
+
+  return result;
+}
+
+
+Try<struct rtnl_link_stats64> statistics(Socket* socket)
+{
+  Try<hashmap<string, struct rtnl_link_stats64>> statistics = links(socket);
+  if (statistics.isError()) {
+    return Error(statistics.error());
+  }
+
+  struct rtnl_link_stats64 total;
+  memset(&total, 0, sizeof(total));
+
+  foreachvalue (const struct rtnl_link_stats64& link, statistics.get()) {
+    total.rx_packets += link.rx_packets;
+    total.tx_packets += link.tx_packets;
+    total.rx_bytes += link.rx_bytes;
+    total.tx_bytes += link.tx_bytes;
+    total.rx_errors += link.rx_errors;
+    total.tx_errors += link.tx_errors;
+    total.rx_dropped += link.rx_dropped;
+    total.tx_dropped += link.tx_dropped;
+  }
+
+  return total;
+}
+
+} // namespace netlink {
+} // namespace mesos {
@@ -0,0 +1,238 @@
+/**
+ * This file is © 2015 Mesosphere, Inc. ("Mesosphere"). Mesosphere
+ * licenses this file to you solely pursuant to the agreement between
+ * Mesosphere and you (if any).  If there is no such agreement between
+ * Mesosphere, the following terms apply (and you may not use this
+ * file except in compliance with such terms):
+ *
+ * 1) Subject to your compliance with the following terms, Mesosphere
+ * hereby grants you a nonexclusive, limited, personal,
+ * non-sublicensable, non-transferable, royalty-free license to use
+ * this file solely for your internal business purposes.
+ *
+ * 2) You may not (and agree not to, and not to authorize or enable
+ * others to), directly or indirectly:
+ *   (a) copy, distribute, rent, lease, timeshare, operate a service
+ *   bureau, or otherwise use for the benefit of a third party, this
+ *   file; or
+ *
+ *   (b) remove any proprietary notices from this file.  Except as
+ *   expressly set forth herein, as between you and Mesosphere,
+ *   Mesosphere retains all right, title and interest in and to this
+ *   file.
+ *
+ * 3) Unless required by applicable law or otherwise agreed to in
+ * writing, Mesosphere provides this file on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied,
+ * including, without limitation, any warranties or conditions of
+ * TITLE, NON-INFRINGEMENT, MERCHANTABILITY, or FITNESS FOR A
+ * PARTICULAR PURPOSE.
+ *
+ * 4) In no event and under no legal theory, whether in tort
+ * (including negligence), contract, or otherwise, unless required by
+ * applicable law (such as deliberate and grossly negligent acts) or
+ * agreed to in writing, shall Mesosphere be liable to you for
+ * damages, including any direct, indirect, special, incidental, or
+ * consequential damages of any character arising as a result of these
+ * terms or out of the use or inability to use this file (including
+ * but not limited to damages for loss of goodwill, work stoppage,
+ * computer failure or malfunction, or any and all other commercial
+ * damages or losses), even if Mesosphere has been advised of the
+ * possibility of such damages.
+ */
+
+#ifndef __NETLINK_HPP__
+#define __NETLINK_HPP__
+
+#include <linux/if_link.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include <sys/types.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <process/owned.hpp>
+
+#include <stout/hashmap.hpp>
+#include <stout/nothing.hpp>
+#include <stout/option.hpp>
+#include <stout/try.hpp>
+
+namespace mesos {
+namespace netlink {
+
+// A rtnetlink message under construction: the netlink header, the
+// family header (ifinfomsg, ifaddrmsg, rtmsg, ...) and its attributes.
+class Message
+{
+public:
+  Message(uint16_t type, uint16_t flags, size_t headerSize);
+
+  // The family header following the netlink header.
+  template <typename T>
+  T* header()
+  {
+    return reinterpret_cast<T*>(data.data() + NLMSG_HDRLEN);
+  }
+
+  void append(uint16_t type, const void* value, size_t length);
+  void append(uint16_t type, uint32_t value);
+  void append(uint16_t type, const std::string& value);
+
+  // Opens an attribute holding further attributes, preceded by a zeroed
+  // family header of 'headerSize' bytes (e.g. for VETH_INFO_PEER), and
+  // closes the innermost one.
+  void nest(uint16_t type, size_t headerSize = 0);
+  void unnest();
+
+  struct nlmsghdr* get()
+  {
+    return reinterpret_cast<struct nlmsghdr*>(data.data());
+  }
+
+private:
+  std::vector<char> data;
+
+  // Offsets of the attributes opened by nest().
+  std::vector<size_t> nests;
+};
+
+
+// A NETLINK_ROUTE socket. The network namespace of a netlink socket is
+// the one of the thread that created it, so one opened in another
+// namespace keeps operating there.
+class Socket
+{
+public:
+  // Opens a socket in the network namespace referred to by 'netns',
+  // e.g. /proc/<pid>/ns/net, or in the caller's if none is given.
+  static Try<process::Owned<Socket>> open(
+      const Option<std::string>& netns = None());
+
+  ~Socket();
+
+  // Sends 'message' and waits for the kernel to acknowledge it.
+  Try<Nothing> request(Message& message);
+
+  // Sends 'message' and returns the kernel's reply to it.
+  Try<std::string> query(Message& message);
+
+  // Sends all of 'messages' with as few system calls as possible and
+  // returns the error, zero for success, the kernel answered each with.
+  // The reply to each request that got one ends up in 'replies'.
+  Try<std::vector<int>> transact(
+      const std::vector<Message*>& messages,
+      std::vector<std::string>* replies = NULL);
+
+  // Dumps the objects of the given type (RTM_GETLINK, RTM_GETADDR,
+  // RTM_GETROUTE) and returns the messages of the reply.
+  Try<std::vector<std::string>> dump(uint16_t type, unsigned char family);
+
+  // Sends 'message', a request with NLM_F_DUMP, and returns the messages
+  // of the reply.
+  Try<std::vector<std::string>> dump(Message& message);
+
+private:
+  explicit Socket(int fd);
+
+  Socket(const Socket&) = delete;
+  Socket& operator=(const Socket&) = delete;
+
+  // Reads replies to 'seq' until the kernel is done with it; appends
+  // the data messages to 'messages' if given.
+  Try<Nothing> receive(uint32_t seq, std::vector<std::string>* messages);
+
+  // Reads the acknowledgements of the 'count' requests sent starting
+  // with sequence number 'first'.
+  Try<Nothing> acknowledge(
+      uint32_t first,
+      size_t count,
+      int* errors,
+      std::string* replies);
+
+  const int fd;
+  uint32_t seq;
+};
+
+
+// Moves every non-loopback link of the network namespace 'netns' into
+// the one of process 'pid', together with their IPv4 addresses and the
+// main table routes through them. Links lose both when they change
+// namespaces, so they are read beforehand and set up again afterwards.
+Try<Nothing> adopt(const std::string& netns, pid_t pid);
+
+
+// A container for the built-in virtualizer to connect: process 'pid'
+// gets a veth pair with 'link' on the host and eth0 in its network
+// namespace. The container gets 'addresses' as /32s and a default route
+// through 169.254.1.1, which the host answers for by proxy ARP; the
+// host gets a route to each address through 'link'.
+struct Plumbing
+{
+  pid_t pid;
+  std::string link;
+  std::vector<std::string> addresses;
+};
+
+
+// Connects 'containers', batching the requests on the host for all of
+// them and those in each container's namespace. Returns the outcome for
+// each container.
+std::vector<Try<Nothing>> plumb(const std::vector<Plumbing>& containers);
+
+// Removes 'link', along with its peer and routes, unless already gone.
+Try<Nothing> unplumb(const std::string& link);
+
+// Limits the rates at which a container connected by plumb() through
+// 'link' receives and sends to 'rate' bytes per second each: 'link'
+// shapes what it sends and drops what it receives beyond the rate, so
+// that the container cannot lift the limit, and 'eth0' in the container
+// shapes what it sends. 'container' is a socket in its network
+// namespace. An earlier limit is changed in place, none lifts it.
+Try<Nothing> limit(
+    Socket* container,
+    const std::string& link,
+    const Option<uint64_t>& rate);
+
+// Makes a prio qdisc with three bands, 1 to 3 from the highest to the
+// lowest priority, without filters, the root qdisc of 'device' on the
+// host. One an earlier call set up is kept, and the ids of its filters
+// returned with the address each matches. Another root qdisc, but for
+// noqueue, is only replaced if 'replace' is set.
+Try<hashmap<uint32_t, std::string>> prioritize(
+    const std::string& device,
+    bool replace);
+
+// Sends the IPv4 packets from 'address' that go out of 'device' on the
+// host, set up by prioritize(), through 'band'. Filter 'id', between 1
+// and 4095, is what unclassify() removes.
+Try<Nothing> classify(
+    const std::string& device,
+    uint32_t id,
+    const std::string& address,
+    uint32_t band);
+
+Try<Nothing> unclassify(const std::string& device, uint32_t id);
+
+// Writes each value to its file, a /proc/sys/net path, in the network
+// namespace 'netns', e.g. /proc/<pid>/ns/net, stopping at the first
+// that fails.
+Try<Nothing> sysctl(
+    const std::string& netns,
+    const std::vector<std::pair<std::string, std::string>>& settings);
+
+// The counters of all links but loopback in the namespace 'socket' was
+// opened in, by name.
+Try<hashmap<std::string, struct rtnl_link_stats64>> links(Socket* socket);
+
+// Sums up the counters of all links but loopback in the namespace
+// 'socket' was opened in.
+Try<struct rtnl_link_stats64> statistics(Socket* socket);
+
+} // namespace netlink {
+} // namespace mesos {
+
+#endif // #ifdef __NETLINK_HPP__
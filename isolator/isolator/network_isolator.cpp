@@ -41,6 +41,27 @@
  * possibility of such damages.
  */
 
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/mount.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <iomanip>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <tuple>
+
 #include <mesos/hook.hpp>
 #include <mesos/mesos.hpp>
 #include <mesos/module.hpp>
@@ -50,443 +71,4033 @@
 
 #include <mesos/slave/isolator.hpp>
 
+#include <process/collect.hpp>
+#include <process/defer.hpp>
+#include <process/delay.hpp>
+#include <process/dispatch.hpp>
 #include <process/future.hpp>
 #include <process/io.hpp>
 #include <process/owned.hpp>
 #include <process/process.hpp>
 
+#include <process/metrics/metrics.hpp>
+
+#include <stout/error.hpp>
 #include <stout/hashmap.hpp>
+#include <stout/ip.hpp>
+#include <stout/lambda.hpp>
+#include <stout/numify.hpp>
 #include <stout/option.hpp>
 #include <stout/os.hpp>
 #include <stout/os/exists.hpp>
+#include <stout/path.hpp>
 #include <stout/protobuf.hpp>
+#include <stout/result.hpp>
 #include <stout/stringify.hpp>
+#include <stout/strings.hpp>
 #include <stout/try.hpp>
 #include <stout/uuid.hpp>
 
 #include "interface.hpp"
+#include "ipam.hpp"
+#include "netlink.hpp"
 #include "network_isolator.hpp"
+#include "uring.hpp"
+
+// 40KB should suffice for now!
+#define MAX_JSON_OUTPUT_SIZE (10*4096)
+
+// Not all libc headers know about pidfd_open(2) (Linux >= 5.3) yet.
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434
+#endif
+
+// Nor about clone3(2) and CLONE_INTO_CGROUP (Linux >= 5.7).
+#ifndef __NR_clone3
+#define __NR_clone3 435
+#endif
+
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP 0x200000000ULL
+#endif
+
+using namespace mesos;
+using namespace network_isolator;
+using namespace process;
+
+using std::pair;
+using std::string;
+using std::vector;
+
+using mesos::slave::ContainerConfig;
+using mesos::slave::ContainerLaunchInfo;
+using mesos::slave::ContainerLimitation;
+using mesos::slave::Isolator;
+
+static const char* ipamClientKey = "ipam_command";
+static const char* isolatorClientKey = "isolator_command";
+static const char* pluginEnvironmentKey = "plugin_environment";
+static const char* pluginCgroupKey = "plugin_cgroup";
+static const char* pluginCpusKey = "plugin_cpus";
+static const char* pluginNiceKey = "plugin_nice";
+static const char* ipamConcurrencyKey = "ipam_max_concurrency";
+static const char* isolatorConcurrencyKey = "isolator_max_concurrency";
+static const char* pluginRetriesKey = "plugin_retries";
+static const char* pluginRetryCommandsKey = "plugin_retry_commands";
+static const char* pluginRetryBackoffKey = "plugin_retry_backoff";
+static const char* pluginRetryMaxBackoffKey = "plugin_retry_max_backoff";
+static const char* pluginBreakerThresholdKey = "plugin_breaker_threshold";
+static const char* pluginBreakerTimeoutKey = "plugin_breaker_timeout";
+static const char* pluginIoBackendKey = "plugin_io_backend";
+static const char* ipamHedgePercentileKey = "ipam_hedge_percentile";
+static const char* ipamSpeculationTimeoutKey = "ipam_speculation_timeout";
+static const char* netnsPoolSizeKey = "netns_pool_size";
+static const char* netnsPoolDirKey = "netns_pool_dir";
+static const char* ipamBlockSizeKey = "ipam_block_size";
+static const char* ipamBlockWatermarkKey = "ipam_block_watermark";
+static const char* ipamBlockDirKey = "ipam_block_dir";
+static const char* ipamStickyTtlKey = "ipam_sticky_ttl";
+static const char* ipamStickySizeKey = "ipam_sticky_size";
+static const char* ipamStickyDirKey = "ipam_sticky_dir";
+static const char* limitPacketRateKey = "limit_packet_rate";
+static const char* limitConntrackEntriesKey = "limit_conntrack_entries";
+static const char* limitGracePeriodKey = "limit_grace_period";
+static const char* trafficClassDeviceKey = "traffic_class_device";
+static const char* trafficClassReplaceKey = "traffic_class_replace";
+static const char* sysctlProfilesKey = "sysctl_profiles";
+
+// Value of 'isolator_command' selecting the virtualizer built into the
+// module.
+static const char* builtinVirtualizer = "builtin://veth";
+static const char* builtinIpamScheme = "builtin://";
+
+// Scalar resource, in Mbit/s, limiting what containers of the built-in
+// virtualizer send and receive each.
+static const char* bandwidthResource = "network_bandwidth";
+
+// NetworkInfo label putting the traffic of a container ahead of, or
+// behind, that of the others on the 'traffic_class_device'.
+static const char* priorityLabel = "priority";
+static const char* latencyPriority = "latency";
+static const char* bulkPriority = "bulk";
+
+// Bands of the prio qdisc set up by netlink::prioritize(); the
+// unlabelled containers share the middle one.
+static const uint32_t LATENCY_BAND = 1;
+static const uint32_t BULK_BAND = 3;
+
+// NetworkInfo label naming the 'sysctl_profiles' entry to apply to the
+// network namespace of a container.
+static const char* sysctlProfileLabel = "sysctl_profile";
+
+// Ids a u32 filter can be given, one per address of a prioritized
+// container.
+static const uint32_t MAX_TRAFFIC_FILTERS = 4095;
+
+// IPAM commands for address blocks, passed in the 'command' field of
+// IPAMRequestIPMessage and IPAMReleaseIPMessage respectively.
+static const char* claimBlockCommand = "claim_block";
+static const char* releaseBlockCommand = "release_block";
+
+// Number of allocation latencies the hedging delay is derived from, and
+// how many are needed before allocations are hedged at all.
+static const size_t HEDGE_WINDOW = 100;
+static const size_t HEDGE_MIN_SAMPLES = 20;
+
+// How long to wait before pooling namespaces again after a failure.
+static const Duration NETNS_POOL_RETRY_INTERVAL = Seconds(10);
+
+// How long a block stays empty before it is given back to IPAM.
+static const Duration IPAM_BLOCK_IDLE_TIMEOUT = Minutes(5);
+
+// How long the counters of host side veths are reused for. The agent
+// samples every container about once a second, taking a while to get
+// through all of them.
+static const Duration HOST_STATISTICS_TTL = Milliseconds(500);
+
+// How often watched containers are checked against their limits.
+static const Duration LIMIT_CHECK_INTERVAL = Seconds(1);
+
+// How far over its bandwidth a container whose links are not ours to
+// shape may go between two checks, as the bursts of a token bucket let
+// it.
+static const double LIMIT_BANDWIDTH_TOLERANCE = 1.25;
+
+// Plugins are Python programs, a handful at a time keeps the host busy.
+static const size_t DEFAULT_PLUGIN_CONCURRENCY = 8;
+
+// Value of 'plugin_io_backend' moving plugin pipe traffic through an
+// io_uring, and how many operations it queues before submitting them
+// anyway. Plugin calls take two or three each, at a time.
+static const char* ioUringBackend = "io_uring";
+static const unsigned PLUGIN_RING_ENTRIES = 256;
+static const Duration PLUGIN_RING_RETRY_INTERVAL = Milliseconds(10);
+
+// How often plugins are checked on while another child of the agent
+// waits to be reaped, on kernels without pidfd_open(2).
+static const Duration PLUGIN_REAP_INTERVAL = Milliseconds(10);
+
+static hashmap<ContainerID, Info*> *infos = NULL;
+// By executorKey().
+static hashmap<string, ContainerID> *executorContainerIds = NULL;
+
+// Held by the isolator while it adds to or removes from 'infos' and
+// 'executorContainerIds', and by the hook thread while it reads them.
+static std::mutex containersMutex;
+static bool isolatorActivated = false;
+
+static Try<Isolator*> networkIsolator = (Isolator*) NULL;
+
+
+Dictionary<string>& mesos::netgroupNames()
+{
+  static Dictionary<string>* dictionary = new Dictionary<string>();
+  return *dictionary;
+}
+
+
+Dictionary<Label>& mesos::labelPairs()
+{
+  static Dictionary<Label>* dictionary = new Dictionary<Label>();
+  return *dictionary;
+}
+
+
+PluginCommand::PluginCommand(
+    const string& command_,
+    const vector<string>& environment_)
+  : command(command_),
+    args(strings::tokenize(command_, " ")),
+    environment(environment_)
+{
+  if (!args.empty()) {
+    executable = args[0];
+  }
+
+  // Resolve the executable now rather than letting execvp() search PATH
+  // in the forked child.
+  if (!executable.empty() && executable.find('/') == string::npos) {
+    Option<string> searchPath = os::getenv("PATH");
+    if (searchPath.isSome()) {
+      foreach (const string& dir, strings::tokenize(searchPath.get(), ":")) {
+        const string candidate = path::join(dir, executable);
+        if (os::exists(candidate)) {
+          executable = candidate;
+          break;
+        }
+      }
+    }
+  }
+
+  foreach (string& arg, args) {
+    argv.push_back((char*) arg.c_str());
+  }
+  argv.push_back(NULL);
+
+  foreach (string& variable, environment) {
+    envp.push_back((char*) variable.c_str());
+  }
+  envp.push_back(NULL);
+}
+
+
+// Builds the environment for plugin processes. By default plugins see
+// the agent environment as it was when the module was loaded. When the
+// 'plugin_environment' parameter is given, it is a comma separated list of
+// 'NAME=VALUE' entries, or plain 'NAME' entries to pass through the
+// agent's value, and plugins see exactly that.
+static vector<string> pluginEnvironment(const Option<string>& spec)
+{
+  vector<string> result;
+
+  if (spec.isNone()) {
+    foreachpair (const string& name, const string& value, os::environment()) {
+      result.push_back(name + "=" + value);
+    }
+    return result;
+  }
+
+  foreach (const string& entry, strings::tokenize(spec.get(), ",")) {
+    if (entry.find('=') != string::npos) {
+      result.push_back(entry);
+      continue;
+    }
+
+    Option<string> value = os::getenv(entry);
+    if (value.isSome()) {
+      result.push_back(entry + "=" + value.get());
+    }
+  }
+
+  return result;
+}
+
+
+// Returns the value of the module parameter 'key', if given.
+static Option<string> parameter(const Parameters& parameters, const string& key)
+{
+  foreach (const Parameter& parameter, parameters.parameter()) {
+    if (parameter.key() == key) {
+      return parameter.value();
+    }
+  }
+  return None();
+}
+
+
+// Parses a CPU list such as '0-3,8'.
+static Try<cpu_set_t> parseCpus(const string& value)
+{
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+
+  foreach (const string& range, strings::tokenize(value, ",")) {
+    vector<string> bounds = strings::split(range, "-");
+    if (bounds.size() > 2) {
+      return Error("Invalid CPU range '" + range + "'");
+    }
+
+    Try<int> first = numify<int>(strings::trim(bounds.front()));
+    Try<int> last = numify<int>(strings::trim(bounds.back()));
+    if (first.isError() || last.isError() ||
+        first.get() < 0 || last.get() < first.get() ||
+        last.get() >= CPU_SETSIZE) {
+      return Error("Invalid CPU range '" + range + "'");
+    }
+
+    for (int cpu = first.get(); cpu <= last.get(); cpu++) {
+      CPU_SET(cpu, &cpus);
+    }
+  }
+
+  if (CPU_COUNT(&cpus) == 0) {
+    return Error("Empty CPU list '" + value + "'");
+  }
+
+  return cpus;
+}
+
+
+// Parses a non-negative number, or returns 'value' if 'key' is not given.
+static Try<size_t> parseCount(
+    const Parameters& parameters,
+    const string& key,
+    size_t value)
+{
+  Option<string> count = parameter(parameters, key);
+  if (count.isNone()) {
+    return value;
+  }
+
+  Try<size_t> result = numify<size_t>(count.get());
+  if (result.isError()) {
+    return Error("Invalid '" + key + "': '" + count.get() + "'");
+  }
+  return result.get();
+}
+
+
+// Parses a duration such as '100ms', or returns 'value' if 'key' is not
+// given.
+static Try<Duration> parseDuration(
+    const Parameters& parameters,
+    const string& key,
+    const Duration& value)
+{
+  Option<string> duration = parameter(parameters, key);
+  if (duration.isNone()) {
+    return value;
+  }
+
+  Try<Duration> result = Duration::parse(duration.get());
+  if (result.isError()) {
+    return Error(
+        "Invalid '" + key + "': '" + duration.get() + "': " + result.error());
+  }
+  return result.get();
+}
+
+
+static Try<RetryPolicy> parseRetryPolicy(const Parameters& parameters)
+{
+  RetryPolicy policy;
+
+  // Repeating these has no further effect: reservations and releases are
+  // of given addresses and the virtualizer cleanup is per container.
+  // Neither 'allocate' nor 'isolate' are safe to repeat in general.
+  string commands = parameter(parameters, pluginRetryCommandsKey)
+    .getOrElse("reserve,release,cleanup");
+  foreach (const string& command, strings::tokenize(commands, ",")) {
+    policy.commands.insert(strings::trim(command));
+  }
+
+  Try<size_t> retries = parseCount(parameters, pluginRetriesKey, 3);
+  if (retries.isError()) {
+    return Error(retries.error());
+  }
+  policy.retries = retries.get();
+
+  Try<Duration> backoff =
+    parseDuration(parameters, pluginRetryBackoffKey, Milliseconds(100));
+  if (backoff.isError()) {
+    return Error(backoff.error());
+  }
+  policy.backoff = backoff.get();
+
+  Try<Duration> maxBackoff =
+    parseDuration(parameters, pluginRetryMaxBackoffKey, Seconds(2));
+  if (maxBackoff.isError()) {
+    return Error(maxBackoff.error());
+  }
+  policy.maxBackoff = maxBackoff.get();
+
+  return policy;
+}
+
+
+static Try<CircuitBreaker> parseCircuitBreaker(const Parameters& parameters)
+{
+  CircuitBreaker breaker;
+
+  Try<size_t> threshold = parseCount(parameters, pluginBreakerThresholdKey, 5);
+  if (threshold.isError()) {
+    return Error(threshold.error());
+  }
+  breaker.threshold = threshold.get();
+
+  Try<Duration> timeout =
+    parseDuration(parameters, pluginBreakerTimeoutKey, Seconds(10));
+  if (timeout.isError()) {
+    return Error(timeout.error());
+  }
+  breaker.timeout = timeout.get();
+
+  return breaker;
+}
+
+
+// Reads the sysctl profiles in the JSON file at 'path', an object of
+// profiles by name, each an object of settings such as
+// "net.core.somaxconn": "4096". Names are turned into /proc/sys paths
+// here so that applying a profile only takes writing the files.
+static Try<hashmap<string, vector<pair<string, string>>>> parseSysctlProfiles(
+    const string& path)
+{
+  Try<string> read = os::read(path);
+  if (read.isError()) {
+    return Error("Failed to read '" + path + "': " + read.error());
+  }
+
+  Try<JSON::Object> object = JSON::parse<JSON::Object>(read.get());
+  if (object.isError()) {
+    return Error("Failed to parse '" + path + "': " + object.error());
+  }
+
+  hashmap<string, vector<pair<string, string>>> profiles;
+  foreachpair (const string& name,
+               const JSON::Value& profile,
+               object.get().values) {
+    if (!profile.is<JSON::Object>()) {
+      return Error("Sysctl profile '" + name + "' is not an object");
+    }
+
+    vector<pair<string, string>>& settings = profiles[name];
+    foreachpair (const string& key,
+                 const JSON::Value& value,
+                 profile.as<JSON::Object>().values) {
+      // Either form sysctl(8) takes; the slashes one allows for dots in
+      // link names.
+      string file = key;
+      if (!strings::contains(file, "/")) {
+        std::replace(file.begin(), file.end(), '.', '/');
+      }
+
+      // Only the net tree is per network namespace.
+      vector<string> components = strings::split(file, "/");
+      if (components.front() != "net" ||
+          std::find(components.begin(), components.end(), "..") !=
+            components.end()) {
+        return Error(
+            "Invalid sysctl '" + key + "' in profile '" + name +
+            "': expected one under 'net'");
+      }
+
+      if (value.is<JSON::String>()) {
+        settings.push_back(std::make_pair(
+            path::join("/proc/sys", file), value.as<JSON::String>().value));
+      } else if (value.is<JSON::Number>()) {
+        settings.push_back(
+            std::make_pair(path::join("/proc/sys", file), stringify(value)));
+      } else {
+        return Error(
+            "Invalid value of sysctl '" + key + "' in profile '" + name +
+            "': expected a string or a number");
+      }
+    }
+  }
+
+  return profiles;
+}
+
+
+static Try<NetworkIsolatorOptions> parseOptions(const Parameters& parameters)
+{
+  NetworkIsolatorOptions options;
+
+  Option<string> percentile = parameter(parameters, ipamHedgePercentileKey);
+  if (percentile.isSome()) {
+    Try<double> value = numify<double>(percentile.get());
+    if (value.isError() || value.get() < 0 || value.get() >= 100) {
+      return Error(
+          "Invalid '" + string(ipamHedgePercentileKey) + "': '" +
+          percentile.get() + "'");
+    }
+    options.hedgePercentile = value.get();
+  }
+
+  Try<Duration> speculationTimeout = parseDuration(
+      parameters, ipamSpeculationTimeoutKey, options.speculationTimeout);
+  if (speculationTimeout.isError()) {
+    return Error(speculationTimeout.error());
+  }
+  options.speculationTimeout = speculationTimeout.get();
+
+  Try<size_t> poolSize = parseCount(parameters, netnsPoolSizeKey, 0);
+  if (poolSize.isError()) {
+    return Error(poolSize.error());
+  }
+  options.poolSize = poolSize.get();
+
+  options.builtinVirtualizer =
+    parameter(parameters, isolatorClientKey) == string(builtinVirtualizer);
+
+  Option<string> poolDir = parameter(parameters, netnsPoolDirKey);
+  if (poolDir.isSome()) {
+    options.poolDir = poolDir.get();
+  }
+
+  Try<size_t> blockPrefix = parseCount(parameters, ipamBlockSizeKey, 0);
+  if (blockPrefix.isError()) {
+    return Error(blockPrefix.error());
+  }
+  if (blockPrefix.get() != 0 &&
+      (blockPrefix.get() < 12 || blockPrefix.get() > 30)) {
+    return Error(
+        "Invalid '" + string(ipamBlockSizeKey) + "': expected 12 to 30");
+  }
+  options.blockPrefix = blockPrefix.get();
+
+  Try<size_t> blockWatermark = parseCount(
+      parameters, ipamBlockWatermarkKey, options.blockWatermark);
+  if (blockWatermark.isError()) {
+    return Error(blockWatermark.error());
+  }
+  options.blockWatermark = blockWatermark.get();
+
+  Option<string> blockDir = parameter(parameters, ipamBlockDirKey);
+  if (blockDir.isSome()) {
+    options.blockDir = blockDir.get();
+  }
+
+  Try<Duration> stickyTtl =
+    parseDuration(parameters, ipamStickyTtlKey, options.stickyTtl);
+  if (stickyTtl.isError()) {
+    return Error(stickyTtl.error());
+  }
+  options.stickyTtl = stickyTtl.get();
+
+  Try<size_t> stickySize =
+    parseCount(parameters, ipamStickySizeKey, options.stickySize);
+  if (stickySize.isError()) {
+    return Error(stickySize.error());
+  }
+  options.stickySize = stickySize.get();
+
+  Option<string> stickyDir = parameter(parameters, ipamStickyDirKey);
+  if (stickyDir.isSome()) {
+    options.stickyDir = stickyDir.get();
+  }
+
+  Try<size_t> limitPacketRate =
+    parseCount(parameters, limitPacketRateKey, options.limitPacketRate);
+  if (limitPacketRate.isError()) {
+    return Error(limitPacketRate.error());
+  }
+  options.limitPacketRate = limitPacketRate.get();
+
+  Try<size_t> limitConntrackEntries = parseCount(
+      parameters, limitConntrackEntriesKey, options.limitConntrackEntries);
+  if (limitConntrackEntries.isError()) {
+    return Error(limitConntrackEntries.error());
+  }
+  options.limitConntrackEntries = limitConntrackEntries.get();
+
+  Try<Duration> limitGracePeriod = parseDuration(
+      parameters, limitGracePeriodKey, options.limitGracePeriod);
+  if (limitGracePeriod.isError()) {
+    return Error(limitGracePeriod.error());
+  }
+  options.limitGracePeriod = limitGracePeriod.get();
+
+  options.trafficClassDevice = parameter(parameters, trafficClassDeviceKey);
+
+  Option<string> trafficClassReplace =
+    parameter(parameters, trafficClassReplaceKey);
+  if (trafficClassReplace.isSome()) {
+    if (trafficClassReplace.get() != "true" &&
+        trafficClassReplace.get() != "false") {
+      return Error(
+          "Invalid " + string(trafficClassReplaceKey) + " '" +
+          trafficClassReplace.get() + "', expected 'true' or 'false'");
+    }
+    options.trafficClassReplace = trafficClassReplace.get() == "true";
+  }
+
+  Option<string> sysctlProfiles = parameter(parameters, sysctlProfilesKey);
+  if (sysctlProfiles.isSome()) {
+    Try<hashmap<string, vector<pair<string, string>>>> profiles =
+      parseSysctlProfiles(sysctlProfiles.get());
+    if (profiles.isError()) {
+      return Error(profiles.error());
+    }
+    options.sysctlProfiles = profiles.get();
+  }
+
+  return options;
+}
+
+
+static Try<PluginPlacement> parsePlacement(const Parameters& parameters)
+{
+  PluginPlacement placement;
+
+  Option<string> cpus = parameter(parameters, pluginCpusKey);
+  if (cpus.isSome()) {
+    Try<cpu_set_t> set = parseCpus(cpus.get());
+    if (set.isError()) {
+      return Error("Invalid '" + string(pluginCpusKey) + "': " + set.error());
+    }
+    placement.cpus = set.get();
+  }
+
+  Option<string> nice = parameter(parameters, pluginNiceKey);
+  if (nice.isSome()) {
+    Try<int> value = numify<int>(nice.get());
+    if (value.isError() || value.get() < -20 || value.get() > 19) {
+      return Error(
+          "Invalid '" + string(pluginNiceKey) + "': '" + nice.get() + "'");
+    }
+    placement.nice = value.get();
+  }
+
+  placement.cgroup = parameter(parameters, pluginCgroupKey);
+  if (placement.cgroup.isSome()) {
+    const string& cgroup = placement.cgroup.get();
+
+    placement.cgroupFd =
+      ::open(cgroup.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (placement.cgroupFd == -1) {
+      return ErrnoError("Failed to open plugin cgroup '" + cgroup + "'");
+    }
+
+    const string procs = path::join(cgroup, "cgroup.procs");
+    placement.cgroupProcsFd = ::open(procs.c_str(), O_WRONLY | O_CLOEXEC);
+    if (placement.cgroupProcsFd == -1) {
+      ErrnoError error("Failed to open '" + procs + "'");
+      os::close(placement.cgroupFd);
+      return error;
+    }
+  }
+
+  return placement;
+}
+
+
+// Mirrors 'struct clone_args' of <linux/sched.h>, which not all kernel
+// headers we build against have.
+struct CloneArgs
+{
+  uint64_t flags;
+  uint64_t pidfd;
+  uint64_t child_tid;
+  uint64_t parent_tid;
+  uint64_t exit_signal;
+  uint64_t stack;
+  uint64_t stack_size;
+  uint64_t tls;
+  uint64_t set_tid;
+  uint64_t set_tid_size;
+  uint64_t cgroup;
+};
+
+
+// Set once clone3(CLONE_INTO_CGROUP) turned out not to work here, either
+// because the kernel is too old or the cgroup is not on cgroup v2.
+static bool cloneIntoCgroupUnsupported = false;
+
+
+// Forks a child that starts life inside the plugin cgroup, when possible.
+// Sets '*placed' if it did, otherwise the child has to move itself.
+static pid_t forkPlugin(const PluginPlacement& placement, bool* placed)
+{
+  *placed = false;
+
+  if (placement.cgroupFd != -1 && !cloneIntoCgroupUnsupported) {
+    CloneArgs args;
+    memset(&args, 0, sizeof(args));
+    args.flags = CLONE_INTO_CGROUP;
+    args.exit_signal = SIGCHLD;
+    args.cgroup = placement.cgroupFd;
+
+    pid_t pid = ::syscall(__NR_clone3, &args, sizeof(args));
+    if (pid != -1) {
+      *placed = true;
+      return pid;
+    }
+
+    if (errno != EAGAIN && errno != ENOMEM) {
+      LOG(INFO) << "clone3(CLONE_INTO_CGROUP) is not available ("
+                << ::strerror(errno) << "); plugins will move themselves "
+                << "into '" << placement.cgroup.get() << "'";
+      cloneIntoCgroupUnsupported = true;
+    }
+  }
+
+  return ::fork();
+}
+
+
+// Spawns 'command' with its stdin and stdout connected to pipes. As much
+// of 'input' as the pipe buffer takes, normally all of it, is queued
+// before forking; the write end is then closed before the child even
+// exists and '*inFd' is -1. Otherwise '*inFd' is our write end and the
+// first '*written' bytes of 'input' are already in the pipe. '*outFd' is
+// the read end of the child's stdout. Our ends are non-blocking, for
+// the libprocess event loop, unless 'blocking' is set, for an io_uring.
+static Try<pid_t> popen2(
+    const PluginCommand& command,
+    const PluginPlacement& placement,
+    const string& input,
+    bool blocking,
+    int *inFd,
+    size_t *written,
+    int *outFd)
+{
+  int inPipe[2];
+  int outPipe[2];
+
+  if (pipe2(inPipe, O_CLOEXEC) < 0) {
+    return ErrnoError("Error creating pipe");
+  }
+
+  // Only our end is non-blocking; the child's stdin must not be, as it
+  // may have to wait for the rest of a large input.
+  ::fcntl(inPipe[1], F_SETFL, O_NONBLOCK);
+
+  ssize_t length;
+  while ((length = ::write(inPipe[1], input.data(), input.size())) == -1 &&
+         errno == EINTR);
+
+  if (length == -1 && errno != EAGAIN) {
+    ErrnoError error("Error writing to pipe");
+    os::close(inPipe[0]);
+    os::close(inPipe[1]);
+    return error;
+  }
+
+  *written = length == -1 ? 0 : length;
+
+  if (*written == input.size()) {
+    os::close(inPipe[1]);
+    inPipe[1] = -1;
+  } else if (blocking) {
+    ::fcntl(inPipe[1], F_SETFL, 0);
+  }
+
+  if (pipe2(outPipe, O_CLOEXEC) < 0) {
+    ErrnoError error("Error creating pipe");
+    os::close(inPipe[0]);
+    if (inPipe[1] != -1) {
+      os::close(inPipe[1]);
+    }
+    return error;
+  }
+
+  bool placed;
+  pid_t childPid = forkPlugin(placement, &placed);
+
+  if (childPid == -1) {
+    ErrnoError error("Error forking child");
+    os::close(inPipe[0]);
+    if (inPipe[1] != -1) {
+      os::close(inPipe[1]);
+    }
+    os::close(outPipe[0]);
+    os::close(outPipe[1]);
+    return error;
+  }
+
+  if (childPid == 0) {
+    // Only async signal safe calls from here on. Note that dup2() clears
+    // the CLOEXEC flag on the new descriptor.
+    while (::dup2(inPipe[0], STDIN_FILENO) == -1 && errno == EINTR);
+    while (::dup2(outPipe[1], STDOUT_FILENO) == -1 && errno == EINTR);
+
+    // Writing 0 to 'cgroup.procs' moves the writing process.
+    if (placement.cgroupProcsFd != -1 && !placed &&
+        ::write(placement.cgroupProcsFd, "0", 1) != 1) {
+      ::_exit(1);
+    }
+
+    if (placement.cpus.isSome() &&
+        ::sched_setaffinity(
+            0, sizeof(cpu_set_t), &placement.cpus.get()) != 0) {
+      ::_exit(1);
+    }
+
+    if (placement.nice.isSome() &&
+        ::setpriority(PRIO_PROCESS, 0, placement.nice.get()) != 0) {
+      ::_exit(1);
+    }
+
+    ::execve(command.executable.c_str(), &command.argv[0], &command.envp[0]);
+    ::_exit(1);
+  } else {
+    os::close(inPipe[0]);
+    os::close(outPipe[1]);
+  }
+
+  if (!blocking) {
+    ::fcntl(outPipe[0], F_SETFL, O_NONBLOCK);
+  }
+
+  *inFd = inPipe[1];
+  *outFd = outPipe[0];
+  return childPid;
+}
+
+
+// Reads a plugin response from the non-blocking 'fd' until EOF, straight
+// into 'buffer', which is sized one byte over the maximum response size
+// so that oversized responses can be told apart.
+static Future<string> readResponse(
+    int fd,
+    const std::shared_ptr<string>& buffer,
+    size_t offset)
+{
+  if (offset == buffer->size()) {
+    return Failure(
+        "Response exceeds the maximum of " +
+        stringify(MAX_JSON_OUTPUT_SIZE) + " bytes");
+  }
+
+  return io::read(fd, &(*buffer)[offset], buffer->size() - offset)
+    .then([fd, buffer, offset](size_t length) -> Future<string> {
+      if (length == 0) {
+        buffer->resize(offset);
+        return *buffer;
+      }
+      return readResponse(fd, buffer, offset + length);
+    });
+}
+
+
+// Blocks until 'pid' has exited and collects its exit status and
+// resource usage. Only called once the child is known to have exited.
+static Try<PluginExit> waitPlugin(pid_t pid)
+{
+  PluginExit exit;
+
+  pid_t result;
+  while ((result = ::wait4(pid, &exit.status, 0, &exit.usage)) == -1 &&
+         errno == EINTR);
+
+  if (result == -1) {
+    return ErrnoError("Failed to reap plugin process " + stringify(pid));
+  }
+
+  return exit;
+}
+
+
+// Reaps plugin processes on kernels without pidfd_open(2): one thread,
+// started with the first plugin, waits for children of the agent to
+// exit. It peeks at them with WNOWAIT and only collects the plugins,
+// leaving executors and everything else to whoever started them. While
+// such a child waits for its owner the thread checks on the plugins
+// every PLUGIN_REAP_INTERVAL instead.
+class PluginReaper
+{
+public:
+  static PluginReaper* instance()
+  {
+    static PluginReaper* reaper = new PluginReaper();
+    return reaper;
+  }
+
+  Future<PluginExit> reap(pid_t pid)
+  {
+    std::shared_ptr<Promise<PluginExit>> promise(new Promise<PluginExit>());
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      promises[pid] = promise;
+    }
+
+    added.notify_one();
+
+    return promise->future();
+  }
+
+private:
+  PluginReaper()
+  {
+    std::thread(&PluginReaper::run, this).detach();
+  }
+
+  void run()
+  {
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        added.wait(lock, [this]() { return !promises.empty(); });
+      }
+
+      siginfo_t info;
+      memset(&info, 0, sizeof(info));
+
+      if (::waitid(P_ALL, 0, &info, WEXITED | WNOWAIT) == -1) {
+        if (errno == ECHILD) {
+          // Whatever we wait for is no child of ours (anymore).
+          failAll(ErrnoError("Failed to reap plugin process").message);
+        }
+        continue;
+      }
+
+      if (!collect(info.si_pid)) {
+        os::sleep(PLUGIN_REAP_INTERVAL);
+        collectExited();
+      }
+    }
+  }
+
+  // Reaps 'pid' if it is a plugin, returns whether it was.
+  bool collect(pid_t pid)
+  {
+    std::shared_ptr<Promise<PluginExit>> promise;
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!promises.contains(pid)) {
+        return false;
+      }
+      promise = promises.at(pid);
+      promises.erase(pid);
+    }
+
+    Try<PluginExit> exit = waitPlugin(pid);
+    if (exit.isError()) {
+      promise->fail(exit.error());
+    } else {
+      promise->set(exit.get());
+    }
+
+    return true;
+  }
+
+  void collectExited()
+  {
+    std::vector<pid_t> pids;
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      foreachkey (pid_t pid, promises) {
+        pids.push_back(pid);
+      }
+    }
+
+    foreach (pid_t pid, pids) {
+      siginfo_t info;
+      memset(&info, 0, sizeof(info));
+
+      if (::waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0 &&
+          info.si_pid == pid) {
+        collect(pid);
+      }
+    }
+  }
+
+  void failAll(const string& message)
+  {
+    hashmap<pid_t, std::shared_ptr<Promise<PluginExit>>> failed;
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      std::swap(failed, promises);
+    }
+
+    foreachvalue (const std::shared_ptr<Promise<PluginExit>>& promise,
+                  failed) {
+      promise->fail(message);
+    }
+  }
+
+  std::mutex mutex;
+  std::condition_variable added;
+  hashmap<pid_t, std::shared_ptr<Promise<PluginExit>>> promises;
+};
+
+
+// Reaps a plugin process without blocking the calling actor. Where the
+// kernel supports pidfd_open(2) we wait for the pidfd to become readable
+// on the libprocess event loop, otherwise the PluginReaper does. Unlike
+// process::reap() this keeps the rusage of the child.
+static Future<PluginExit> reap(pid_t pid)
+{
+  int pidfd = ::syscall(__NR_pidfd_open, pid, 0);
+  if (pidfd >= 0) {
+    return io::poll(pidfd, io::READ)
+      .then([pid]() -> Future<PluginExit> {
+        Try<PluginExit> exit = waitPlugin(pid);
+        if (exit.isError()) {
+          return Failure(exit.error());
+        }
+        return exit.get();
+      })
+      .onAny([pidfd]() { os::close(pidfd); });
+  }
+
+  return PluginReaper::instance()->reap(pid);
+}
+
+
+static int64_t milliseconds(const struct timeval& time)
+{
+  return time.tv_sec * 1000 + time.tv_usec / 1000;
+}
+
+
+// Parses a plugin reply. Fails only if the plugin did not get to reply:
+// it was killed, or it left no JSON behind, or exited with an error
+// without saying why. These are what retries and the circuit breaker
+// are about; an 'error' in the reply is left for checkResponse().
+static Future<JSON::Object> parseResponse(
+    const string& plugin,
+    const PluginRun& run)
+{
+  if (WIFSIGNALED(run.exit.status)) {
+    return Failure(
+        plugin + " was terminated by signal " +
+        stringify(WTERMSIG(run.exit.status)));
+  }
+
+  const string& output = run.output;
+
+  if (output.empty()) {
+    return Failure("Got no response");
+  }
+
+  Try<JSON::Object> jsonOutput = JSON::parse<JSON::Object>(output);
+  if (jsonOutput.isError()) {
+    return Failure(
+        "Error parsing output '" + output + "' to JSON string" +
+        jsonOutput.error());
+  }
+
+  Result<JSON::Value> error = jsonOutput.get().find<JSON::Value>("error");
+  if ((error.isNone() || error.get().is<JSON::Null>()) &&
+      WEXITSTATUS(run.exit.status) != 0) {
+    return Failure(
+        plugin + " exited with status " +
+        stringify(WEXITSTATUS(run.exit.status)));
+  }
+
+  return jsonOutput.get();
+}
+
+
+// Fails if a plugin reply carries an error, such as a reserved IP that
+// is taken; the plugin itself works fine.
+static Future<JSON::Object> checkResponse(
+    const string& plugin,
+    const JSON::Object& response)
+{
+  JSON::Object jsonOutput = response;
+
+  Result<JSON::Value> error = jsonOutput.find<JSON::Value>("error");
+  if (error.isSome() && !error.get().is<JSON::Null>()) {
+    return Failure(plugin + " returned error: " + stringify(error.get()));
+  }
+
+  // Protobuf can't parse JSON "null" values; remove error from the object.
+  jsonOutput.values.erase("error");
+
+  return jsonOutput;
+}
+
+
+template <typename OutProto>
+static Future<OutProto> parseProtobuf(const JSON::Object& jsonOutput)
+{
+  Try<OutProto> result = protobuf::parse<OutProto>(jsonOutput);
+  if (result.isError()) {
+    return Failure(
+        "Error parsing output '" + stringify(jsonOutput) + "' to Protobuf" +
+        result.error());
+  }
+
+  return result.get();
+}
+
+
+// Returns 'message' emptied for another request.
+template <typename Message>
+static Message& recycle(Message* message)
+{
+  message->Clear();
+  return *message;
+}
+
+
+// A future that becomes ready after 'duration'.
+static Future<Nothing> elapse(const Duration& duration)
+{
+  return Future<Nothing>().after(
+      duration,
+      [](const Future<Nothing>&) -> Future<Nothing> { return Nothing(); });
+}
+
+
+// Prefixes the failure message of 'future', if it fails, with 'message'.
+template <typename T>
+static Future<T> annotate(const Future<T>& future, const string& message)
+{
+  return future.repair([message](const Future<T>& failed) -> Future<T> {
+    return Failure(message + failed.failure());
+  });
+}
+
+
+// Parses IPv4 addresses as received from IPAM or the framework.
+template <typename Iterable>
+static Try<vector<net::IP>> parseIPs(const Iterable& addresses)
+{
+  vector<net::IP> ips;
+  foreach (const string& address, addresses) {
+    Try<net::IP> ip = net::IP::parse(address, AF_INET);
+    if (ip.isError()) {
+      return Error("Invalid IP address '" + address + "': " + ip.error());
+    }
+    ips.push_back(ip.get());
+  }
+
+  return ips;
+}
+
+
+static string join(const vector<net::IP>& ips)
+{
+  // Room for "255.255.255.255 " per address.
+  string result;
+  result.reserve(ips.size() * 16);
+
+  foreach (const net::IP& ip, ips) {
+    if (!result.empty()) {
+      result += ' ';
+    }
+    result += stringify(ip);
+  }
+
+  return result;
+}
+
+
+// Interns the netgroups and labels of 'networkInfo'.
+static void intern(
+    const NetworkInfo& networkInfo,
+    vector<Dictionary<string>::Id>* netgroups,
+    vector<Dictionary<Label>::Id>* labels)
+{
+  netgroups->reserve(networkInfo.groups().size());
+  foreach (const string& group, networkInfo.groups()) {
+    netgroups->push_back(netgroupNames().intern(group, group));
+  }
+
+  labels->reserve(networkInfo.labels().labels().size());
+  foreach (const Label& label, networkInfo.labels().labels()) {
+    labels->push_back(labelPairs().intern(label.SerializeAsString(), label));
+  }
+}
+
+
+// Gives back the ids intern() handed out.
+static void release(
+    const vector<Dictionary<string>::Id>& netgroups,
+    const vector<Dictionary<Label>::Id>& labels)
+{
+  foreach (Dictionary<string>::Id netgroup, netgroups) {
+    netgroupNames().release(netgroup);
+  }
+
+  foreach (Dictionary<Label>::Id label, labels) {
+    labelPairs().release(label);
+  }
+}
+
+
+// Records 'addresses' in 'path', for them to be released should the
+// agent restart.
+static Try<Nothing> writeAddresses(
+    const string& path,
+    const vector<net::IP>& addresses)
+{
+  JSON::Array array;
+  foreach (const net::IP& address, addresses) {
+    array.values.push_back(stringify(address));
+  }
+
+  JSON::Object metadata;
+  metadata.values["addresses"] = array;
+
+  return os::write(path, stringify(metadata));
+}
+
+
+// Reads the addresses recorded by writeAddresses(), if any.
+static vector<net::IP> readAddresses(const string& path)
+{
+  vector<net::IP> addresses;
+
+  Try<string> read = os::read(path);
+  if (read.isError()) {
+    return addresses;
+  }
+
+  Try<JSON::Object> object = JSON::parse<JSON::Object>(read.get());
+  if (object.isError()) {
+    return addresses;
+  }
+
+  Result<JSON::Array> array = object.get().find<JSON::Array>("addresses");
+  if (!array.isSome()) {
+    return addresses;
+  }
+
+  foreach (const JSON::Value& value, array.get().values) {
+    if (value.is<JSON::String>()) {
+      Try<net::IP> address =
+        net::IP::parse(value.as<JSON::String>().value, AF_INET);
+      if (address.isSome()) {
+        addresses.push_back(address.get());
+      }
+    }
+  }
+
+  return addresses;
+}
+
+
+// The number of conntrack entries in the network namespace of 'pid', if
+// connection tracking is in use there.
+static Option<uint64_t> conntrackEntries(pid_t pid)
+{
+  Try<string> read =
+    os::read(path::join("/proc", stringify(pid), "net/stat/nf_conntrack"));
+  if (read.isError()) {
+    return None();
+  }
+
+  // A line of hexadecimal counters per CPU follows the header, all of
+  // them starting with the entries of the namespace.
+  vector<string> lines = strings::tokenize(read.get(), "\n");
+  if (lines.size() < 2) {
+    return None();
+  }
+
+  vector<string> fields = strings::tokenize(lines[1], " ");
+  if (fields.empty()) {
+    return None();
+  }
+
+  Try<uint64_t> entries = numify<uint64_t>("0x" + fields[0]);
+  if (entries.isError()) {
+    return None();
+  }
+
+  return entries.get();
+}
+
+
+// Whether any of the counters limits are checked against is lower in
+// 'sample' than in the 'last' one.
+static bool regressed(
+    const ResourceStatistics& sample,
+    const ResourceStatistics& last)
+{
+  return sample.net_rx_packets() < last.net_rx_packets() ||
+    sample.net_tx_packets() < last.net_tx_packets() ||
+    sample.net_rx_bytes() < last.net_rx_bytes() ||
+    sample.net_tx_bytes() < last.net_tx_bytes();
+}
+
+
+// Starts a process in a new network namespace that just waits to be
+// killed. The virtualizer plumbs the namespace through its pid, which
+// outlives the process once bind mounted.
+static Try<pid_t> holdNamespace()
+{
+  // Unlike unshare(2) in the child, creating the namespace in clone(2)
+  // guarantees it exists by the time the parent carries on.
+  pid_t pid = ::syscall(SYS_clone, CLONE_NEWNET | SIGCHLD, 0, 0, 0, 0);
+  if (pid < 0) {
+    return ErrnoError("Failed to clone");
+  }
+
+  if (pid == 0) {
+    while (true) {
+      ::pause();
+    }
+  }
+
+  return pid;
+}
+
+
+static void removeNamespace(const string& netns)
+{
+  ::umount2(netns.c_str(), MNT_DETACH);
+  os::rm(netns);
+}
+
+
+// Whether a pooled namespace, plumbed for a single IP and neither
+// netgroups nor labels, is what 'networkInfo' asks for.
+static bool poolable(const NetworkInfo& networkInfo)
+{
+  return networkInfo.groups().size() == 0 &&
+    networkInfo.labels().labels().size() == 0 &&
+    networkInfo.ip_addresses().size() == 1 &&
+    !networkInfo.ip_addresses(0).has_ip_address() &&
+    networkInfo.ip_addresses(0).protocol() == NetworkInfo::IPv4;
+}
+
+
+// Host side name of the built-in virtualizer's veth pair for a
+// container, within the IFNAMSIZ limit.
+static string vethName(const string& containerId)
+{
+  std::ostringstream name;
+  name << "veth" << std::hex << std::setw(11) << std::setfill('0')
+       << (std::hash<string>()(containerId) & 0xfffffffffffULL);
+  return name.str();
+}
+
+
+// Executor IDs are only unique within a framework.
+static string executorKey(
+    const FrameworkID& frameworkId,
+    const ExecutorID& executorId)
+{
+  return frameworkId.value() + "/" + executorId.value();
+}
+
+
+// IPs are held back for a container of the same executor of the same
+// framework and with the same NetworkInfo.
+static string stickyKey(
+    const ExecutorInfo& executorInfo,
+    const NetworkInfo& networkInfo)
+{
+  return executorKey(executorInfo.framework_id(), executorInfo.executor_id()) +
+    "/" + networkInfo.SerializeAsString();
+}
+
+
+// The virtualizer knows a pooled namespace by this container ID until
+// the container that takes it over is cleaned up.
+static ContainerID pooledContainerId(const string& id)
+{
+  ContainerID containerId;
+  containerId.set_value("netns-pool-" + id);
+  return containerId;
+}
+
+
+Try<Isolator*> NetworkIsolatorProcess::create(const Parameters& parameters)
+{
+  string ipamClientPath;
+  string isolatorClientPath;
+  Option<string> environmentSpec;
+  bool ipamPathSpecified = false;
+  bool isolatorPathSpecified = false;
+  foreach (const Parameter& parameter, parameters.parameter()) {
+    if (parameter.key() == ipamClientKey) {
+      ipamPathSpecified = true;
+      ipamClientPath = parameter.value();
+    } else if (parameter.key() == isolatorClientKey) {
+      isolatorPathSpecified = true;
+      isolatorClientPath = parameter.value();
+    } else if (parameter.key() == pluginEnvironmentKey) {
+      environmentSpec = parameter.value();
+    }
+  }
+
+  if (!ipamPathSpecified) {
+    LOG(WARNING) << "IPAM path not specified";
+    return Error("IPAM path not specified.");
+  }
+
+  if (!isolatorPathSpecified) {
+    LOG(WARNING) << "Isolator path not specified";
+    return Error("Isolator path not specified.");
+  }
+
+  const vector<string> environment = pluginEnvironment(environmentSpec);
+
+  Try<PluginPlacement> placement = parsePlacement(parameters);
+  if (placement.isError()) {
+    return Error(placement.error());
+  }
+
+  Try<NetworkIsolatorOptions> options = parseOptions(parameters);
+  if (options.isError()) {
+    return Error(options.error());
+  }
+
+  if (options.get().poolSize > 0) {
+    Try<Nothing> mkdir = os::mkdir(options.get().poolDir);
+    if (mkdir.isError()) {
+      return Error(
+          "Failed to create '" + options.get().poolDir + "': " +
+          mkdir.error());
+    }
+  }
+
+  if (options.get().stickyTtl > Duration::zero()) {
+    Try<Nothing> mkdir = os::mkdir(options.get().stickyDir);
+    if (mkdir.isError()) {
+      return Error(
+          "Failed to create '" + options.get().stickyDir + "': " +
+          mkdir.error());
+    }
+  }
+
+  // The filters an earlier agent added for its containers, which keep
+  // running, are left in place.
+  hashmap<uint32_t, string> trafficFilters;
+  if (options.get().trafficClassDevice.isSome()) {
+    Try<hashmap<uint32_t, string>> prioritize = netlink::prioritize(
+        options.get().trafficClassDevice.get(),
+        options.get().trafficClassReplace);
+    if (prioritize.isError()) {
+      return Error(prioritize.error());
+    }
+    trafficFilters = prioritize.get();
+  }
+
+  Try<size_t> ipamConcurrency = parseCount(
+      parameters, ipamConcurrencyKey, DEFAULT_PLUGIN_CONCURRENCY);
+  if (ipamConcurrency.isError()) {
+    return Error(ipamConcurrency.error());
+  }
+
+  Try<size_t> isolatorConcurrency = parseCount(
+      parameters, isolatorConcurrencyKey, DEFAULT_PLUGIN_CONCURRENCY);
+  if (isolatorConcurrency.isError()) {
+    return Error(isolatorConcurrency.error());
+  }
+
+  // Without io_uring, plugins are run as if it had not been asked for.
+  process::Owned<uring::Ring> ring;
+  Option<string> ioBackend = parameter(parameters, pluginIoBackendKey);
+  if (ioBackend.isSome() && ioBackend.get() != ioUringBackend) {
+    return Error(
+        "Invalid '" + string(pluginIoBackendKey) + "': '" +
+        ioBackend.get() + "'");
+  } else if (ioBackend.isSome()) {
+    Try<process::Owned<uring::Ring>> created =
+      uring::Ring::create(PLUGIN_RING_ENTRIES);
+    if (created.isError()) {
+      LOG(WARNING) << "Not using io_uring for plugins: " << created.error();
+    } else {
+      ring = created.get();
+    }
+  }
+
+  Try<RetryPolicy> retryPolicy = parseRetryPolicy(parameters);
+  if (retryPolicy.isError()) {
+    return Error(retryPolicy.error());
+  }
+
+  Try<CircuitBreaker> circuitBreaker = parseCircuitBreaker(parameters);
+  if (circuitBreaker.isError()) {
+    return Error(circuitBreaker.error());
+  }
+
+  process::Owned<Plugin> ipamPlugin(new Plugin(
+      "ipam",
+      process::Owned<PluginCommand>(
+          new PluginCommand(ipamClientPath, environment)),
+      ipamConcurrency.get(),
+      retryPolicy.get(),
+      circuitBreaker.get()));
+
+  process::Owned<ipam::Allocator> builtinIpam;
+  if (strings::startsWith(ipamClientPath, builtinIpamScheme)) {
+    Try<process::Owned<ipam::Allocator>> allocator = ipam::Allocator::create(
+        ipamClientPath.substr(strlen(builtinIpamScheme)));
+    if (allocator.isError()) {
+      return Error("Failed to set up the built-in IPAM: " + allocator.error());
+    }
+    builtinIpam = allocator.get();
+  }
+
+  process::Owned<ipam::Blocks> blocks;
+  if (options.get().blockPrefix > 0) {
+    Try<process::Owned<ipam::Blocks>> recovered =
+      ipam::Blocks::recover(options.get().blockDir);
+    if (recovered.isError()) {
+      return Error(
+          "Failed to recover address blocks: " + recovered.error());
+    }
+    blocks = recovered.get();
+  }
+
+  process::Owned<Plugin> isolatorPlugin(new Plugin(
+      "isolator",
+      process::Owned<PluginCommand>(
+          new PluginCommand(isolatorClientPath, environment)),
+      isolatorConcurrency.get(),
+      retryPolicy.get(),
+      circuitBreaker.get()));
+
+  if ((builtinIpam.get() != NULL ||
+       os::exists(ipamPlugin->command->executable)) &&
+      (options.get().builtinVirtualizer ||
+       os::exists(isolatorPlugin->command->executable))) {
+    isolatorActivated = true;
+  } else {
+    LOG(WARNING) << "IPAM ('" << ipamClientPath << "') or "
+                 << "Isolator ('" << isolatorClientPath << "') path doesn't "
+                 << "exist; module 'com_mesosphere_mesos_NetworkIsolator' "
+                 << "will not be activated";
+  }
+
+  return new NetworkIsolator(process::Owned<NetworkIsolatorProcess>(
+      new NetworkIsolatorProcess(
+          ipamPlugin,
+          builtinIpam,
+          blocks,
+          isolatorPlugin,
+          placement.get(),
+          ring,
+          trafficFilters,
+          options.get(),
+          parameters)),
+      isolatorActivated);
+}
+
+
+NetworkIsolatorProcess::NetworkIsolatorProcess(
+    process::Owned<Plugin> ipamPlugin_,
+    process::Owned<ipam::Allocator> builtinIpam_,
+    process::Owned<ipam::Blocks> blocks_,
+    process::Owned<Plugin> isolatorPlugin_,
+    const PluginPlacement& placement_,
+    process::Owned<uring::Ring> ring_,
+    const hashmap<uint32_t, string>& trafficFilters,
+    const NetworkIsolatorOptions& options_,
+    const Parameters& parameters_)
+  : metrics(*this),
+    ipamPlugin(ipamPlugin_),
+    builtinIpam(builtinIpam_),
+    blocks(blocks_),
+    isolatorPlugin(isolatorPlugin_),
+    placement(placement_),
+    ring(ring_),
+    ringSubmitting(false),
+    ringPolling(false),
+    options(options_),
+    stickyGeneration(0),
+    filling(0),
+    poolRecovered(false),
+    checkingLimits(false),
+    parameters(parameters_)
+{
+  if (options.trafficClassDevice.isSome()) {
+    for (uint32_t id = MAX_TRAFFIC_FILTERS; id > 0; id--) {
+      if (trafficFilters.contains(id)) {
+        recoveredFilters[trafficFilters.at(id)] = id;
+      } else {
+        freeFilters.push_back(id);
+      }
+    }
+  }
+}
+
+
+void NetworkIsolatorProcess::initialize()
+{
+  // Before any container is cleaned up and has its IPs held back.
+  recoverSticky();
+}
+
+
+NetworkIsolatorProcess::~NetworkIsolatorProcess()
+{
+  if (placement.cgroupFd != -1) {
+    os::close(placement.cgroupFd);
+  }
+  if (placement.cgroupProcsFd != -1) {
+    os::close(placement.cgroupProcsFd);
+  }
+}
+
+
+Future<double> NetworkIsolatorProcess::_plugin_cgroup_cpu_usage_secs()
+{
+  if (placement.cgroup.isNone()) {
+    return Failure("No plugin cgroup configured");
+  }
+
+  // cgroup v2 reports 'usage_usec' in 'cpu.stat'.
+  Try<string> stat = os::read(path::join(placement.cgroup.get(), "cpu.stat"));
+  if (stat.isSome()) {
+    foreach (const string& line, strings::tokenize(stat.get(), "\n")) {
+      vector<string> fields = strings::tokenize(line, " ");
+      if (fields.size() == 2 && fields[0] == "usage_usec") {
+        Try<uint64_t> usec = numify<uint64_t>(fields[1]);
+        if (usec.isError()) {
+          return Failure("Failed to parse 'usage_usec': " + usec.error());
+        }
+        return usec.get() / 1000000.0;
+      }
+    }
+  }
+
+  // cgroup v1 reports nanoseconds in 'cpuacct.usage'.
+  Try<string> usage =
+    os::read(path::join(placement.cgroup.get(), "cpuacct.usage"));
+  if (usage.isError()) {
+    return Failure("Failed to read plugin cgroup CPU usage: " + usage.error());
+  }
+
+  Try<uint64_t> nsec = numify<uint64_t>(strings::trim(usage.get()));
+  if (nsec.isError()) {
+    return Failure("Failed to parse 'cpuacct.usage': " + nsec.error());
+  }
+  return nsec.get() / 1000000000.0;
+}
+
+
+NetworkIsolatorProcess::Metrics::Metrics(
+    const NetworkIsolatorProcess& process)
+  : plugin_runs(
+        "network_isolator/plugin_runs"),
+    plugin_failures(
+        "network_isolator/plugin_failures"),
+    plugin_cpu_user_ms(
+        "network_isolator/plugin_cpu_user_ms"),
+    plugin_cpu_system_ms(
+        "network_isolator/plugin_cpu_system_ms"),
+    plugin_run_time(
+        "network_isolator/plugin_run_time"),
+    plugin_cgroup_cpu_usage_secs(
+        "network_isolator/plugin_cgroup_cpu_usage_secs",
+        defer(process,
+              &NetworkIsolatorProcess::_plugin_cgroup_cpu_usage_secs)),
+    ipam_queue_depth(
+        "network_isolator/ipam_queue_depth",
+        defer(process, &NetworkIsolatorProcess::_ipam_queue_depth)),
+    isolator_queue_depth(
+        "network_isolator/isolator_queue_depth",
+        defer(process, &NetworkIsolatorProcess::_isolator_queue_depth)),
+    ipam_breaker_open(
+        "network_isolator/ipam_breaker_open",
+        defer(process, &NetworkIsolatorProcess::_ipam_breaker_open)),
+    isolator_breaker_open(
+        "network_isolator/isolator_breaker_open",
+        defer(process, &NetworkIsolatorProcess::_isolator_breaker_open)),
+    ipam_hedged_allocations(
+        "network_isolator/ipam_hedged_allocations"),
+    ipam_hedge_wins(
+        "network_isolator/ipam_hedge_wins"),
+    ipam_hedge_releases(
+        "network_isolator/ipam_hedge_releases"),
+    ipam_speculation_hits(
+        "network_isolator/ipam_speculation_hits"),
+    ipam_speculation_expirations(
+        "network_isolator/ipam_speculation_expirations"),
+    netns_pool_available(
+        "network_isolator/netns_pool_available",
+        defer(process, &NetworkIsolatorProcess::_netns_pool_available)),
+    netns_pool_hits(
+        "network_isolator/netns_pool_hits"),
+    ipam_blocks(
+        "network_isolator/ipam_blocks",
+        defer(process, &NetworkIsolatorProcess::_ipam_blocks)),
+    ipam_block_claims(
+        "network_isolator/ipam_block_claims"),
+    ipam_sticky_hits(
+        "network_isolator/ipam_sticky_hits"),
+    ipam_sticky_releases(
+        "network_isolator/ipam_sticky_releases")
+{
+  process::metrics::add(plugin_runs);
+  process::metrics::add(plugin_failures);
+  process::metrics::add(plugin_cpu_user_ms);
+  process::metrics::add(plugin_cpu_system_ms);
+  process::metrics::add(plugin_run_time);
+  process::metrics::add(plugin_cgroup_cpu_usage_secs);
+  process::metrics::add(ipam_queue_depth);
+  process::metrics::add(isolator_queue_depth);
+  process::metrics::add(ipam_breaker_open);
+  process::metrics::add(isolator_breaker_open);
+  process::metrics::add(ipam_hedged_allocations);
+  process::metrics::add(ipam_hedge_wins);
+  process::metrics::add(ipam_hedge_releases);
+  process::metrics::add(ipam_speculation_hits);
+  process::metrics::add(ipam_speculation_expirations);
+  process::metrics::add(netns_pool_available);
+  process::metrics::add(netns_pool_hits);
+  process::metrics::add(ipam_blocks);
+  process::metrics::add(ipam_block_claims);
+  process::metrics::add(ipam_sticky_hits);
+  process::metrics::add(ipam_sticky_releases);
+}
+
+
+NetworkIsolatorProcess::Metrics::~Metrics()
+{
+  process::metrics::remove(plugin_runs);
+  process::metrics::remove(plugin_failures);
+  process::metrics::remove(plugin_cpu_user_ms);
+  process::metrics::remove(plugin_cpu_system_ms);
+  process::metrics::remove(plugin_run_time);
+  process::metrics::remove(plugin_cgroup_cpu_usage_secs);
+  process::metrics::remove(ipam_queue_depth);
+  process::metrics::remove(isolator_queue_depth);
+  process::metrics::remove(ipam_breaker_open);
+  process::metrics::remove(isolator_breaker_open);
+  process::metrics::remove(ipam_hedged_allocations);
+  process::metrics::remove(ipam_hedge_wins);
+  process::metrics::remove(ipam_hedge_releases);
+  process::metrics::remove(ipam_speculation_hits);
+  process::metrics::remove(ipam_speculation_expirations);
+  process::metrics::remove(netns_pool_available);
+  process::metrics::remove(netns_pool_hits);
+  process::metrics::remove(ipam_blocks);
+  process::metrics::remove(ipam_block_claims);
+  process::metrics::remove(ipam_sticky_hits);
+  process::metrics::remove(ipam_sticky_releases);
+}
+
+
+Plugin::Plugin(
+    const string& name_,
+    process::Owned<PluginCommand> command_,
+    size_t limit_,
+    const RetryPolicy& retry_,
+    const CircuitBreaker& breaker_)
+  : name(name_),
+    command(command_),
+    limit(limit_),
+    running(0),
+    retry(retry_),
+    breaker(breaker_),
+    queue_wait_time("network_isolator/" + name_ + "_queue_wait_time"),
+    retries("network_isolator/" + name_ + "_retries"),
+    breaker_trips("network_isolator/" + name_ + "_breaker_trips"),
+    breaker_rejections("network_isolator/" + name_ + "_breaker_rejections")
+{
+  process::metrics::add(queue_wait_time);
+  process::metrics::add(retries);
+  process::metrics::add(breaker_trips);
+  process::metrics::add(breaker_rejections);
+}
+
+
+Plugin::~Plugin()
+{
+  process::metrics::remove(queue_wait_time);
+  process::metrics::remove(retries);
+  process::metrics::remove(breaker_trips);
+  process::metrics::remove(breaker_rejections);
+}
+
+
+size_t Plugin::waiting() const
+{
+  size_t result = 0;
+  for (int priority = 0; priority < PLUGIN_PRIORITIES; priority++) {
+    result += queues[priority].size();
+  }
+  return result;
+}
+
+
+double NetworkIsolatorProcess::_ipam_queue_depth()
+{
+  return ipamPlugin->waiting();
+}
+
+
+double NetworkIsolatorProcess::_isolator_queue_depth()
+{
+  return isolatorPlugin->waiting();
+}
+
+
+double NetworkIsolatorProcess::_ipam_breaker_open()
+{
+  return ipamPlugin->breaker.state == CircuitBreaker::CLOSED ? 0 : 1;
+}
+
+
+double NetworkIsolatorProcess::_isolator_breaker_open()
+{
+  return isolatorPlugin->breaker.state == CircuitBreaker::CLOSED ? 0 : 1;
+}
+
+
+Future<Nothing> NetworkIsolatorProcess::admit(
+    const process::Owned<Plugin>& plugin,
+    PluginPriority priority)
+{
+  if (plugin->limit == 0 || plugin->running < plugin->limit) {
+    plugin->running++;
+    return Nothing();
+  }
+
+  process::Owned<Promise<Nothing>> promise(new Promise<Nothing>());
+  plugin->queues[priority].push_back(promise);
+
+  return plugin->queue_wait_time.time(promise->future());
+}
+
+
+void NetworkIsolatorProcess::retire(const process::Owned<Plugin>& plugin)
+{
+  for (int priority = 0; priority < PLUGIN_PRIORITIES; priority++) {
+    if (!plugin->queues[priority].empty()) {
+      process::Owned<Promise<Nothing>> next =
+        plugin->queues[priority].front();
+      plugin->queues[priority].pop_front();
+
+      // The slot goes straight to the next invocation.
+      next->set(Nothing());
+      return;
+    }
+  }
+
+  CHECK_GT(plugin->running, 0u);
+  plugin->running--;
+}
+
+
+Future<PluginRun> NetworkIsolatorProcess::runPlugin(
+    const process::Owned<Plugin>& plugin,
+    const string& input)
+{
+  const PluginCommand& command = *plugin->command;
+
+  int inFd = -1;
+  size_t written = 0;
+  int outFd = -1;
+
+  LOG(INFO) << "Sending command to " + command.command + ": " << input;
+
+  Try<pid_t> childPid = popen2(
+      command,
+      placement,
+      input,
+      ring.get() != NULL,
+      &inFd,
+      &written,
+      &outFd);
+  if (childPid.isError()) {
+    return Failure("Error creating subprocess: " + childPid.error());
+  }
+
+  const std::shared_ptr<string> buffer =
+    std::make_shared<string>(MAX_JSON_OUTPUT_SIZE + 1, '\0');
+
+  Future<string> output;
+
+  if (ring.get() != NULL) {
+    // Only inputs larger than the pipe buffer are left over.
+    if (inFd != -1) {
+      ringWrite(inFd, std::make_shared<string>(input.substr(written)), 0);
+    }
+
+    std::shared_ptr<Promise<string>> promise(new Promise<string>());
+    ringRead(outFd, buffer, 0, promise);
+    output = promise->future();
+  } else {
+    // io::write() works on its own duplicate of the descriptor.
+    if (inFd != -1) {
+      io::write(inFd, input.substr(written));
+      os::close(inFd);
+    }
+
+    output = readResponse(outFd, buffer, 0)
+      .onAny([outFd]() { os::close(outFd); });
+  }
+
+  return metrics.plugin_run_time.time(
+      collect(output, reap(childPid.get()))
+        .then(defer(self(),
+                    &Self::_runPlugin,
+                    command.command,
+                    childPid.get(),
+                    lambda::_1)));
+}
+
+
+void NetworkIsolatorProcess::ringRead(
+    int fd,
+    const std::shared_ptr<string>& buffer,
+    size_t offset,
+    const std::shared_ptr<Promise<string>>& promise)
+{
+  if (offset == buffer->size()) {
+    promise->fail(
+        "Response exceeds the maximum of " +
+        stringify(MAX_JSON_OUTPUT_SIZE) + " bytes");
+    ringClose(fd);
+    return;
+  }
+
+  Try<Nothing> read = ring->read(
+      fd,
+      &(*buffer)[offset],
+      buffer->size() - offset,
+      [=](int result) {
+        if (result == -EINTR || result == -EAGAIN) {
+          ringRead(fd, buffer, offset, promise);
+          return;
+        }
+
+        if (result > 0) {
+          ringRead(fd, buffer, offset + result, promise);
+          return;
+        }
+
+        if (result == 0) {
+          buffer->resize(offset);
+          promise->set(*buffer);
+        } else {
+          promise->fail(
+              "Failed to read plugin response: " + string(strerror(-result)));
+        }
+        ringClose(fd);
+      });
+
+  if (read.isError()) {
+    promise->fail("Failed to read plugin response: " + read.error());
+    os::close(fd);
+    return;
+  }
+
+  ringQueued();
+}
+
+
+void NetworkIsolatorProcess::ringWrite(
+    int fd,
+    const std::shared_ptr<string>& data,
+    size_t offset)
+{
+  Try<Nothing> write = ring->write(
+      fd,
+      data->data() + offset,
+      data->size() - offset,
+      [=](int result) {
+        if (result == -EINTR || result == -EAGAIN) {
+          ringWrite(fd, data, offset);
+          return;
+        }
+
+        // The plugin sees a truncated request if this fails, and its
+        // reply tells.
+        if (result > 0 && offset + result < data->size()) {
+          ringWrite(fd, data, offset + result);
+          return;
+        }
+
+        if (result < 0) {
+          LOG(WARNING) << "Failed to write plugin request: "
+                       << strerror(-result);
+        }
+        ringClose(fd);
+      });
+
+  if (write.isError()) {
+    LOG(WARNING) << "Failed to write plugin request: " << write.error();
+    os::close(fd);
+    return;
+  }
+
+  ringQueued();
+}
+
+
+void NetworkIsolatorProcess::ringClose(int fd)
+{
+  if (ring->close(fd, [](int) {}).isError()) {
+    os::close(fd);
+    return;
+  }
+
+  ringQueued();
+}
+
+
+void NetworkIsolatorProcess::ringQueued()
+{
+  // Everything queued until the actor gets to it goes in one submission.
+  if (!ringSubmitting) {
+    ringSubmitting = true;
+    dispatch(self(), &Self::submitRing);
+  }
+}
+
+
+void NetworkIsolatorProcess::submitRing()
+{
+  ringSubmitting = false;
+
+  Try<Nothing> submit = ring->submit();
+  if (submit.isError()) {
+    // The queued operations stay queued.
+    LOG(WARNING) << submit.error();
+    ringSubmitting = true;
+    delay(PLUGIN_RING_RETRY_INTERVAL, self(), &Self::submitRing);
+  }
+
+  if (!ringPolling && ring->pending() > 0) {
+    ringPolling = true;
+    io::poll(ring->eventfd(), io::READ)
+      .onAny(defer(self(), &Self::reapRing));
+  }
+}
+
+
+void NetworkIsolatorProcess::reapRing()
+{
+  ringPolling = false;
+
+  ring->reap();
+
+  if (ring->pending() > 0) {
+    ringPolling = true;
+    io::poll(ring->eventfd(), io::READ)
+      .onAny(defer(self(), &Self::reapRing));
+  }
+}
+
+
+Future<PluginRun> NetworkIsolatorProcess::_runPlugin(
+    const string& command,
+    pid_t pid,
+    const std::tuple<string, PluginExit>& result)
+{
+  PluginRun run;
+  run.output = std::get<0>(result);
+  run.exit = std::get<1>(result);
+
+  const int64_t userMs = milliseconds(run.exit.usage.ru_utime);
+  const int64_t systemMs = milliseconds(run.exit.usage.ru_stime);
+
+  ++metrics.plugin_runs;
+  metrics.plugin_cpu_user_ms += userMs;
+  metrics.plugin_cpu_system_ms += systemMs;
+
+  if (!WIFEXITED(run.exit.status) || WEXITSTATUS(run.exit.status) != 0) {
+    ++metrics.plugin_failures;
+    LOG(WARNING) << command << " (pid " << pid << ") "
+                 << (WIFEXITED(run.exit.status)
+                       ? "exited with status " +
+                         stringify(WEXITSTATUS(run.exit.status))
+                       : "was terminated by signal " +
+                         stringify(WTERMSIG(run.exit.status)));
+  }
+
+  LOG(INFO) << "Got response from " << command << " (pid " << pid << ", "
+            << userMs << "ms user, " << systemMs << "ms system): "
+            << run.output;
+
+  return run;
+}
+
+
+template <typename InProto, typename OutProto>
+Future<OutProto> NetworkIsolatorProcess::runCommand(
+    const process::Owned<Plugin>& plugin,
+    const InProto& command,
+    PluginPriority priority)
+{
+  return invoke(
+      plugin,
+      command.command(),
+      stringify(JSON::protobuf(command)),
+      priority,
+      1)
+    .then(lambda::bind(&parseProtobuf<OutProto>, lambda::_1));
+}
+
+
+Future<JSON::Object> NetworkIsolatorProcess::invoke(
+    const process::Owned<Plugin>& plugin,
+    const string& command,
+    const string& input,
+    PluginPriority priority,
+    size_t attempt)
+{
+  CircuitBreaker& breaker = plugin->breaker;
+
+  if (breaker.state == CircuitBreaker::OPEN &&
+      Clock::now() - breaker.opened >= breaker.timeout) {
+    LOG(INFO) << "Trying " << plugin->name << " plugin again after its "
+              << "circuit breaker opened " << breaker.timeout << " ago";
+    breaker.state = CircuitBreaker::HALF_OPEN;
+    breaker.trial = false;
+  }
+
+  // Fail fast rather than piling up calls to a plugin that keeps failing;
+  // a half open breaker lets a single trial call through.
+  if (breaker.state == CircuitBreaker::OPEN ||
+      (breaker.state == CircuitBreaker::HALF_OPEN && breaker.trial)) {
+    ++plugin->breaker_rejections;
+    return Failure(
+        "Circuit breaker of the " + plugin->name + " plugin is open");
+  }
+
+  if (breaker.state == CircuitBreaker::HALF_OPEN) {
+    breaker.trial = true;
+  }
+
+  return admit(plugin, priority)
+    .then(defer(self(), &Self::runPlugin, plugin, input))
+    .onAny(defer(self(), &Self::retire, plugin))
+    .then(lambda::bind(&parseResponse, plugin->command->command, lambda::_1))
+    .onAny(defer(self(), &Self::record, plugin, lambda::_1))
+    .repair(defer(self(),
+                  &Self::retry,
+                  plugin,
+                  command,
+                  input,
+                  priority,
+                  attempt,
+                  lambda::_1))
+    .then(lambda::bind(&checkResponse, plugin->command->command, lambda::_1));
+}
+
+
+void NetworkIsolatorProcess::record(
+    const process::Owned<Plugin>& plugin,
+    const Future<JSON::Object>& result)
+{
+  CircuitBreaker& breaker = plugin->breaker;
+
+  if (result.isReady()) {
+    if (breaker.state != CircuitBreaker::CLOSED) {
+      LOG(INFO) << "Closing the circuit breaker of the " << plugin->name
+                << " plugin";
+    }
+    breaker.state = CircuitBreaker::CLOSED;
+    breaker.failures = 0;
+    return;
+  }
+
+  breaker.failures++;
+
+  if (breaker.threshold == 0) {
+    return;
+  }
+
+  if (breaker.state == CircuitBreaker::HALF_OPEN ||
+      (breaker.state == CircuitBreaker::CLOSED &&
+       breaker.failures >= breaker.threshold)) {
+    LOG(WARNING) << "Opening the circuit breaker of the " << plugin->name
+                 << " plugin for " << breaker.timeout << " after "
+                 << breaker.failures << " consecutive failures";
+    ++plugin->breaker_trips;
+    breaker.state = CircuitBreaker::OPEN;
+    breaker.opened = Clock::now();
+  }
+}
+
+
+Future<JSON::Object> NetworkIsolatorProcess::retry(
+    const process::Owned<Plugin>& plugin,
+    const string& command,
+    const string& input,
+    PluginPriority priority,
+    size_t attempt,
+    const Future<JSON::Object>& result)
+{
+  const RetryPolicy& policy = plugin->retry;
+
+  if (!policy.commands.contains(command) ||
+      attempt > policy.retries ||
+      plugin->breaker.state == CircuitBreaker::OPEN) {
+    return Failure(result.failure());
+  }
+
+  // Exponential backoff with equal jitter: wait between half and all of
+  // the current backoff so that retries of a burst of calls spread out.
+  Duration backoff = policy.backoff;
+  for (size_t i = 1; i < attempt && backoff < policy.maxBackoff; i++) {
+    backoff = backoff * 2;
+  }
+  backoff = std::min(backoff, policy.maxBackoff);
+  backoff = backoff / 2 + backoff / 2 * ((double) ::random() / RAND_MAX);
+
+  LOG(WARNING) << "Retrying '" << command << "' with the " << plugin->name
+               << " plugin in " << backoff << " after attempt " << attempt
+               << " failed: " << result.failure();
+
+  ++plugin->retries;
+
+  return elapse(backoff)
+    .then(defer(self(),
+                &Self::invoke,
+                plugin,
+                command,
+                input,
+                priority,
+                attempt + 1));
+}
+
+
+// Returns the NetworkInfo of the container 'executorInfo' describes, as
+// a pointer into 'executorInfo', or None if the container does not ask
+// for networking.
+static Result<const NetworkInfo*> getNetworkInfo(
+    const ExecutorInfo& executorInfo)
+{
+  if (!executorInfo.has_container() ||
+      executorInfo.container().network_infos().size() == 0) {
+    return None();
+  }
+
+  if (executorInfo.container().network_infos().size() > 1) {
+    return Error(
+        "NetworkIsolator:: multiple NetworkInfos are not supported.");
+  }
+
+  const NetworkInfo& networkInfo = executorInfo.container().network_infos(0);
+
+  if (networkInfo.has_protocol()) {
+    return Error(
+      "NetworkIsolator: NetworkInfo.protocol is deprecated and unsupported.");
+  }
+  if (networkInfo.has_ip_address()) {
+    return Error(
+      "NetworkIsolator: NetworkInfo.ip_address is deprecated and"
+      " unsupported.");
+  }
+
+  return &networkInfo;
+}
+
+
+process::Future<Option<ContainerLaunchInfo>> NetworkIsolatorProcess::prepare(
+    const ContainerID& containerId,
+    const ContainerConfig& containerConfig)
+{
+  LOG(INFO) << "NetworkIsolator::prepare for container: " << containerId;
+
+  const ExecutorInfo& executorInfo = containerConfig.executorinfo();
+  const string executor =
+    executorKey(executorInfo.framework_id(), executorInfo.executor_id());
+
+  Result<const NetworkInfo*> result = getNetworkInfo(executorInfo);
+  if (result.isError()) {
+    return Failure(result.error());
+  } else if (result.isNone()) {
+    LOG(INFO) << "NetworkIsolator::prepare Ignoring request as "
+              << "executorInfo.container.network_infos is missing for "
+              << "container: " << containerId;
+    return None();
+  }
+
+  const NetworkInfo& networkInfo = *result.get();
+
+  // Only these are kept with the container, the NetworkInfo itself is
+  // not copied beyond this point.
+  vector<Dictionary<string>::Id> netgroups;
+  vector<Dictionary<Label>::Id> labels;
+  intern(networkInfo, &netgroups, &labels);
+
+  Option<string> key;
+  if (options.stickyTtl > Duration::zero()) {
+    key = stickyKey(executorInfo, networkInfo);
+  }
+
+  // A relaunched executor gets its IPs back, if still held for it.
+  Option<StickyAddresses> held;
+  if (key.isSome()) {
+    held = unstick(key.get());
+  }
+
+  if (held.isSome()) {
+    LOG(INFO) << "Reusing IP(s) " << join(held.get().addresses)
+              << " for container " << containerId;
+    ++metrics.ipam_sticky_hits;
+
+    abandon(executor);
+
+    return _prepare(
+        containerId,
+        executor,
+        netgroups,
+        labels,
+        held.get().uid,
+        held.get().addresses,
+        key);
+  }
+
+  if (!pool.empty() && poolable(networkInfo)) {
+    const PooledNamespace pooled = std::move(pool.front());
+    pool.pop_front();
+
+    LOG(INFO) << "Using pooled network namespace " << pooled.id
+              << " for container " << containerId;
+    ++metrics.netns_pool_hits;
+
+    abandon(executor);
+
+    refill();
+
+    Future<Option<ContainerLaunchInfo>> launchInfo = _prepare(
+        containerId,
+        executor,
+        netgroups,
+        labels,
+        pooled.id,
+        pooled.addresses,
+        key);
+
+    (*infos)[containerId]->pooledNamespace = pooled.id;
+    return launchInfo;
+  }
+
+  string uid;
+  Future<vector<net::IP>> addresses;
+
+  // Pick up the allocation the NetworkHook started when the task was
+  // accepted, unless it went wrong or the NetworkInfo has changed since.
+  if (speculations.contains(executor)) {
+    const SpeculativeAllocation& speculation = speculations.at(executor);
+
+    if (!speculation.addresses.isFailed() &&
+        !speculation.addresses.isDiscarded() &&
+        speculation.networkInfo.SerializeAsString() ==
+          networkInfo.SerializeAsString()) {
+      LOG(INFO) << "Using speculative IP allocation for container "
+                << containerId;
+      ++metrics.ipam_speculation_hits;
+      uid = speculation.uid;
+      addresses = speculation.addresses;
+    } else {
+      speculation.addresses
+        .onReady(defer(self(), &Self::releaseIPs, lambda::_1));
+    }
+
+    speculations.erase(executor);
+  }
+
+  if (uid.empty()) {
+    uid = UUID::random().toString();
+    addresses = acquire(networkInfo, uid);
+  }
+
+  return addresses
+    .then(defer(self(),
+                &Self::_prepare,
+                containerId,
+                executor,
+                netgroups,
+                labels,
+                uid,
+                lambda::_1,
+                key))
+    .onAny([netgroups, labels](
+        const Future<Option<ContainerLaunchInfo>>& launchInfo) {
+      // Otherwise the container's Info holds on to them.
+      if (!launchInfo.isReady()) {
+        release(netgroups, labels);
+      }
+    });
+}
+
+
+// Reserves the IPs 'networkInfo' asks for and allocates the rest.
+process::Future<vector<net::IP>> NetworkIsolatorProcess::acquire(
+    const NetworkInfo& networkInfo,
+    const string& uid)
+{
+  // Two IPAM commands:
+  // 1) reserve for IPs the user has specifically asked for.
+  // 2) auto-assign IPs.
+  // Spin through all IPAddress messages once to get info for each command.
+  // Then we'll issue each command if needed.
+  IPAMReserveIPMessage& reserveMessage = recycle(&recycled.reserve);
+  IPAMReserveIPMessage::Args* reserveArgs = reserveMessage.mutable_args();
+
+  // Counter of IPs to auto assign.
+  int numIPv4 = 0;
+  vector<net::IP> addresses;
+  foreach (const NetworkInfo::IPAddress& ipAddress, networkInfo.ip_addresses()) {
+    if (ipAddress.has_ip_address() && ipAddress.has_protocol()) {
+      return Failure("NetworkIsolator: Cannot include both ip_address and "
+                     "protocol in a request.");
+    }
+    if (ipAddress.has_ip_address()) {
+      Try<net::IP> address = net::IP::parse(ipAddress.ip_address(), AF_INET);
+      if (address.isError()) {
+        return Failure(
+            "NetworkIsolator: Invalid IP address '" +
+            ipAddress.ip_address() + "': " + address.error());
+      }
+
+      // Store IP to attempt to reserve.
+      addresses.push_back(address.get());
+      reserveArgs->add_ipv4_addrs(stringify(address.get()));
+    } else if (ipAddress.has_protocol() &&
+               ipAddress.protocol() == NetworkInfo::IPv6){
+      return Failure("NetworkIsolator: IPv6 is not supported at this time.");
+    } else {
+      // Either protocol is IPv4, or not included (in which case we default to
+      // IPv4 anyway).
+      numIPv4++;
+    }
+  }
+
+  if (!(reserveArgs->ipv4_addrs_size() + numIPv4)) {
+    return Failure(
+      "NetworkIsolator: Container requires at least one IP address.");
+  }
+
+  // Reserve provided IPs first.
+  Future<vector<net::IP>> reserved = vector<net::IP>();
+  if (reserveArgs->ipv4_addrs_size()) {
+    reserveArgs->set_hostname(slaveInfo.hostname());
+    reserveArgs->set_uid(uid);
+    reserveArgs->mutable_netgroups()->CopyFrom(networkInfo.groups());
+    reserveArgs->mutable_labels()->CopyFrom(networkInfo.labels().labels());
+
+    LOG(INFO) << "Sending IP reserve command to IPAM";
+    reserved = annotate(
+        runIpam(reserveMessage, LAUNCH_PRIORITY),
+        "Error reserving IPs with IPAM: ")
+      .then([addresses]() -> vector<net::IP> {
+        LOG(INFO) << "IP(s) " << join(addresses) << " reserved with IPAM";
+        return addresses;
+      });
+  }
+
+  if (numIPv4 == 0) {
+    return reserved;
+  }
+
+  IPAMRequestIPMessage requestMessage;
+  IPAMRequestIPMessage::Args* requestArgs = requestMessage.mutable_args();
+  requestArgs->set_num_ipv4(numIPv4);
+  requestArgs->set_hostname(slaveInfo.hostname());
+  requestArgs->set_uid(uid);
+
+  requestArgs->mutable_netgroups()->CopyFrom(networkInfo.groups());
+  requestArgs->mutable_labels()->CopyFrom(networkInfo.labels().labels());
+
+  return reserved
+    .then(defer(self(), &Self::allocate, requestMessage, lambda::_1));
+}
+
+
+void NetworkIsolatorProcess::speculate(const ExecutorInfo& executorInfo)
+{
+  const ExecutorID& executorId = executorInfo.executor_id();
+  const string executor =
+    executorKey(executorInfo.framework_id(), executorInfo.executor_id());
+
+  // Only the task that launches an executor gets a container.
+  if (options.speculationTimeout == Duration::zero() ||
+      speculations.contains(executor) ||
+      executorContainerIds->contains(executor)) {
+    return;
+  }
+
+  Result<const NetworkInfo*> networkInfo = getNetworkInfo(executorInfo);
+  if (!networkInfo.isSome()) {
+    // prepare() reports any error.
+    return;
+  }
+
+  // The container is going to get its earlier IPs, or a pooled
+  // namespace and its IP.
+  if ((options.stickyTtl > Duration::zero() &&
+       stickyKeys.contains(stickyKey(executorInfo, *networkInfo.get()))) ||
+      (!pool.empty() && poolable(*networkInfo.get()))) {
+    return;
+  }
+
+  LOG(INFO) << "Speculatively allocating IPs for executor " << executorId;
+
+  SpeculativeAllocation speculation;
+  speculation.networkInfo = *networkInfo.get();
+  speculation.uid = UUID::random().toString();
+  speculation.addresses = acquire(*networkInfo.get(), speculation.uid);
+  speculations[executor] = speculation;
+
+  elapse(options.speculationTimeout)
+    .onReady(defer(self(), &Self::expire, executor, speculation.uid));
+}
+
+
+void NetworkIsolatorProcess::expire(
+    const string& executor,
+    const string& uid)
+{
+  if (!speculations.contains(executor) ||
+      speculations.at(executor).uid != uid) {
+    return;
+  }
+
+  // The executor was never launched, e.g. the task was killed while
+  // being fetched.
+  LOG(INFO) << "Speculative IP allocation for executor " << executor
+            << " expired";
+  ++metrics.ipam_speculation_expirations;
+
+  speculations.at(executor).addresses
+    .onReady(defer(self(), &Self::releaseIPs, lambda::_1));
+  speculations.erase(executor);
+}
+
+
+void NetworkIsolatorProcess::abandon(const string& executor)
+{
+  if (speculations.contains(executor)) {
+    speculations.at(executor).addresses
+      .onReady(defer(self(), &Self::releaseIPs, lambda::_1));
+    speculations.erase(executor);
+  }
+}
+
+
+void NetworkIsolatorProcess::stick(
+    const string& key,
+    const string& uid,
+    const vector<net::IP>& addresses)
+{
+  // Not expected, as only one container runs an executor at a time.
+  if (stickyKeys.contains(key)) {
+    expireSticky(key, stickyKeys.at(key)->generation);
+  }
+
+  StickyAddresses held;
+  held.key = key;
+  held.uid = uid;
+  held.addresses = addresses;
+  held.generation = ++stickyGeneration;
+
+  // Recorded so that an agent restart does not lose track of them.
+  Try<Nothing> write =
+    writeAddresses(path::join(options.stickyDir, uid + ".json"), addresses);
+  if (write.isError()) {
+    LOG(WARNING) << "Failed to record IP(s) " << join(addresses)
+                 << ", releasing them: " << write.error();
+    releaseIPs(addresses);
+    return;
+  }
+
+  LOG(INFO) << "Holding back IP(s) " << join(addresses)
+            << " for " << options.stickyTtl;
+
+  sticky.push_front(held);
+  stickyKeys[key] = sticky.begin();
+
+  while (sticky.size() > options.stickySize) {
+    const StickyAddresses oldest = sticky.back();
+    expireSticky(oldest.key, oldest.generation);
+  }
+
+  elapse(options.stickyTtl)
+    .onReady(defer(self(), &Self::expireSticky, key, held.generation));
+}
+
+
+Option<StickyAddresses> NetworkIsolatorProcess::unstick(const string& key)
+{
+  if (!stickyKeys.contains(key)) {
+    return None();
+  }
+
+  const StickyAddresses held = *stickyKeys.at(key);
+  sticky.erase(stickyKeys.at(held.key));
+  stickyKeys.erase(held.key);
+
+  os::rm(path::join(options.stickyDir, held.uid + ".json"));
+
+  return held;
+}
+
+
+void NetworkIsolatorProcess::expireSticky(
+    const string& key,
+    uint64_t generation)
+{
+  if (!stickyKeys.contains(key) ||
+      stickyKeys.at(key)->generation != generation) {
+    return;
+  }
+
+  const StickyAddresses held = unstick(key).get();
+
+  ++metrics.ipam_sticky_releases;
+  releaseIPs(held.addresses);
+}
+
+
+void NetworkIsolatorProcess::recoverSticky()
+{
+  if (!os::exists(options.stickyDir)) {
+    return;
+  }
+
+  Try<std::list<string>> entries = os::ls(options.stickyDir);
+  if (entries.isError()) {
+    LOG(WARNING) << "Failed to list '" << options.stickyDir << "': "
+                 << entries.error();
+    return;
+  }
+
+  foreach (const string& entry, entries.get()) {
+    const string metadata = path::join(options.stickyDir, entry);
+
+    const vector<net::IP> release = readAddresses(metadata);
+    if (!release.empty()) {
+      ++metrics.ipam_sticky_releases;
+      releaseIPs(release);
+    }
+
+    os::rm(metadata);
+  }
+}
+
+
+process::Future<vector<net::IP>> NetworkIsolatorProcess::allocate(
+    const IPAMRequestIPMessage& message,
+    const vector<net::IP>& reserved)
+{
+  LOG(INFO) << "Sending IP request command to IPAM";
+  return annotate(
+      requestIPs(message),
+      "Error allocating IP from IPAM: ")
+    .then(defer(self(),
+                &Self::_allocate,
+                message.args().uid(),
+                reserved,
+                lambda::_1));
+}
+
+
+process::Future<vector<net::IP>> NetworkIsolatorProcess::_allocate(
+    const string& uid,
+    const vector<net::IP>& reserved,
+    const IPAMResponse& response)
+{
+  vector<net::IP> addresses = reserved;
+  Option<string> error;
+
+  if (response.ipv4().size() == 0) {
+    error = "No IPv4 addresses received from IPAM.";
+  }
+
+  foreach (const string& address, response.ipv4()) {
+    Try<net::IP> ip = net::IP::parse(address, AF_INET);
+    if (ip.isError()) {
+      error = "Malformed IPAM response: Invalid IP address '" + address +
+        "': " + ip.error();
+    } else {
+      addresses.push_back(ip.get());
+    }
+  }
+
+  if (error.isNone()) {
+    LOG(INFO) << "IP(s) " << join(vector<net::IP>(
+                     addresses.begin() + reserved.size(), addresses.end()))
+              << " allocated with IPAM.";
+    return addresses;
+  }
+
+  // Nothing is going to use the addresses, those that IPAM handed out
+  // nor those it reserved. The ones that did not parse can only be
+  // named by the uid.
+  if (!addresses.empty()) {
+    releaseIPs(addresses);
+  }
+
+  if ((size_t) response.ipv4().size() > addresses.size() - reserved.size()) {
+    IPAMReleaseIPMessage& message = recycle(&recycled.release);
+    message.mutable_args()->set_uid(uid);
+
+    LOG(INFO) << "Requesting IPAM to release the IPs of uid " << uid;
+
+    runIpam(message, CLEANUP_PRIORITY)
+      .onFailed([uid](const string& failure) {
+        LOG(ERROR) << "Failed to release the IPs of uid " << uid << ": "
+                   << failure;
+      });
+  }
+
+  return Failure(error.get());
+}
+
+
+Future<IPAMResponse> NetworkIsolatorProcess::requestIPs(
+    const IPAMRequestIPMessage& message)
+{
+  Future<IPAMResponse> first = timedRequestIPs(message);
+
+  if (options.hedgePercentile == 0 ||
+      allocationLatencies.size() < HEDGE_MIN_SAMPLES) {
+    return first;
+  }
+
+  vector<Duration> latencies(
+      allocationLatencies.begin(), allocationLatencies.end());
+  vector<Duration>::iterator delay = latencies.begin() +
+    (size_t) (latencies.size() * options.hedgePercentile / 100);
+  std::nth_element(latencies.begin(), delay, latencies.end());
+
+  process::Owned<HedgedAllocation> allocation(new HedgedAllocation());
+  allocation->pending = 1;
+
+  first.onAny(defer(self(), &Self::_hedge, allocation, false, lambda::_1));
+
+  elapse(*delay)
+    .onReady(defer(self(), &Self::hedge, allocation, message));
+
+  return allocation->promise.future();
+}
+
+
+Future<IPAMResponse> NetworkIsolatorProcess::timedRequestIPs(
+    const IPAMRequestIPMessage& message)
+{
+  return runIpam(message, LAUNCH_PRIORITY)
+    .onReady(defer(self(), &Self::sampleAllocation, Clock::now()));
+}
+
+
+void NetworkIsolatorProcess::sampleAllocation(const Time& start)
+{
+  allocationLatencies.push_back(Clock::now() - start);
+  if (allocationLatencies.size() > HEDGE_WINDOW) {
+    allocationLatencies.pop_front();
+  }
+}
+
+
+void NetworkIsolatorProcess::hedge(
+    const process::Owned<HedgedAllocation>& allocation,
+    const IPAMRequestIPMessage& message)
+{
+  if (allocation->decided) {
+    return;
+  }
+
+  // The second request carries the same 'uid' as the first.
+  LOG(INFO) << "Hedging IP request for uid " << message.args().uid();
+
+  ++metrics.ipam_hedged_allocations;
+  allocation->pending++;
+
+  timedRequestIPs(message)
+    .onAny(defer(self(), &Self::_hedge, allocation, true, lambda::_1));
+}
+
+
+void NetworkIsolatorProcess::_hedge(
+    const process::Owned<HedgedAllocation>& allocation,
+    bool second,
+    const Future<IPAMResponse>& response)
+{
+  allocation->pending--;
+
+  if (response.isReady() && !allocation->decided) {
+    if (second) {
+      ++metrics.ipam_hedge_wins;
+    }
+    allocation->decided = true;
+    allocation->winner = response.get();
+    allocation->promise.set(response.get());
+    return;
+  }
+
+  if (response.isReady()) {
+    // Both requests got addresses; give back those of the loser, unless
+    // IPAM handed out the same ones twice for the shared 'uid'.
+    hashset<string> used;
+    foreach (const string& address, allocation->winner.ipv4()) {
+      used.insert(address);
+    }
+
+    vector<string> duplicates;
+    foreach (const string& address, response.get().ipv4()) {
+      if (!used.contains(address)) {
+        duplicates.push_back(address);
+      }
+    }
+
+    Try<vector<net::IP>> release = parseIPs(duplicates);
+    if (release.isError()) {
+      LOG(WARNING) << "Not releasing IPs of the slower IPAM request: "
+                   << release.error();
+    } else if (!release.get().empty()) {
+      ++metrics.ipam_hedge_releases;
+      releaseIPs(release.get());
+    }
+    return;
+  }
+
+  if (!allocation->decided && allocation->pending == 0) {
+    allocation->decided = true;
+    allocation->promise.fail(
+        response.isFailed() ? response.failure() : "Discarded");
+  }
+}
+
+
+void NetworkIsolatorProcess::releaseIPs(const vector<net::IP>& addresses)
+{
+  IPAMReleaseIPMessage& message = recycle(&recycled.release);
+  foreach (const net::IP& address, addresses) {
+    message.mutable_args()->add_ips(stringify(address));
+  }
+
+  const string ips = join(addresses);
+
+  LOG(INFO) << "Requesting IPAM to release unused IPs: " << ips;
+
+  runIpam(message, CLEANUP_PRIORITY)
+    .onFailed([ips](const string& failure) {
+      LOG(ERROR) << "Failed to release unused IPs " << ips << ": " << failure;
+    });
+}
+
+
+process::Future<Option<ContainerLaunchInfo>> NetworkIsolatorProcess::_prepare(
+    const ContainerID& containerId,
+    const string& executor,
+    const vector<Dictionary<string>::Id>& netgroups,
+    const vector<Dictionary<Label>::Id>& labels,
+    const string& uid,
+    const vector<net::IP>& addresses,
+    const Option<string>& stickyKey)
+{
+  ContainerLaunchInfo launchInfo;
+  launchInfo.set_namespaces(CLONE_NEWNET);
+
+  Environment::Variable* variable =
+    launchInfo.mutable_environment()->add_variables();
+  variable->set_name("LIBPROCESS_IP");
+  // If more than one IP is available, just use the first.  LIBPROCESS just
+  // needs one, it doesn't matter which.
+  variable->set_value(stringify(addresses.front()));
+
+  Info* info = new Info(addresses, netgroups, uid, labels);
+  info->executor = executor;
+  info->stickyKey = stickyKey;
+
+  std::lock_guard<std::mutex> lock(containersMutex);
+  (*infos)[containerId] = info;
+  (*executorContainerIds)[executor] = containerId;
+
+  return launchInfo;
+}
+
+
+process::Future<Nothing> NetworkIsolatorProcess::isolate(
+    const ContainerID& containerId,
+    pid_t pid)
+{
+  if (!infos->contains(containerId)) {
+    LOG(INFO) << "NetworkIsolator::isolate Ignoring isolate request for unknown"
+              << " container: " << containerId;
+    return Nothing();
+  }
+  (*infos)[containerId]->pid = pid;
+
+  Try<Nothing> prioritized = prioritize(containerId);
+  if (prioritized.isError()) {
+    return Failure(prioritized.error());
+  }
+
+  const Info* info = (*infos)[containerId];
+
+  // Before the virtualizer adds links, for the 'default' settings of a
+  // profile to apply to them.
+  foreach (Dictionary<Label>::Id id, info->labels) {
+    const Label& label = labelPairs().lookup(id);
+    if (label.key() != sysctlProfileLabel) {
+      continue;
+    }
+
+    if (!options.sysctlProfiles.contains(label.value())) {
+      return Failure("Unknown sysctl profile '" + label.value() + "'");
+    }
+
+    Try<Nothing> sysctl = netlink::sysctl(
+        "/proc/" + stringify(pid) + "/ns/net",
+        options.sysctlProfiles.at(label.value()));
+    if (sysctl.isError()) {
+      return Failure(
+          "Failed to apply sysctl profile '" + label.value() + "': " +
+          sysctl.error());
+    }
+
+    LOG(INFO) << "Applied sysctl profile '" << label.value()
+              << "' to container " << containerId;
+  }
+
+  // The virtualizer is done with pooled namespaces, all that is left is
+  // taking over their links.
+  if (info->pooledNamespace.isSome()) {
+    const string& id = info->pooledNamespace.get();
+    const string netns = path::join(options.poolDir, id);
+
+    Try<Nothing> adopted = netlink::adopt(netns, pid);
+
+    removeNamespace(netns);
+    os::rm(path::join(options.poolDir, id + ".json"));
+
+    if (adopted.isError()) {
+      return Failure(
+          "Failed to move pooled network namespace " + id +
+          " into container: " + adopted.error());
+    }
+
+    LOG(INFO) << "Moved pooled network namespace " << id
+              << " into container " << containerId;
+    return Nothing();
+  }
+
+  IsolatorIsolateMessage& isolatorMessage = recycle(&recycled.isolate);
+  IsolatorIsolateMessage::Args* isolatorArgs = isolatorMessage.mutable_args();
+  isolatorArgs->set_hostname(slaveInfo.hostname());
+  isolatorArgs->set_container_id(containerId.value());
+  isolatorArgs->set_pid(pid);
+  foreach (const net::IP& addr, info->ipAddresses) {
+    isolatorArgs->add_ipv4_addrs(stringify(addr));
+  }
+  // isolatorArgs->add_ipv6_addrs();
+  foreach (Dictionary<string>::Id netgroup, info->netgroups) {
+    isolatorArgs->add_netgroups(netgroupNames().lookup(netgroup));
+  }
+  foreach (Dictionary<Label>::Id label, info->labels) {
+    isolatorArgs->add_labels()->CopyFrom(labelPairs().lookup(label));
+  }
+
+  LOG(INFO) << "Sending isolate command to Isolator";
+  return annotate(
+      runIsolator(isolatorMessage, LAUNCH_PRIORITY),
+      "Error running isolate command: ")
+    .then([]() { return Nothing(); });
+}
+
+
+Try<Nothing> NetworkIsolatorProcess::prioritize(const ContainerID& containerId)
+{
+  if (options.trafficClassDevice.isNone()) {
+    return Nothing();
+  }
+
+  Info* info = (*infos)[containerId];
+
+  Option<uint32_t> band;
+  foreach (Dictionary<Label>::Id id, info->labels) {
+    const Label& label = labelPairs().lookup(id);
+    if (label.key() != priorityLabel) {
+      continue;
+    }
+
+    if (label.value() == latencyPriority) {
+      band = LATENCY_BAND;
+    } else if (label.value() == bulkPriority) {
+      band = BULK_BAND;
+    } else {
+      LOG(WARNING) << "Ignoring unknown '" << priorityLabel << "' label '"
+                   << label.value() << "' of container " << containerId;
+    }
+  }
+
+  const string& device = options.trafficClassDevice.get();
+
+  // A filter an earlier agent added for one of the addresses outlived
+  // its container, as the address has been handed out again.
+  vector<uint32_t> stale;
+  foreach (const net::IP& address, info->ipAddresses) {
+    if (recoveredFilters.contains(stringify(address))) {
+      stale.push_back(recoveredFilters.at(stringify(address)));
+      recoveredFilters.erase(stringify(address));
+    }
+  }
+
+  if (band.isNone()) {
+    foreach (uint32_t filter, stale) {
+      Try<Nothing> unclassify = netlink::unclassify(device, filter);
+      if (unclassify.isError()) {
+        LOG(WARNING) << "Failed to remove stale filter " << filter << ": "
+                     << unclassify.error();
+        continue;
+      }
+      freeFilters.push_back(filter);
+    }
+    return Nothing();
+  }
+
+  // The filters are recorded as they are added, for cleanup() to remove
+  // them even if one fails. Stale ones are replaced in place.
+  foreach (const net::IP& address, info->ipAddresses) {
+    uint32_t filter;
+    if (!stale.empty()) {
+      filter = stale.back();
+      stale.pop_back();
+    } else if (!freeFilters.empty()) {
+      filter = freeFilters.back();
+      freeFilters.pop_back();
+    } else {
+      return Error("No filter left on '" + device + "'");
+    }
+    info->filters.push_back(filter);
+
+    Try<Nothing> classify =
+      netlink::classify(device, filter, stringify(address), band.get());
+    if (classify.isError()) {
+      return Error(classify.error());
+    }
+  }
+
+  LOG(INFO) << "Sending the traffic of container " << containerId
+            << " out of '" << device << "' in band " << band.get();
+
+  return Nothing();
+}
+
+
+void NetworkIsolatorProcess::unprioritize(const ContainerID& containerId)
+{
+  Info* info = (*infos)[containerId];
+
+  foreach (uint32_t filter, info->filters) {
+    Try<Nothing> unclassify =
+      netlink::unclassify(options.trafficClassDevice.get(), filter);
+    if (unclassify.isError()) {
+      LOG(WARNING) << "Failed to remove filter " << filter << " of container "
+                   << containerId << ": " << unclassify.error();
+    }
+    freeFilters.push_back(filter);
+  }
+
+  info->filters.clear();
+}
+
+
+process::Future<Nothing> NetworkIsolatorProcess::cleanup(
+    const ContainerID& containerId)
+{
+  if (!infos->contains(containerId)) {
+    LOG(INFO) << "NetworkIsolator::isolate Ignoring cleanup request for unknown"
+              << " container: " << containerId;
+    return Nothing();
+  }
+
+  Info* info = (*infos)[containerId];
+
+  namespaceSockets.erase(containerId);
+  watches.erase(containerId);
+  unprioritize(containerId);
+
+  // Unless the executor already runs in a newer container, its next
+  // container gets a speculative allocation again. Out of 'infos',
+  // nothing else refers to the Info.
+  {
+    std::lock_guard<std::mutex> lock(containersMutex);
+    if (executorContainerIds->contains(info->executor) &&
+        executorContainerIds->at(info->executor) == containerId) {
+      executorContainerIds->erase(info->executor);
+    }
+    infos->erase(containerId);
+  }
+
+  // A pooled namespace was plumbed under an ID of its own.
+  ContainerID pluginContainerId = containerId;
+  if (info->pooledNamespace.isSome()) {
+    const string& id = info->pooledNamespace.get();
+    pluginContainerId = pooledContainerId(id);
+
+    // Still there if the container went away before isolate().
+    removeNamespace(path::join(options.poolDir, id));
+    os::rm(path::join(options.poolDir, id + ".json"));
+  }
+
+  release(info->netgroups, info->labels);
+
+  // Freed on return.
+  process::Owned<Info> forgotten(info);
+
+  if (info->stickyKey.isSome()) {
+    stick(info->stickyKey.get(), info->uid, info->ipAddresses);
+    return _cleanup(pluginContainerId);
+  }
+
+  IPAMReleaseIPMessage& ipamMessage = recycle(&recycled.release);
+  foreach (const net::IP& addr, info->ipAddresses) {
+    ipamMessage.mutable_args()->add_ips(stringify(addr));
+  }
+
+  LOG(INFO) << "Requesting IPAM to release IPs: " << join(info->ipAddresses);
+  return annotate(
+      runIpam(ipamMessage, CLEANUP_PRIORITY),
+      "Error releasing IP from IPAM: ")
+    .then(defer(self(), &Self::_cleanup, pluginContainerId));
+}
+
+
+process::Future<Nothing> NetworkIsolatorProcess::_cleanup(
+    const ContainerID& containerId)
+{
+  IsolatorCleanupMessage& isolatorMessage = recycle(&recycled.cleanup);
+  isolatorMessage.mutable_args()->set_hostname(slaveInfo.hostname());
+  isolatorMessage.mutable_args()->set_container_id(containerId.value());
+
+  return annotate(
+      runIsolator(isolatorMessage, CLEANUP_PRIORITY),
+      "Error doing cleanup:")
+    .then([]() { return Nothing(); });
+}
+
+
+Future<ResourceStatistics> NetworkIsolatorProcess::usage(
+    const ContainerID& containerId)
+{
+  PendingUsage pending;
+  pending.containerId = containerId;
+  pending.promise = process::Owned<Promise<ResourceStatistics>>(
+      new Promise<ResourceStatistics>());
+
+  if (pendingUsages.empty()) {
+    dispatch(self(), &Self::sampleUsages);
+  }
+  pendingUsages.push_back(pending);
+
+  return pending.promise->future();
+}
+
+
+void NetworkIsolatorProcess::sampleUsages()
+{
+  vector<PendingUsage> pending;
+  std::swap(pending, pendingUsages);
+
+  refreshHostStatistics();
+
+  foreach (const PendingUsage& usage, pending) {
+    Try<ResourceStatistics> statistics = sampleUsage(usage.containerId);
+    if (statistics.isError()) {
+      usage.promise->fail(statistics.error());
+    } else {
+      usage.promise->set(statistics.get());
+    }
+  }
+}
+
+
+void NetworkIsolatorProcess::refreshHostStatistics()
+{
+  // The built-in virtualizer's veths are all on the host, one dump has
+  // the counters of every container.
+  if (!options.builtinVirtualizer ||
+      (hostStatisticsTime.isSome() &&
+       Clock::now() - hostStatisticsTime.get() < HOST_STATISTICS_TTL)) {
+    return;
+  }
+
+  Try<hashmap<string, struct rtnl_link_stats64>> links =
+    Error("No netlink socket");
+
+  if (hostSocket.get() == NULL) {
+    Try<process::Owned<netlink::Socket>> socket = netlink::Socket::open();
+    if (socket.isError()) {
+      links = Error(socket.error());
+    } else {
+      hostSocket = socket.get();
+    }
+  }
+
+  if (hostSocket.get() != NULL) {
+    links = netlink::links(hostSocket.get());
+  }
+
+  if (links.isError()) {
+    LOG(WARNING) << "Failed to read the counters of host side links, "
+                 << "reading them in each container: " << links.error();
+    hostSocket.reset();
+    hostStatistics.clear();
+    hostStatisticsTime = None();
+  } else {
+    hostStatistics = links.get();
+    hostStatisticsTime = Clock::now();
+  }
+}
+
+
+Try<ResourceStatistics> NetworkIsolatorProcess::sampleUsage(
+    const ContainerID& containerId)
+{
+  // Not a container of ours, or not isolated yet.
+  if (!infos->contains(containerId) ||
+      (*infos)[containerId]->pid.isNone()) {
+    return ResourceStatistics();
+  }
+
+  // What the container receives is sent by its host side veth, and the
+  // other way round.
+  const string link = hostLink(containerId);
+
+  if (hostStatistics.contains(link)) {
+    const struct rtnl_link_stats64& host = hostStatistics.at(link);
+
+    ResourceStatistics result;
+    result.set_timestamp(hostStatisticsTime.get().secs());
+    result.set_net_rx_packets(host.tx_packets);
+    result.set_net_rx_bytes(host.tx_bytes);
+    result.set_net_rx_errors(host.tx_errors);
+    result.set_net_rx_dropped(host.tx_dropped);
+    result.set_net_tx_packets(host.rx_packets);
+    result.set_net_tx_bytes(host.rx_bytes);
+    result.set_net_tx_errors(host.rx_errors);
+    result.set_net_tx_dropped(host.rx_dropped);
+
+    return result;
+  }
+
+  Try<netlink::Socket*> socket = namespaceSocket(containerId);
+  if (socket.isError()) {
+    return Error(socket.error());
+  }
+
+  Try<struct rtnl_link_stats64> links = netlink::statistics(socket.get());
+  if (links.isError()) {
+    namespaceSockets.erase(containerId);
+    return Error(
+        "Failed to read the network statistics of container " +
+        stringify(containerId) + ": " + links.error());
+  }
+
+  ResourceStatistics result;
+  result.set_timestamp(Clock::now().secs());
+  result.set_net_rx_packets(links.get().rx_packets);
+  result.set_net_rx_bytes(links.get().rx_bytes);
+  result.set_net_rx_errors(links.get().rx_errors);
+  result.set_net_rx_dropped(links.get().rx_dropped);
+  result.set_net_tx_packets(links.get().tx_packets);
+  result.set_net_tx_bytes(links.get().tx_bytes);
+  result.set_net_tx_errors(links.get().tx_errors);
+  result.set_net_tx_dropped(links.get().tx_dropped);
+
+  return result;
+}
+
+
+Future<Nothing> NetworkIsolatorProcess::update(
+    const ContainerID& containerId,
+    const Resources& resources)
+{
+  if (!infos->contains(containerId) ||
+      (*infos)[containerId]->pid.isNone()) {
+    return Nothing();
+  }
+
+  Option<uint64_t> rate;
+  Option<Value::Scalar> bandwidth =
+    resources.get<Value::Scalar>(bandwidthResource);
+  if (bandwidth.isSome() && bandwidth.get().value() > 0) {
+    // Megabits per second, in bytes.
+    rate = (uint64_t) (bandwidth.get().value() * 1000000 / 8);
+  }
+
+  Info* info = (*infos)[containerId];
+  if (info->rate == rate) {
+    return Nothing();
+  }
+
+  // Only the links of the built-in virtualizer are known to us, others
+  // are just watched.
+  if (!options.builtinVirtualizer) {
+    info->rate = rate;
+    return Nothing();
+  }
+
+  Try<netlink::Socket*> socket = namespaceSocket(containerId);
+  if (socket.isError()) {
+    return Failure(socket.error());
+  }
+
+  const string link = hostLink(containerId);
+
+  Try<Nothing> limited = netlink::limit(socket.get(), link, rate);
+  if (limited.isError()) {
+    return Failure(
+        "Failed to limit the bandwidth of container " +
+        stringify(containerId) + ": " + limited.error());
+  }
+
+  if (rate.isSome()) {
+    LOG(INFO) << "Limited " << link << " of container " << containerId
+              << " to " << bandwidth.get().value() << "Mbit/s";
+  } else {
+    LOG(INFO) << "Lifted the bandwidth limit of " << link
+              << " of container " << containerId;
+  }
+
+  info->rate = rate;
+  return Nothing();
+}
+
+
+Future<ContainerLimitation> NetworkIsolatorProcess::watch(
+    const ContainerID& containerId)
+{
+  if (!infos->contains(containerId)) {
+    return Future<ContainerLimitation>();
+  }
+
+  if (!watches.contains(containerId)) {
+    WatchedContainer watched;
+    watched.promise = process::Owned<Promise<ContainerLimitation>>(
+        new Promise<ContainerLimitation>());
+
+    // A check may still be due for containers no longer watched.
+    if (!checkingLimits) {
+      checkingLimits = true;
+      delay(LIMIT_CHECK_INTERVAL, self(), &Self::checkLimits);
+    }
+    watches[containerId] = watched;
+  }
+
+  return watches[containerId].promise->future();
+}
+
+
+void NetworkIsolatorProcess::checkLimits()
+{
+  if (watches.empty()) {
+    checkingLimits = false;
+    return;
+  }
+
+  refreshHostStatistics();
+
+  foreach (const ContainerID& containerId, watches.keys()) {
+    WatchedContainer& watched = watches[containerId];
+
+    Option<string> limit = exceeded(containerId, &watched);
+    if (limit.isNone()) {
+      watched.exceeding = None();
+      continue;
+    }
+
+    if (watched.exceeding.isNone()) {
+      watched.exceeding = Clock::now();
+    }
+
+    if (Clock::now() - watched.exceeding.get() < options.limitGracePeriod) {
+      continue;
+    }
+
+    LOG(INFO) << "Container " << containerId << " has been over its limit "
+              << "for " << options.limitGracePeriod << ": " << limit.get();
+
+    ContainerLimitation limitation;
+    limitation.set_message(
+        "Network limit exceeded for " +
+        stringify(options.limitGracePeriod) + ": " + limit.get());
+
+    watched.promise->set(limitation);
+    watches.erase(containerId);
+  }
+
+  if (watches.empty()) {
+    checkingLimits = false;
+    return;
+  }
+
+  delay(LIMIT_CHECK_INTERVAL, self(), &Self::checkLimits);
+}
+
+
+Option<string> NetworkIsolatorProcess::exceeded(
+    const ContainerID& containerId,
+    WatchedContainer* watched)
+{
+  if (!infos->contains(containerId) ||
+      (*infos)[containerId]->pid.isNone()) {
+    return None();
+  }
+
+  const Info* info = (*infos)[containerId];
+
+  if (options.limitConntrackEntries > 0) {
+    Option<uint64_t> entries = conntrackEntries(info->pid.get());
+    if (entries.isSome() && entries.get() >= options.limitConntrackEntries) {
+      return stringify(entries.get()) + " conntrack entries, of " +
+        stringify(options.limitConntrackEntries) + " allowed";
+    }
+  }
+
+  // The links of the built-in virtualizer are held to the bandwidth by
+  // the filters update() sets up.
+  const Option<uint64_t> rate =
+    options.builtinVirtualizer ? Option<uint64_t>::none() : info->rate;
+
+  if (options.limitPacketRate == 0 && rate.isNone()) {
+    return None();
+  }
+
+  Try<ResourceStatistics> sample = sampleUsage(containerId);
+  if (sample.isError()) {
+    LOG(WARNING) << "Failed to check the limits of container "
+                 << containerId << ": " << sample.error();
+    return None();
+  }
+
+  const Option<ResourceStatistics> last = watched->last;
+  watched->last = sample.get();
+
+  // Counters go back when the links were read from elsewhere than the
+  // last time, the host rather than the container's namespace or the
+  // other way around, or were reset.
+  if (last.isNone() ||
+      sample.get().timestamp() <= last.get().timestamp() ||
+      regressed(sample.get(), last.get())) {
+    return None();
+  }
+
+  const double seconds = sample.get().timestamp() - last.get().timestamp();
+
+  const double packets =
+    (sample.get().net_rx_packets() - last.get().net_rx_packets() +
+     sample.get().net_tx_packets() - last.get().net_tx_packets()) / seconds;
+  if (options.limitPacketRate > 0 && packets > options.limitPacketRate) {
+    return stringify((uint64_t) packets) + " packets/s, of " +
+      stringify(options.limitPacketRate) + " allowed";
+  }
+
+  if (rate.isSome()) {
+    const double received =
+      (sample.get().net_rx_bytes() - last.get().net_rx_bytes()) / seconds;
+    const double sent =
+      (sample.get().net_tx_bytes() - last.get().net_tx_bytes()) / seconds;
+    if (std::max(received, sent) > rate.get() * LIMIT_BANDWIDTH_TOLERANCE) {
+      return stringify((uint64_t) (std::max(received, sent) * 8 / 1000000)) +
+        "Mbit/s, of " + stringify(rate.get() * 8 / 1000000) + " allowed";
+    }
+  }
+
+  return None();
+}
+
+
+string NetworkIsolatorProcess::hostLink(const ContainerID& containerId)
+{
+  const Info* info = (*infos)[containerId];
+
+  return vethName(info->pooledNamespace.isSome()
+    ? pooledContainerId(info->pooledNamespace.get()).value()
+    : containerId.value());
+}
+
+
+Try<netlink::Socket*> NetworkIsolatorProcess::namespaceSocket(
+    const ContainerID& containerId)
+{
+  if (!namespaceSockets.contains(containerId)) {
+    const pid_t pid = (*infos)[containerId]->pid.get();
+
+    Try<process::Owned<netlink::Socket>> socket =
+      netlink::Socket::open("/proc/" + stringify(pid) + "/ns/net");
+    if (socket.isError()) {
+      return Error(
+          "Failed to open the network namespace of container " +
+          stringify(containerId) + ": " + socket.error());
+    }
+
+    namespaceSockets[containerId] = socket.get();
+  }
+
+  return namespaceSockets[containerId].get();
+}
+
+
+Future<IPAMResponse> NetworkIsolatorProcess::runIpam(
+    const IPAMReserveIPMessage& message,
+    PluginPriority priority)
+{
+  // Only copied if some of the addresses are dealt with here.
+  const IPAMReserveIPMessage* forwarded = &message;
+  IPAMReserveIPMessage remaining;
+
+  // Addresses in blocks of ours are not for IPAM to hand out anymore.
+  if (blocks.get() != NULL) {
+    Try<vector<string>> others = blocks->reserve(vector<string>(
+        message.args().ipv4_addrs().begin(),
+        message.args().ipv4_addrs().end()));
+    if (others.isError()) {
+      return Failure(others.error());
+    }
+
+    if (others.get().empty() && message.args().ipv6_addrs_size() == 0) {
+      return IPAMResponse();
+    }
+
+    remaining = message;
+    remaining.mutable_args()->clear_ipv4_addrs();
+    foreach (const string& address, others.get()) {
+      remaining.mutable_args()->add_ipv4_addrs(address);
+    }
+    forwarded = &remaining;
+  }
+
+  if (builtinIpam.get() == NULL) {
+    return runCommand<IPAMReserveIPMessage, IPAMResponse>(
+        ipamPlugin, *forwarded, priority);
+  }
+
+  const IPAMReserveIPMessage::Args& args = forwarded->args();
+  if (args.ipv6_addrs_size() > 0) {
+    return Failure("The built-in IPAM does not support IPv6");
+  }
+
+  Try<Nothing> reserved = builtinIpam->reserve(
+      args.uid(),
+      vector<string>(args.ipv4_addrs().begin(), args.ipv4_addrs().end()));
+  if (reserved.isError()) {
+    return Failure(reserved.error());
+  }
+
+  return IPAMResponse();
+}
+
+
+Future<IPAMResponse> NetworkIsolatorProcess::runIpam(
+    const IPAMRequestIPMessage& message,
+    PluginPriority priority)
+{
+  if (blocks.get() != NULL && message.command() != claimBlockCommand) {
+    return allocateFromBlocks(message, priority);
+  }
+
+  if (builtinIpam.get() == NULL) {
+    return runCommand<IPAMRequestIPMessage, IPAMResponse>(
+        ipamPlugin, message, priority);
+  }
 
-// 40KB should suffice for now!
-#define MAX_JSON_OUTPUT_SIZE (10*4096)
+  const IPAMRequestIPMessage::Args& args = message.args();
 
-using namespace mesos;
-using namespace network_isolator;
-using namespace process;
+  if (message.command() == claimBlockCommand) {
+    Try<string> block =
+      builtinIpam->claimBlock(args.hostname(), args.num_ipv4());
+    if (block.isError()) {
+      return Failure(block.error());
+    }
 
-using std::string;
-using std::vector;
+    IPAMResponse response;
+    response.add_ipv4(block.get());
+    return response;
+  }
 
-using mesos::slave::ContainerConfig;
-using mesos::slave::ContainerLaunchInfo;
-using mesos::slave::Isolator;
+  if (args.num_ipv6() > 0) {
+    return Failure("The built-in IPAM does not support IPv6");
+  }
 
-static const char* ipamClientKey = "ipam_command";
-static const char* isolatorClientKey = "isolator_command";
+  Try<vector<string>> allocated = builtinIpam->allocate(
+      args.uid(),
+      vector<string>(args.netgroups().begin(), args.netgroups().end()),
+      args.num_ipv4());
+  if (allocated.isError()) {
+    return Failure(allocated.error());
+  }
 
-static hashmap<ContainerID, Info*> *infos = NULL;
-static hashmap<ExecutorID, ContainerID> *executorContainerIds = NULL;
-static bool isolatorActivated = false;
+  IPAMResponse response;
+  foreach (const string& address, allocated.get()) {
+    response.add_ipv4(address);
+  }
+  return response;
+}
 
-static Try<Isolator*> networkIsolator = (Isolator*) NULL;
 
-static Try<pid_t> popen2(const string& path, int *inFd, int *outFd)
+Future<IPAMResponse> NetworkIsolatorProcess::runIpam(
+    const IPAMReleaseIPMessage& message,
+    PluginPriority priority)
 {
-  int inPipe[2];
-  int outPipe[2];
+  // Only copied if some of the addresses are dealt with here.
+  const IPAMReleaseIPMessage* forwarded = &message;
+  IPAMReleaseIPMessage remaining;
 
-  if (pipe2(inPipe, O_CLOEXEC) < 0) {
-    return Error("Error creating pipe");
-  }
+  if (blocks.get() != NULL &&
+      message.command() != releaseBlockCommand &&
+      message.args().ips_size() > 0) {
+    vector<string> emptied;
+    vector<string> others = blocks->release(
+        vector<string>(message.args().ips().begin(),
+                       message.args().ips().end()),
+        &emptied);
 
-  if (pipe2(outPipe, O_CLOEXEC) < 0) {
-    return Error("Error creating pipe");
-  }
+    // Given back lazily, as the next container may well need them.
+    foreach (const string& block, emptied) {
+      delay(IPAM_BLOCK_IDLE_TIMEOUT, self(), &Self::returnBlock, block);
+    }
 
-  pid_t childPid = fork();
+    if (others.empty()) {
+      return IPAMResponse();
+    }
 
-  if (childPid == -1) {
-    return Error("Error forking child");
+    remaining = message;
+    remaining.mutable_args()->clear_ips();
+    foreach (const string& address, others) {
+      remaining.mutable_args()->add_ips(address);
+    }
+    forwarded = &remaining;
   }
 
-  if (childPid == 0) {
-    while (::dup2(inPipe[0], STDIN_FILENO) == -1 && errno == EINTR);
-    while (::dup2(outPipe[1], STDOUT_FILENO) == -1 && errno == EINTR);
+  if (builtinIpam.get() == NULL) {
+    return runCommand<IPAMReleaseIPMessage, IPAMResponse>(
+        ipamPlugin, *forwarded, priority);
+  }
 
-    // Reset CLOEXEC flag for stdin/out fds.
-    ::fcntl(STDIN_FILENO, F_SETFD, 0);
-    ::fcntl(STDOUT_FILENO, F_SETFD, 0);
+  const IPAMReleaseIPMessage::Args& args = forwarded->args();
 
-    vector<string> args = strings::tokenize(path, " ");
-    // The real arguments that will be passed to 'os::execvpe'. We need
-    // to construct them here before doing the clone as it might not be
-    // async signal safe to perform the memory allocation.
-    char** argv = new char*[args.size() + 1];
-    for (size_t i = 0; i < args.size(); i++) {
-      argv[i] = (char*) args[i].c_str();
+  if (forwarded->command() == releaseBlockCommand) {
+    foreach (const string& block, args.ips()) {
+      Try<Nothing> released = builtinIpam->releaseBlock(block);
+      if (released.isError()) {
+        return Failure(released.error());
+      }
     }
-    argv[args.size()] = NULL;
+    return IPAMResponse();
+  }
 
-    char** envp = os::raw::environment();
+  if (args.ips_size() == 0 && args.has_uid()) {
+    builtinIpam->release(args.uid());
+    return IPAMResponse();
+  }
 
-    os::execvpe(argv[0], argv, envp);
-    ::exit(1);
-  } else {
-    os::close(inPipe[0]);
-    os::close(outPipe[1]);
+  Try<Nothing> released = builtinIpam->release(
+      vector<string>(args.ips().begin(), args.ips().end()));
+  if (released.isError()) {
+    return Failure(released.error());
   }
 
-  *inFd = inPipe[1];
-  *outFd = outPipe[0];
-  return childPid;
+  return IPAMResponse();
 }
 
-static Try<string> runCommand(const string& path, const string& command)
+
+Future<IPAMResponse> NetworkIsolatorProcess::allocateFromBlocks(
+    const IPAMRequestIPMessage& message,
+    PluginPriority priority)
 {
-  int inFd = -1;
-  int outFd = -1;
+  const IPAMRequestIPMessage::Args& args = message.args();
+  if (args.num_ipv6() > 0) {
+    return Failure("Address blocks are IPv4 only");
+  }
 
-  Try<pid_t> childPid = popen2(path, &inFd, &outFd);
-  if (childPid.isError()) {
-    return Error("Error creating subprocess" + childPid.error());
+  // Network and broadcast addresses of a block are not handed out.
+  if (args.num_ipv4() > (1 << (32 - options.blockPrefix)) - 2) {
+    return Failure("More addresses requested than a block holds");
   }
 
-  LOG(INFO) << "Sending command to " + path + ": " << command;
-  os::write(inFd, command);
-  os::close(inFd);
+  vector<string> groups(args.netgroups().begin(), args.netgroups().end());
+  std::sort(groups.begin(), groups.end());
+  const string netgroups = strings::join(",", groups);
 
-  Result<string> output = os::read(outFd, MAX_JSON_OUTPUT_SIZE);
-  if (output.isError()) {
-    return Error("Error reading from pipe: " + output.error());
+  Option<vector<string>> allocated =
+    blocks->allocate(netgroups, args.num_ipv4());
+  if (allocated.isNone()) {
+    return claimBlock(netgroups, priority)
+      .then(defer(self(), &Self::allocateFromBlocks, message, priority));
   }
-  os::close(outFd);
-  ::waitpid(childPid.get(), NULL, 0);
 
-  if (output.isNone()) {
-    return Error("Got no response");
+  // Claim ahead so that containers to come need not wait for a block.
+  if (blocks->available(netgroups) < options.blockWatermark) {
+    claimBlock(netgroups, BACKGROUND_PRIORITY);
   }
 
-  LOG(INFO) << "Got response from " << path << ": " << output.get();
-
-  return output.get();
+  IPAMResponse response;
+  foreach (const string& address, allocated.get()) {
+    response.add_ipv4(address);
+  }
+  return response;
 }
 
 
-template <typename InProto, typename OutProto>
-static Try<OutProto> runCommand(const string& path, const InProto& command)
+Future<Nothing> NetworkIsolatorProcess::claimBlock(
+    const string& netgroups,
+    PluginPriority priority)
 {
-  string jsonCommand = stringify(JSON::protobuf(command));
-
-  Try<string> output_ = runCommand(path, jsonCommand);
-  if (output_.isError()) {
-    return Error(output_.error());
+  if (claims.contains(netgroups)) {
+    return claims.at(netgroups);
   }
-  string output = output_.get();
 
-  Try<JSON::Object> jsonOutput_ = JSON::parse<JSON::Object>(output);
-  if (jsonOutput_.isError()) {
-    return Error(
-        "Error parsing output '" + output + "' to JSON string" +
-        jsonOutput_.error());
+  IPAMRequestIPMessage message;
+  message.set_command(claimBlockCommand);
+  IPAMRequestIPMessage::Args* args = message.mutable_args();
+  args->set_hostname(slaveInfo.hostname());
+  args->set_num_ipv4(1 << (32 - options.blockPrefix));
+  args->set_uid(UUID::random().toString());
+  foreach (const string& netgroup, strings::tokenize(netgroups, ",")) {
+    args->add_netgroups(netgroup);
   }
-  JSON::Object jsonOutput = jsonOutput_.get();
 
-  Result<JSON::Value> error = jsonOutput.find<JSON::Value>("error");
-  if (error.isSome() && !error.get().is<JSON::Null>()) {
-    return Error(path + " returned error: " + stringify(error.get()));
-  }
+  LOG(INFO) << "Claiming a /" << options.blockPrefix
+            << " address block from IPAM for netgroups '" << netgroups
+            << "'";
 
-  // Protobuf can't parse JSON "null" values; remove error from the object.
-  jsonOutput.values.erase("error");
+  Future<Nothing> claim = annotate(
+      runIpam(message, priority),
+      "Error claiming address block from IPAM: ")
+    .then(defer(self(), &Self::_claimBlock, netgroups, lambda::_1));
 
-  Try<OutProto> result = protobuf::parse<OutProto>(jsonOutput);
-  if (result.isError()) {
-    return Error(
-        "Error parsing output '" + output + "' to Protobuf" + result.error());
-  }
+  claims[netgroups] = claim;
+  claim
+    .onFailed([netgroups](const string& failure) {
+      LOG(WARNING) << "Failed to claim an address block for netgroups '"
+                   << netgroups << "': " << failure;
+    })
+    .onAny(defer(self(), &Self::claimed, netgroups));
 
-  return result;
+  return claim;
 }
 
 
-Try<Isolator*> NetworkIsolatorProcess::create(const Parameters& parameters)
+Future<Nothing> NetworkIsolatorProcess::_claimBlock(
+    const string& netgroups,
+    const IPAMResponse& response)
 {
-  string ipamClientPath;
-  string isolatorClientPath;
-  bool ipamPathSpecified = false;
-  bool isolatorPathSpecified = false;
-  foreach (const Parameter& parameter, parameters.parameter()) {
-    if (parameter.key() == ipamClientKey) {
-      ipamPathSpecified = true;
-      ipamClientPath = parameter.value();
-    } else if (parameter.key() == isolatorClientKey) {
-      isolatorPathSpecified = true;
-      isolatorClientPath = parameter.value();
-    }
+  if (response.ipv4().size() != 1) {
+    return Failure("Expected a single block from IPAM");
   }
 
-  if (!ipamPathSpecified) {
-    LOG(WARNING) << "IPAM path not specified";
-    return Error("IPAM path not specified.");
-  }
+  const string& block = response.ipv4(0);
 
-  if (!isolatorPathSpecified) {
-    LOG(WARNING) << "Isolator path not specified";
-    return Error("Isolator path not specified.");
+  Try<Nothing> added = blocks->add(netgroups, block);
+  if (added.isError()) {
+    releaseBlock(block);
+    return Failure(
+        "Failed to add address block " + block + ": " + added.error());
   }
 
-  if (os::exists(ipamClientPath) && os::exists(isolatorClientPath)) {
-    isolatorActivated = true;
-  } else {
-    LOG(WARNING) << "IPAM ('" << ipamClientPath << "') or "
-                 << "Isolator ('" << isolatorClientPath << "') path doesn't "
-                 << "exist; module 'com_mesosphere_mesos_NetworkIsolator' "
-                 << "will not be activated";
-  }
+  ++metrics.ipam_block_claims;
+  LOG(INFO) << "Claimed address block " << block << " for netgroups '"
+            << netgroups << "'";
 
-  return new NetworkIsolator(process::Owned<NetworkIsolatorProcess>(
-      new NetworkIsolatorProcess(
-          ipamClientPath, isolatorClientPath, parameters)),
-      isolatorActivated);
+  return Nothing();
 }
 
 
-NetworkIsolatorProcess::NetworkIsolatorProcess(
-    const std::string& ipamClientPath_,
-    const std::string& isolatorClientPath_,
-    const Parameters& parameters_)
-  : ipamClientPath(ipamClientPath_),
-    isolatorClientPath(isolatorClientPath_),
-    parameters(parameters_)
-{}
+void NetworkIsolatorProcess::claimed(const string& netgroups)
+{
+  claims.erase(netgroups);
+}
 
 
-process::Future<Option<ContainerLaunchInfo>> NetworkIsolatorProcess::prepare(
-    const ContainerID& containerId,
-    const ContainerConfig& containerConfig)
+void NetworkIsolatorProcess::returnBlock(const string& block)
 {
-  LOG(INFO) << "NetworkIsolator::prepare for container: " << containerId;
-
-  const ExecutorInfo executorInfo = containerConfig.executorinfo();
-  if (!executorInfo.has_container()) {
-    LOG(INFO) << "NetworkIsolator::prepare Ignoring request as "
-              << "executorInfo.container is missing for container: "
-              << containerId;
-    return None();
+  Option<string> netgroups = blocks->netgroups(block);
+  if (netgroups.isNone() || !blocks->empty(block)) {
+    return;
   }
 
-  if (executorInfo.container().network_infos().size() == 0) {
-    LOG(INFO) << "NetworkIsolator::prepare Ignoring request as "
-              << "executorInfo.container.network_infos is missing for "
-              << "container: " << containerId;
-    return None();
+  // Keep the block if another would have to be claimed without it.
+  const size_t size = (1 << (32 - options.blockPrefix)) - 2;
+  if (blocks->available(netgroups.get()) < size + options.blockWatermark) {
+    return;
   }
 
-  if (executorInfo.container().network_infos().size() > 1) {
-    return Failure(
-        "NetworkIsolator:: multiple NetworkInfos are not supported.");
+  Try<Nothing> removed = blocks->remove(block);
+  if (removed.isError()) {
+    LOG(WARNING) << "Failed to remove address block " << block << ": "
+                 << removed.error();
+    return;
   }
 
-  NetworkInfo networkInfo = executorInfo.container().network_infos(0);
+  releaseBlock(block);
+}
 
-  if (networkInfo.has_protocol()) {
-    return Failure(
-      "NetworkIsolator: NetworkInfo.protocol is deprecated and unsupported.");
-  }
-  if (networkInfo.has_ip_address()) {
-    return Failure(
-      "NetworkIsolator: NetworkInfo.ip_address is deprecated and"
-      " unsupported.");
-  }
 
-  string uid = UUID::random().toString();
+void NetworkIsolatorProcess::releaseBlock(const string& block)
+{
+  IPAMReleaseIPMessage& message = recycle(&recycled.release);
+  message.set_command(releaseBlockCommand);
+  message.mutable_args()->add_ips(block);
 
-  // Two IPAM commands:
-  // 1) reserve for IPs the user has specifically asked for.
-  // 2) auto-assign IPs.
-  // Spin through all IPAddress messages once to get info for each command.
-  // Then we'll issue each command if needed.
-  IPAMReserveIPMessage reserveMessage;
-  IPAMReserveIPMessage::Args* reserveArgs = reserveMessage.mutable_args();
+  LOG(INFO) << "Releasing address block " << block << " to IPAM";
 
-  // Counter of IPs to auto assign.
-  int numIPv4 = 0;
-  foreach (const NetworkInfo::IPAddress& ipAddress, networkInfo.ip_addresses()) {
-    if (ipAddress.has_ip_address() && ipAddress.has_protocol()) {
-      return Failure("NetworkIsolator: Cannot include both ip_address and "
-                     "protocol in a request.");
-    }
-    if (ipAddress.has_ip_address()) {
-      // Store IP to attempt to reserve.
-      reserveArgs->add_ipv4_addrs(ipAddress.ip_address());
-    } else if (ipAddress.has_protocol() &&
-               ipAddress.protocol() == NetworkInfo::IPv6){
-      return Failure("NetworkIsolator: IPv6 is not supported at this time.");
-    } else {
-      // Either protocol is IPv4, or not included (in which case we default to
-      // IPv4 anyway).
-      numIPv4++;
-    }
+  runIpam(message, BACKGROUND_PRIORITY)
+    .onFailed([block](const string& failure) {
+      LOG(ERROR) << "Failed to release address block " << block << ": "
+                 << failure;
+    });
+}
+
+
+Future<IsolatorResponse> NetworkIsolatorProcess::runIsolator(
+    const IsolatorIsolateMessage& message,
+    PluginPriority priority)
+{
+  if (!options.builtinVirtualizer) {
+    return runCommand<IsolatorIsolateMessage, IsolatorResponse>(
+        isolatorPlugin, message, priority);
   }
 
-  if (!(reserveArgs->ipv4_addrs_size() + numIPv4)) {
-    return Failure(
-      "NetworkIsolator: Container requires at least one IP address.");
+  const IsolatorIsolateMessage::Args& args = message.args();
+
+  PendingPlumbing pending;
+  pending.plumbing.pid = args.pid();
+  pending.plumbing.link = vethName(args.container_id());
+  pending.plumbing.addresses.assign(
+      args.ipv4_addrs().begin(), args.ipv4_addrs().end());
+  pending.promise =
+    process::Owned<Promise<IsolatorResponse>>(new Promise<IsolatorResponse>());
+
+  // Containers isolated in the meantime are connected along with this
+  // one, sharing the netlink round trips on the host.
+  if (pendingPlumbings.empty()) {
+    dispatch(self(), &Self::plumbPending);
   }
+  pendingPlumbings.push_back(pending);
 
-  // All the IP addresses, both reserved and allocated.
-  vector<string> allAddresses;
+  return pending.promise->future();
+}
 
-  // Reserve provided IPs first.
-  if (reserveArgs->ipv4_addrs_size()) {
-    reserveArgs->set_hostname(slaveInfo.hostname());
-    reserveArgs->set_uid(uid);
-    reserveArgs->mutable_netgroups()->CopyFrom(networkInfo.groups());
-    reserveArgs->mutable_labels()->CopyFrom(networkInfo.labels().labels());
 
-    LOG(INFO) << "Sending IP reserve command to IPAM";
-    Try<IPAMResponse> response =
-      runCommand<IPAMReserveIPMessage, IPAMResponse>(
-          ipamClientPath, reserveMessage);
-    if (response.isError()) {
-      return Failure("Error reserving IPs with IPAM: " + response.error());
-    }
+void NetworkIsolatorProcess::plumbPending()
+{
+  vector<PendingPlumbing> pending;
+  std::swap(pending, pendingPlumbings);
 
-    string addresses = "";
-    foreach (const string& addr, reserveArgs->ipv4_addrs()) {
-      addresses = addresses + addr + " ";
-      allAddresses.push_back(addr);
+  vector<netlink::Plumbing> containers;
+  foreach (const PendingPlumbing& plumbing, pending) {
+    containers.push_back(plumbing.plumbing);
+  }
+
+  vector<Try<Nothing>> results = netlink::plumb(containers);
+
+  for (size_t i = 0; i < pending.size(); i++) {
+    if (results[i].isError()) {
+      pending[i].promise->fail(results[i].error());
+      continue;
     }
-    LOG(INFO) << "IP(s) " << addresses << "reserved with IPAM";
+
+    LOG(INFO) << "Connected pid " << containers[i].pid << " through "
+              << containers[i].link << " (batch of " << containers.size()
+              << ")";
+    pending[i].promise->set(IsolatorResponse());
   }
+}
 
-  // Request for IPs the user has asked to auto-assign.
-  if (numIPv4) {
-    IPAMRequestIPMessage requestMessage;
-    IPAMRequestIPMessage::Args* requestArgs = requestMessage.mutable_args();
-    requestArgs->set_num_ipv4(numIPv4);
-    requestArgs->set_hostname(slaveInfo.hostname());
-    requestArgs->set_uid(uid);
 
-    requestArgs->mutable_netgroups()->CopyFrom(networkInfo.groups());
-    requestArgs->mutable_labels()->CopyFrom(networkInfo.labels().labels());
+Future<IsolatorResponse> NetworkIsolatorProcess::runIsolator(
+    const IsolatorCleanupMessage& message,
+    PluginPriority priority)
+{
+  if (!options.builtinVirtualizer) {
+    return runCommand<IsolatorCleanupMessage, IsolatorResponse>(
+        isolatorPlugin, message, priority);
+  }
 
-    LOG(INFO) << "Sending IP request command to IPAM";
-    Try<IPAMResponse> response =
-      runCommand<IPAMRequestIPMessage, IPAMResponse>(
-          ipamClientPath, requestMessage);
-    if (response.isError()) {
-      return Failure("Error allocating IP from IPAM: " + response.error());
-    } else if (response.get().ipv4().size() == 0) {
-      return Failure("No IPv4 addresses received from IPAM.");
-    }
+  Try<Nothing> unplumbed =
+    netlink::unplumb(vethName(message.args().container_id()));
+  if (unplumbed.isError()) {
+    return Failure(unplumbed.error());
+  }
 
-    string addresses = "";
-    foreach (const string& addr, response.get().ipv4()) {
-      addresses = addresses + addr + " ";
-      allAddresses.push_back(addr);
-    }
-    LOG(INFO) << "IP(s) " << addresses << "allocated with IPAM.";
+  return IsolatorResponse();
+}
+
+
+void NetworkIsolatorProcess::refill()
+{
+  if (options.poolSize == 0) {
+    return;
   }
 
-  vector<string> netgroups;
-  foreach (const string& group, networkInfo.groups()) {
-    netgroups.push_back(group);
+  // Whatever an earlier agent left pooled is of no use to anybody.
+  if (!poolRecovered) {
+    poolRecovered = true;
+
+    Try<std::list<string>> entries = os::ls(options.poolDir);
+    if (entries.isError()) {
+      LOG(WARNING) << "Failed to list '" << options.poolDir << "': "
+                   << entries.error();
+    } else {
+      foreach (const string& entry, entries.get()) {
+        if (strings::endsWith(entry, ".json")) {
+          discard(strings::remove(entry, ".json", strings::SUFFIX));
+        }
+      }
+    }
   }
 
-  Labels labels = networkInfo.labels();
-  labels.CopyFrom(networkInfo.labels());
+  while (pool.size() + filling < options.poolSize) {
+    const string id = UUID::random().toString();
+    filling++;
 
-  ContainerLaunchInfo launchInfo;
-  launchInfo.set_namespaces(CLONE_NEWNET);
+    fill(id)
+      .onAny(defer(self(), &Self::_refill, id, lambda::_1));
+  }
+}
 
-  Environment::Variable* variable =
-    launchInfo.mutable_environment()->add_variables();
-  variable->set_name("LIBPROCESS_IP");
-  // If more than one IP is available, just use the first.  LIBPROCESS just
-  // needs one, it doesn't matter which.
-  variable->set_value(allAddresses.front());
 
-  (*infos)[containerId] = new Info(allAddresses, netgroups, uid, labels);
-  (*executorContainerIds)[executorInfo.executor_id()] = containerId;
+process::Future<PooledNamespace> NetworkIsolatorProcess::fill(
+    const string& id)
+{
+  IPAMRequestIPMessage requestMessage;
+  IPAMRequestIPMessage::Args* requestArgs = requestMessage.mutable_args();
+  requestArgs->set_num_ipv4(1);
+  requestArgs->set_hostname(slaveInfo.hostname());
+  requestArgs->set_uid(id);
 
-  return launchInfo;
+  return annotate(
+      runIpam(requestMessage, BACKGROUND_PRIORITY),
+      "Error allocating IP from IPAM: ")
+    .then(defer(self(), &Self::plumb, id, lambda::_1));
 }
 
 
-process::Future<Nothing> NetworkIsolatorProcess::isolate(
-    const ContainerID& containerId,
-    pid_t pid)
+process::Future<PooledNamespace> NetworkIsolatorProcess::plumb(
+    const string& id,
+    const IPAMResponse& response)
 {
-  if (!infos->contains(containerId)) {
-    LOG(INFO) << "NetworkIsolator::isolate Ignoring isolate request for unknown"
-              << " container: " << containerId;
-    return Nothing();
+  if (response.ipv4().size() == 0) {
+    return Failure("No IPv4 addresses received from IPAM.");
   }
-  const Info* info = (*infos)[containerId];
 
-  IsolatorIsolateMessage isolatorMessage;
+  PooledNamespace pooled;
+  pooled.id = id;
+
+  Try<vector<net::IP>> addresses = parseIPs(response.ipv4());
+  if (addresses.isError()) {
+    return Failure("Malformed IPAM response: " + addresses.error());
+  }
+  pooled.addresses = addresses.get();
+
+  // Recorded before anything else so that discard() can undo all of it,
+  // also after an agent restart.
+  Try<Nothing> write = writeAddresses(
+      path::join(options.poolDir, id + ".json"), pooled.addresses);
+  if (write.isError()) {
+    return Failure("Failed to write metadata: " + write.error());
+  }
+
+  Try<pid_t> holder = holdNamespace();
+  if (holder.isError()) {
+    return Failure(
+        "Failed to create network namespace: " + holder.error());
+  }
+
+  const pid_t pid = holder.get();
+  const string source = path::join("/proc", stringify(pid), "ns", "net");
+  const string netns = path::join(options.poolDir, id);
+
+  Try<Nothing> touch = os::touch(netns);
+  if (touch.isError() ||
+      ::mount(source.c_str(), netns.c_str(), NULL, MS_BIND, NULL) < 0) {
+    ErrnoError error("Failed to bind mount '" + source + "'");
+    ::kill(pid, SIGKILL);
+    reap(pid);
+    return Failure(touch.isError() ? touch.error() : error.message);
+  }
+
+  IsolatorIsolateMessage& isolatorMessage = recycle(&recycled.isolate);
   IsolatorIsolateMessage::Args* isolatorArgs = isolatorMessage.mutable_args();
   isolatorArgs->set_hostname(slaveInfo.hostname());
-  isolatorArgs->set_container_id(containerId.value());
+  isolatorArgs->set_container_id(pooledContainerId(id).value());
   isolatorArgs->set_pid(pid);
-  foreach (const string& addr, info->ipAddresses) {
-    isolatorArgs->add_ipv4_addrs(addr);
-  }
-  // isolatorArgs->add_ipv6_addrs();
-  foreach (const string& netgroup, info->netgroups) {
-    isolatorArgs->add_netgroups(netgroup);
+  foreach (const net::IP& addr, pooled.addresses) {
+    isolatorArgs->add_ipv4_addrs(stringify(addr));
   }
-  isolatorArgs->mutable_labels()->CopyFrom(info->labels.labels());
 
-  LOG(INFO) << "Sending isolate command to Isolator";
-  Try<IsolatorResponse> response =
-    runCommand<IsolatorIsolateMessage, IsolatorResponse>(
-        isolatorClientPath, isolatorMessage);
-  if (response.isError()) {
-    return Failure("Error running isolate command: " + response.error());
-  }
-  return Nothing();
+  return annotate(
+      runIsolator(isolatorMessage, BACKGROUND_PRIORITY),
+      "Error running isolate command: ")
+    .onAny([pid]() {
+      ::kill(pid, SIGKILL);
+      reap(pid);
+    })
+    .then([pooled]() { return pooled; });
 }
 
 
-process::Future<Nothing> NetworkIsolatorProcess::cleanup(
-    const ContainerID& containerId)
+void NetworkIsolatorProcess::_refill(
+    const string& id,
+    const Future<PooledNamespace>& pooled)
 {
-  if (!infos->contains(containerId)) {
-    LOG(INFO) << "NetworkIsolator::isolate Ignoring cleanup request for unknown"
-              << " container: " << containerId;
-    return Nothing();
+  filling--;
+
+  if (pooled.isReady()) {
+    LOG(INFO) << "Pooled network namespace " << id << " with IP(s) "
+              << join(pooled.get().addresses);
+    pool.push_back(pooled.get());
+    return;
   }
 
-  const Info* info = (*infos)[containerId];
+  LOG(WARNING) << "Failed to pool network namespace " << id << ": "
+               << (pooled.isFailed() ? pooled.failure() : "discarded");
 
-  string addresses = "";
-  IPAMReleaseIPMessage ipamMessage;
-  foreach (const string& addr, info->ipAddresses) {
-    ipamMessage.mutable_args()->add_ips(addr);
-    addresses = addresses + addr + " ";
-  }
+  discard(id);
 
-  LOG(INFO) << "Requesting IPAM to release IPs: " << addresses;
-  Try<IPAMResponse> response =
-    runCommand<IPAMReleaseIPMessage, IPAMResponse>(ipamClientPath, ipamMessage);
-  if (response.isError()) {
-    return Failure("Error releasing IP from IPAM: " + response.error());
-  }
+  // Whatever failed is likely to fail again right away.
+  delay(NETNS_POOL_RETRY_INTERVAL, self(), &Self::refill);
+}
 
-  IsolatorCleanupMessage isolatorMessage;
-  isolatorMessage.mutable_args()->set_hostname(slaveInfo.hostname());
-  isolatorMessage.mutable_args()->set_container_id(containerId.value());
 
-  Try<IsolatorResponse> isolatorResponse =
-    runCommand<IsolatorCleanupMessage, IsolatorResponse>(
-        isolatorClientPath, isolatorMessage);
-  if (isolatorResponse.isError()) {
-    return Failure("Error doing cleanup:" + isolatorResponse.error());
+void NetworkIsolatorProcess::discard(const string& id)
+{
+  LOG(INFO) << "Discarding pooled network namespace " << id;
+
+  removeNamespace(path::join(options.poolDir, id));
+
+  const string metadata = path::join(options.poolDir, id + ".json");
+
+  const vector<net::IP> release = readAddresses(metadata);
+  if (!release.empty()) {
+    releaseIPs(release);
   }
 
-  return Nothing();
+  _cleanup(pooledContainerId(id))
+    .onFailed([id](const string& failure) {
+      LOG(WARNING) << "Failed to clean up pooled network namespace " << id
+                   << ": " << failure;
+    })
+    .onAny([metadata]() { os::rm(metadata); });
+}
+
+
+double NetworkIsolatorProcess::_netns_pool_available()
+{
+  return pool.size();
+}
+
+
+double NetworkIsolatorProcess::_ipam_blocks()
+{
+  return blocks.get() == NULL ? 0 : blocks->size();
 }
 
 
@@ -497,7 +4108,7 @@ static Isolator* createNetworkIsolator(const Parameters& parameters)
   if (infos == NULL) {
     infos = new hashmap<ContainerID, Info*>();
     CHECK(executorContainerIds == NULL);
-    executorContainerIds = new hashmap<ExecutorID, ContainerID>();
+    executorContainerIds = new hashmap<string, ContainerID>();
   }
 
   networkIsolator = NetworkIsolatorProcess::create(parameters);
@@ -530,6 +4141,12 @@ public:
       NetworkIsolator *isolator = (NetworkIsolator*) networkIsolator.get();
       isolator->updateSlaveInfo(slaveInfo).await();
     }
+
+    // Get IPAM going while the agent fetches the task's sandbox; the
+    // container's prepare() picks up the result.
+    NetworkIsolator *isolator = (NetworkIsolator*) networkIsolator.get();
+    isolator->speculate(executorInfo);
+
     return None();
   }
 
@@ -548,32 +4165,37 @@ public:
       return None();
     }
 
-    const ExecutorID executorId = status.executor_id();
-    if (!executorContainerIds->contains(executorId)) {
-      LOG(WARNING) << "NetworkHook:: no valid container id for: " << executorId;
-      return None();
-    }
+    const string executor = executorKey(frameworkId, status.executor_id());
 
-    const ContainerID containerId = executorContainerIds->at(executorId);
-    if (infos == NULL || !infos->contains(containerId)) {
-      LOG(WARNING) << "NetworkHook:: no valid infos for: " << containerId;
-      return None();
-    }
+    // Copied, as the isolator may clean the container up meanwhile.
+    vector<net::IP> addresses;
+    {
+      std::lock_guard<std::mutex> lock(containersMutex);
+      if (!executorContainerIds->contains(executor)) {
+        LOG(WARNING) << "NetworkHook:: no valid container id for: "
+                     << executor;
+        return None();
+      }
 
-    const Info* info = (*infos)[containerId];
+      const ContainerID& containerId = executorContainerIds->at(executor);
+      if (infos == NULL || !infos->contains(containerId)) {
+        LOG(WARNING) << "NetworkHook:: no valid infos for: " << containerId;
+        return None();
+      }
+
+      addresses = infos->at(containerId)->ipAddresses;
+    }
 
     TaskStatus result;
     NetworkInfo* networkInfo =
       result.mutable_container_status()->add_network_infos();
-    string addresses = "";
-    foreach (const string& addr, info->ipAddresses) {
+    foreach (const net::IP& addr, addresses) {
       NetworkInfo::IPAddress* ipAddress = networkInfo->add_ip_addresses();
-      ipAddress->set_ip_address(addr);
+      ipAddress->set_ip_address(stringify(addr));
       ipAddress->set_protocol(NetworkInfo::IPv4);
-      addresses = addresses + addr + " ";
     }
 
-    LOG(INFO) << "NetworkHook:: added ip address(es) " << addresses;
+    LOG(INFO) << "NetworkHook:: added ip address(es) " << join(addresses);
     return result;
   }
 };
@@ -44,42 +44,513 @@
 #ifndef __NETWORK_ISOLATOR_HPP__
 #define __NETWORK_ISOLATOR_HPP__
 
+#include <sched.h>
+#include <stdint.h>
+
+#include <sys/resource.h>
+#include <sys/types.h>
+
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
 #include <mesos/mesos.hpp>
 
 #include <mesos/slave/isolator.hpp>
 
+#include <process/clock.hpp>
 #include <process/future.hpp>
 #include <process/owned.hpp>
 #include <process/process.hpp>
+#include <process/time.hpp>
+
+#include <process/metrics/counter.hpp>
+#include <process/metrics/gauge.hpp>
+#include <process/metrics/timer.hpp>
+
+#include <stout/duration.hpp>
+#include <stout/hashmap.hpp>
+#include <stout/hashset.hpp>
+#include <stout/ip.hpp>
+#include <stout/json.hpp>
 
 #include <stout/try.hpp>
 #include <stout/option.hpp>
 
+#include "interface.hpp"
+#include "ipam.hpp"
+#include "netlink.hpp"
+#include "uring.hpp"
+
 namespace mesos {
 
+// A process-wide table of values that many containers have in common,
+// such as netgroup names, handing out a small integer for each. Every
+// intern() takes a reference that release() gives back; an entry goes
+// away with its last reference, so that labels unique to a task do not
+// pile up, and its id is handed out again. Both the isolator and the
+// hook thread use the tables.
+template <typename T>
+class Dictionary
+{
+public:
+  typedef uint32_t Id;
+
+  // Returns the id of 'value', known under 'key', adding it if need be.
+  Id intern(const std::string& key, const T& value)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (!ids.contains(key)) {
+      Id id;
+      if (unused.empty()) {
+        id = entries.size();
+        entries.push_back(Entry());
+      } else {
+        id = unused.back();
+        unused.pop_back();
+      }
+
+      entries[id].key = key;
+      entries[id].value = value;
+      ids[key] = id;
+    }
+
+    const Id id = ids.at(key);
+    entries[id].references++;
+    return id;
+  }
+
+  // Gives back a reference that intern() took.
+  void release(Id id)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    Entry& entry = entries.at(id);
+    if (entry.references == 0 || --entry.references > 0) {
+      return;
+    }
+
+    ids.erase(entry.key);
+    entry.key.clear();
+    entry.value = T();
+    unused.push_back(id);
+  }
+
+  // A std::deque does not move its elements when growing, so the
+  // reference stays valid after the lock is released, for as long as
+  // the caller holds a reference to 'id'.
+  const T& lookup(Id id) const
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return entries.at(id).value;
+  }
+
+  size_t size() const
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return ids.size();
+  }
+
+private:
+  struct Entry
+  {
+    Entry() : references(0) {}
+
+    std::string key;
+    T value;
+    size_t references;
+  };
+
+  mutable std::mutex mutex;
+  hashmap<std::string, Id> ids;
+  std::deque<Entry> entries;
+
+  // Ids of removed entries, for intern() to reuse.
+  std::vector<Id> unused;
+};
+
+
+// Netgroup names.
+Dictionary<std::string>& netgroupNames();
+
+// Label key/value pairs, keyed by their serialized form.
+Dictionary<mesos::Label>& labelPairs();
+
+
 struct Info
 {
-  Info(const std::vector<std::string>& _ipAddresses,
-       const std::vector<std::string>& _netgroups,
+  Info(std::vector<net::IP> _ipAddresses,
+       std::vector<Dictionary<std::string>::Id> _netgroups,
        const std::string& _uid,
-       const mesos::Labels _labels)
-    : ipAddresses(_ipAddresses),
-      netgroups(_netgroups),
+       std::vector<Dictionary<mesos::Label>::Id> _labels)
+    : ipAddresses(std::move(_ipAddresses)),
+      netgroups(std::move(_netgroups)),
       uid(_uid),
-      labels(_labels) {}
+      labels(std::move(_labels)) {}
 
 
   // The IP addresses to assign to the container.
-  const std::vector<std::string> ipAddresses;
+  const std::vector<net::IP> ipAddresses;
 
-  // The network profile name to assign to the container, or NONE for the
-  // default.
-  const std::vector<std::string> netgroups;
+  // The network profile names to assign to the container, as ids in
+  // netgroupNames(); empty for the default.
+  const std::vector<Dictionary<std::string>::Id> netgroups;
 
   // Unique identifier assigned to each IPAM IP request.
   const std::string uid;
 
-  const mesos::Labels labels;
+  // As ids in labelPairs().
+  const std::vector<Dictionary<mesos::Label>::Id> labels;
+
+  // The pooled network namespace the container was given, if any.
+  Option<std::string> pooledNamespace;
+
+  // Under which the IPs are held back at cleanup, if so configured.
+  Option<std::string> stickyKey;
+
+  // The framework and executor ID the container was launched for.
+  std::string executor;
+
+  // The container's process, once isolated.
+  Option<pid_t> pid;
+
+  // The bandwidth limit in bytes per second, if any.
+  Option<uint64_t> rate;
+
+  // The u32 filters classifying the container's traffic on the
+  // 'traffic_class_device', one per address.
+  std::vector<uint32_t> filters;
+};
+
+
+// A plugin command line. It is tokenized and resolved once when the
+// module is loaded so that a forked child only has to dup2() and exec();
+// nothing between fork() and exec() may allocate, since another thread
+// of the agent could be holding the allocator lock at fork() time.
+struct PluginCommand
+{
+  PluginCommand(const std::string& command,
+                const std::vector<std::string>& environment);
+
+  // Both 'argv' and 'envp' point into the strings held by this object,
+  // hence it can be neither copied nor moved.
+  PluginCommand(const PluginCommand&) = delete;
+  PluginCommand& operator=(const PluginCommand&) = delete;
+
+  // The command line as given in the module parameters; used for logging.
+  const std::string command;
+
+  // Absolute path of the executable, resolved against PATH if needed.
+  std::string executable;
+
+  std::vector<std::string> args;
+  std::vector<std::string> environment;
+
+  // NULL-terminated arrays handed to execve().
+  std::vector<char*> argv;
+  std::vector<char*> envp;
+};
+
+
+// Order in which waiting plugin invocations are admitted.
+enum PluginPriority
+{
+  // Work a container launch is waiting on.
+  LAUNCH_PRIORITY,
+
+  // Releasing what terminated containers held.
+  CLEANUP_PRIORITY,
+
+  // Work nobody is waiting on.
+  BACKGROUND_PRIORITY,
+
+  PLUGIN_PRIORITIES
+};
+
+
+// Which failed plugin commands are retried, and how. Only commands
+// that are safe to repeat should be listed.
+struct RetryPolicy
+{
+  RetryPolicy() : retries(0) {}
+
+  hashset<std::string> commands;
+
+  // Retries after the first attempt.
+  size_t retries;
+
+  // Backoff before the first retry; it doubles for every further retry,
+  // up to 'maxBackoff'.
+  Duration backoff;
+  Duration maxBackoff;
+};
+
+
+// After 'threshold' consecutive failures of a plugin, calls to it fail
+// right away for 'timeout'. The next call is then let through as a
+// trial: it closes the breaker again if it succeeds.
+struct CircuitBreaker
+{
+  enum State
+  {
+    CLOSED,
+    OPEN,
+    HALF_OPEN
+  };
+
+  CircuitBreaker()
+    : threshold(0), state(CLOSED), failures(0), trial(false) {}
+
+  // Zero disables the breaker.
+  size_t threshold;
+  Duration timeout;
+
+  State state;
+  size_t failures;
+  process::Time opened;
+
+  // Whether the trial call of a half open breaker is under way.
+  bool trial;
+};
+
+
+// A plugin together with its admission control: at most 'limit' of its
+// processes run at a time, further invocations wait in one FIFO queue
+// per priority. Only ever used from the isolator actor.
+struct Plugin
+{
+  Plugin(const std::string& name,
+         process::Owned<PluginCommand> command,
+         size_t limit,
+         const RetryPolicy& retry,
+         const CircuitBreaker& breaker);
+
+  ~Plugin();
+
+  // Invocations waiting to be admitted, across all priorities.
+  size_t waiting() const;
+
+  const std::string name;
+  const process::Owned<PluginCommand> command;
+
+  // Zero for no limit.
+  const size_t limit;
+
+  size_t running;
+  std::deque<process::Owned<process::Promise<Nothing>>>
+    queues[PLUGIN_PRIORITIES];
+
+  const RetryPolicy retry;
+  CircuitBreaker breaker;
+
+  // How long invocations waited to be admitted.
+  process::metrics::Timer<Milliseconds> queue_wait_time;
+
+  process::metrics::Counter retries;
+  process::metrics::Counter breaker_trips;
+
+  // Calls failed right away because the breaker was open.
+  process::metrics::Counter breaker_rejections;
+};
+
+
+// Where and how plugin processes run, from the 'plugin_cgroup',
+// 'plugin_cpus' and 'plugin_nice' module parameters. Everything the
+// forked child needs is prepared up front, see PluginCommand.
+struct PluginPlacement
+{
+  PluginPlacement() : cgroupFd(-1), cgroupProcsFd(-1) {}
+
+  // The cgroup directory plugins are placed into, if any.
+  Option<std::string> cgroup;
+
+  // The cgroup directory itself, for clone3(CLONE_INTO_CGROUP).
+  int cgroupFd;
+
+  // Its 'cgroup.procs', for children that have to move themselves in
+  // when clone3() is not available or the hierarchy is cgroup v1.
+  int cgroupProcsFd;
+
+  Option<cpu_set_t> cpus;
+  Option<int> nice;
+};
+
+
+// How a plugin process exited, as reported by wait4().
+struct PluginExit
+{
+  PluginExit() : status(0) {}
+
+  int status;
+  struct rusage usage;
+};
+
+
+// The outcome of a single plugin invocation.
+struct PluginRun
+{
+  std::string output;
+  PluginExit exit;
+};
+
+
+// Tunables from the module parameters, parsed and validated once in
+// NetworkIsolatorProcess::create().
+struct NetworkIsolatorOptions
+{
+  NetworkIsolatorOptions()
+    : hedgePercentile(0),
+      speculationTimeout(Minutes(10)),
+      poolSize(0),
+      poolDir("/var/run/mesos/network_isolator/netns"),
+      builtinVirtualizer(false),
+      blockPrefix(0),
+      blockWatermark(8),
+      blockDir("/var/run/mesos/network_isolator/blocks"),
+      stickyTtl(Duration::zero()),
+      stickySize(256),
+      stickyDir("/var/run/mesos/network_isolator/sticky"),
+      limitPacketRate(0),
+      limitConntrackEntries(0),
+      limitGracePeriod(Seconds(30)),
+      trafficClassReplace(false) {}
+
+  // An IPAM allocation still unanswered after this percentile of recent
+  // allocation latencies is hedged with a second, identical request;
+  // zero disables hedging.
+  double hedgePercentile;
+
+  // How long IPs allocated when a task is accepted are kept for its
+  // container; zero disables speculative allocation.
+  Duration speculationTimeout;
+
+  // Network namespaces kept plumbed ahead of containers, and where they
+  // are bind mounted.
+  size_t poolSize;
+  std::string poolDir;
+
+  // Whether containers are connected by the module itself, over
+  // rtnetlink, rather than by the 'isolator_command' plugin.
+  bool builtinVirtualizer;
+
+  // Prefix length of the address blocks claimed from IPAM, zero to
+  // have IPAM allocate each address; how few free addresses make for
+  // claiming another block, and where the claimed blocks are recorded.
+  size_t blockPrefix;
+  size_t blockWatermark;
+  std::string blockDir;
+
+  // How long the IPs of a container are held back at cleanup for the
+  // next container of the same executor and NetworkInfo, zero to release
+  // them right away; at most how many containers' IPs are held back, and
+  // where they are recorded.
+  Duration stickyTtl;
+  size_t stickySize;
+  std::string stickyDir;
+
+  // Packets per second, sent and received, and conntrack entries a
+  // container may have, zero for no limit; how long a container may
+  // stay over these, or its 'network_bandwidth', before it is reported
+  // as limited.
+  size_t limitPacketRate;
+  size_t limitConntrackEntries;
+  Duration limitGracePeriod;
+
+  // The uplink on which containers are prioritized by their 'priority'
+  // label, if any, and whether a root qdisc already on it may be
+  // replaced.
+  Option<std::string> trafficClassDevice;
+  bool trafficClassReplace;
+
+  // The /proc/sys paths and values of each profile in the
+  // 'sysctl_profiles' file, by name.
+  hashmap<std::string, std::vector<std::pair<std::string, std::string>>>
+    sysctlProfiles;
+};
+
+
+// A network namespace plumbed by the virtualizer for an IP of its own,
+// bind mounted as 'id' in the pool directory.
+struct PooledNamespace
+{
+  // Also the IPAM uid of 'addresses'.
+  std::string id;
+  std::vector<net::IP> addresses;
+};
+
+
+// A container waiting to be connected by the built-in virtualizer.
+struct PendingPlumbing
+{
+  netlink::Plumbing plumbing;
+  process::Owned<process::Promise<network_isolator::IsolatorResponse>> promise;
+};
+
+
+// A container whose network statistics were asked for.
+struct PendingUsage
+{
+  ContainerID containerId;
+  process::Owned<process::Promise<ResourceStatistics>> promise;
+};
+
+
+// A container whose limitation the containerizer waits for.
+struct WatchedContainer
+{
+  process::Owned<process::Promise<mesos::slave::ContainerLimitation>>
+    promise;
+
+  // The counters when last checked, and since when the container has
+  // been over a limit.
+  Option<ResourceStatistics> last;
+  Option<process::Time> exceeding;
+};
+
+
+// IPs allocated by the NetworkHook for an executor whose container has
+// not been prepared yet.
+struct SpeculativeAllocation
+{
+  NetworkInfo networkInfo;
+  std::string uid;
+  process::Future<std::vector<net::IP>> addresses;
+};
+
+
+// The IPs of a container that was cleaned up, held back in case its
+// executor is launched again with the same NetworkInfo.
+struct StickyAddresses
+{
+  std::string key;
+  std::string uid;
+  std::vector<net::IP> addresses;
+
+  // Tells apart the times the IPs were held back under 'key'.
+  uint64_t generation;
+};
+
+
+// State shared by the requests of one hedged IPAM allocation.
+struct HedgedAllocation
+{
+  HedgedAllocation() : pending(0), decided(false) {}
+
+  process::Promise<network_isolator::IPAMResponse> promise;
+
+  // Requests still outstanding.
+  size_t pending;
+
+  // Whether 'promise' has been completed; the first successful
+  // response wins, later ones are duplicates.
+  bool decided;
+  network_isolator::IPAMResponse winner;
 };
 
 
@@ -89,7 +560,7 @@ public:
   static Try<mesos::slave::Isolator*> create(
       const Parameters& parameters);
 
-  ~NetworkIsolatorProcess() {}
+  ~NetworkIsolatorProcess();
 
   process::Future<Option<mesos::slave::ContainerLaunchInfo>> prepare(
       const ContainerID& containerId,
@@ -99,23 +570,445 @@ public:
       const ContainerID& containerId,
       pid_t pid);
 
+  // Starts allocating IPs for the container of 'executorInfo' ahead of
+  // prepare(), so that it overlaps with fetching.
+  void speculate(const ExecutorInfo& executorInfo);
+
   process::Future<Nothing> cleanup(
       const ContainerID& containerId);
 
+  // The counters of the container's links.
+  process::Future<ResourceStatistics> usage(const ContainerID& containerId);
+
+  // Becomes ready once the container has been over one of its limits for
+  // longer than allowed.
+  process::Future<mesos::slave::ContainerLimitation> watch(
+      const ContainerID& containerId);
+
+  // Limits the bandwidth of the container to its 'network_bandwidth'.
+  process::Future<Nothing> update(
+      const ContainerID& containerId,
+      const Resources& resources);
+
   process::Future<Nothing> updateSlaveInfo(const SlaveInfo& slaveInfo_)
   {
     slaveInfo.CopyFrom(slaveInfo_);
+
+    // Plumbing namespaces needs the hostname.
+    refill();
+
     return Nothing();
   }
 
+protected:
+  virtual void initialize();
+
 private:
   NetworkIsolatorProcess(
-      const std::string& ipamClientPath_,
-      const std::string& isolatorClientPath_,
+      process::Owned<Plugin> ipamPlugin_,
+      process::Owned<ipam::Allocator> builtinIpam_,
+      process::Owned<ipam::Blocks> blocks_,
+      process::Owned<Plugin> isolatorPlugin_,
+      const PluginPlacement& placement_,
+      process::Owned<uring::Ring> ring_,
+      const hashmap<uint32_t, std::string>& trafficFilters,
+      const NetworkIsolatorOptions& options_,
       const Parameters& parameters_);
 
-  const std::string ipamClientPath;
-  const std::string isolatorClientPath;
+  // Total CPU time used by plugins, read from their cgroup.
+  process::Future<double> _plugin_cgroup_cpu_usage_secs();
+
+  process::Future<std::vector<net::IP>> acquire(
+      const NetworkInfo& networkInfo,
+      const std::string& uid);
+
+  // Releases a speculative allocation that no container picked up.
+  void expire(const std::string& executor, const std::string& uid);
+
+  // Releases the speculative allocation for 'executor', if any.
+  void abandon(const std::string& executor);
+
+  // Holds back the IPs of a container that is being cleaned up, giving
+  // back those held the longest if there are too many.
+  void stick(
+      const std::string& key,
+      const std::string& uid,
+      const std::vector<net::IP>& addresses);
+
+  // Takes the IPs held back under 'key', if any.
+  Option<StickyAddresses> unstick(const std::string& key);
+
+  // Releases the IPs held back under 'key' unless taken since.
+  void expireSticky(const std::string& key, uint64_t generation);
+
+  // Releases IPs an earlier agent held back.
+  void recoverSticky();
+
+  // Requests the IPs 'message' asks for and returns them along with the
+  // already 'reserved' ones.
+  process::Future<std::vector<net::IP>> allocate(
+      const network_isolator::IPAMRequestIPMessage& message,
+      const std::vector<net::IP>& reserved);
+
+  // Releases the 'reserved' IPs and those of 'response' if it is empty
+  // or malformed.
+  process::Future<std::vector<net::IP>> _allocate(
+      const std::string& uid,
+      const std::vector<net::IP>& reserved,
+      const network_isolator::IPAMResponse& response);
+
+  // Sends an IPAM allocation request, hedged if so configured.
+  process::Future<network_isolator::IPAMResponse> requestIPs(
+      const network_isolator::IPAMRequestIPMessage& message);
+
+  process::Future<network_isolator::IPAMResponse> timedRequestIPs(
+      const network_isolator::IPAMRequestIPMessage& message);
+
+  void sampleAllocation(const process::Time& start);
+
+  // Issues the second request of a hedged allocation unless the first
+  // one has been answered.
+  void hedge(
+      const process::Owned<HedgedAllocation>& allocation,
+      const network_isolator::IPAMRequestIPMessage& message);
+
+  void _hedge(
+      const process::Owned<HedgedAllocation>& allocation,
+      bool second,
+      const process::Future<network_isolator::IPAMResponse>& response);
+
+  // Returns addresses to IPAM that no container will use.
+  void releaseIPs(const std::vector<net::IP>& addresses);
+
+  process::Future<Option<mesos::slave::ContainerLaunchInfo>> _prepare(
+      const ContainerID& containerId,
+      const std::string& executor,
+      const std::vector<Dictionary<std::string>::Id>& netgroups,
+      const std::vector<Dictionary<mesos::Label>::Id>& labels,
+      const std::string& uid,
+      const std::vector<net::IP>& addresses,
+      const Option<std::string>& stickyKey);
+
+  process::Future<Nothing> _cleanup(
+      const ContainerID& containerId);
+
+  // Runs IPAM, the plugin or the built-in one.
+  process::Future<network_isolator::IPAMResponse> runIpam(
+      const network_isolator::IPAMReserveIPMessage& message,
+      PluginPriority priority);
+
+  process::Future<network_isolator::IPAMResponse> runIpam(
+      const network_isolator::IPAMRequestIPMessage& message,
+      PluginPriority priority);
+
+  process::Future<network_isolator::IPAMResponse> runIpam(
+      const network_isolator::IPAMReleaseIPMessage& message,
+      PluginPriority priority);
+
+  // Hands out addresses from the blocks claimed for the netgroups of
+  // 'message', claiming another if they run short.
+  process::Future<network_isolator::IPAMResponse> allocateFromBlocks(
+      const network_isolator::IPAMRequestIPMessage& message,
+      PluginPriority priority);
+
+  // Claims a block for 'netgroups' unless one is being claimed already.
+  process::Future<Nothing> claimBlock(
+      const std::string& netgroups,
+      PluginPriority priority);
+
+  process::Future<Nothing> _claimBlock(
+      const std::string& netgroups,
+      const network_isolator::IPAMResponse& response);
+
+  void claimed(const std::string& netgroups);
+
+  // Gives 'block' back to IPAM if it is still empty and not needed to
+  // stay above the watermark.
+  void returnBlock(const std::string& block);
+
+  void releaseBlock(const std::string& block);
+
+  // Runs the virtualizer, the plugin or the built-in one.
+  process::Future<network_isolator::IsolatorResponse> runIsolator(
+      const network_isolator::IsolatorIsolateMessage& message,
+      PluginPriority priority);
+
+  process::Future<network_isolator::IsolatorResponse> runIsolator(
+      const network_isolator::IsolatorCleanupMessage& message,
+      PluginPriority priority);
+
+  // Classifies the traffic of a container on the 'traffic_class_device'
+  // by its 'priority' label, and stops doing so.
+  Try<Nothing> prioritize(const ContainerID& containerId);
+  void unprioritize(const ContainerID& containerId);
+
+  // Connects all containers in 'pendingPlumbings' at once.
+  void plumbPending();
+
+  // Reads the statistics of all containers in 'pendingUsages'.
+  void sampleUsages();
+
+  // Dumps the counters of the links on the host unless done lately.
+  void refreshHostStatistics();
+
+  // Checks the watched containers against their limits, as long as there
+  // are any.
+  void checkLimits();
+
+  // The limit 'watched' has been over since its last check, if any.
+  Option<std::string> exceeded(
+      const ContainerID& containerId,
+      WatchedContainer* watched);
+
+  Try<ResourceStatistics> sampleUsage(const ContainerID& containerId);
+
+  // The host side veth of an isolated container of the built-in
+  // virtualizer.
+  std::string hostLink(const ContainerID& containerId);
+
+  // A socket in the network namespace of an isolated container.
+  Try<netlink::Socket*> namespaceSocket(const ContainerID& containerId);
+
+  // Tops up the pool of network namespaces.
+  void refill();
+
+  process::Future<PooledNamespace> fill(const std::string& id);
+
+  process::Future<PooledNamespace> plumb(
+      const std::string& id,
+      const network_isolator::IPAMResponse& response);
+
+  void _refill(
+      const std::string& id,
+      const process::Future<PooledNamespace>& pooled);
+
+  // Releases the IP and virtualizer state of a pooled namespace that no
+  // container is going to use.
+  void discard(const std::string& id);
+
+  double _netns_pool_available();
+
+  double _ipam_blocks();
+
+  // Waits for 'plugin' to accept another invocation.
+  process::Future<Nothing> admit(
+      const process::Owned<Plugin>& plugin,
+      PluginPriority priority);
+
+  // Hands the slot of a finished invocation to the next waiting one.
+  void retire(const process::Owned<Plugin>& plugin);
+
+  double _ipam_queue_depth();
+  double _isolator_queue_depth();
+  double _ipam_breaker_open();
+  double _isolator_breaker_open();
+
+  // Runs 'plugin', writing 'input' to its stdin and collecting its
+  // stdout. Neither the write, the read nor reaping the plugin process
+  // blocks the actor.
+  process::Future<PluginRun> runPlugin(
+      const process::Owned<Plugin>& plugin,
+      const std::string& input);
+
+  // The same through the io_uring: reads the reply into 'buffer' from
+  // 'offset' on, and writes what is left of a request.
+  void ringRead(
+      int fd,
+      const std::shared_ptr<std::string>& buffer,
+      size_t offset,
+      const std::shared_ptr<process::Promise<std::string>>& promise);
+
+  void ringWrite(
+      int fd,
+      const std::shared_ptr<std::string>& data,
+      size_t offset);
+
+  void ringClose(int fd);
+
+  // Schedules submitting what has been queued on the ring.
+  void ringQueued();
+  void submitRing();
+
+  // Runs the callbacks of completed ring operations.
+  void reapRing();
+
+  process::Future<PluginRun> _runPlugin(
+      const std::string& command,
+      pid_t pid,
+      const std::tuple<std::string, PluginExit>& result);
+
+  // Sends 'input', the JSON form of 'command', to 'plugin' subject to
+  // its circuit breaker, admission control and retry policy. Only calls
+  // the plugin did not reply to count as failures for the breaker and
+  // are retried; an error it replies with fails the call right away.
+  process::Future<JSON::Object> invoke(
+      const process::Owned<Plugin>& plugin,
+      const std::string& command,
+      const std::string& input,
+      PluginPriority priority,
+      size_t attempt);
+
+  // Updates the circuit breaker of 'plugin' with the outcome of a call.
+  void record(
+      const process::Owned<Plugin>& plugin,
+      const process::Future<JSON::Object>& result);
+
+  process::Future<JSON::Object> retry(
+      const process::Owned<Plugin>& plugin,
+      const std::string& command,
+      const std::string& input,
+      PluginPriority priority,
+      size_t attempt,
+      const process::Future<JSON::Object>& result);
+
+  // Sends the JSON form of 'command' to 'plugin', once admitted at
+  // 'priority', and parses its reply.
+  template <typename InProto, typename OutProto>
+  process::Future<OutProto> runCommand(
+      const process::Owned<Plugin>& plugin,
+      const InProto& command,
+      PluginPriority priority);
+
+  struct Metrics
+  {
+    explicit Metrics(const NetworkIsolatorProcess& process);
+    ~Metrics();
+
+    process::metrics::Counter plugin_runs;
+
+    // Plugin processes that exited with a non-zero status or a signal.
+    process::metrics::Counter plugin_failures;
+
+    // CPU time consumed by plugin processes, from their rusage.
+    process::metrics::Counter plugin_cpu_user_ms;
+    process::metrics::Counter plugin_cpu_system_ms;
+
+    process::metrics::Timer<Milliseconds> plugin_run_time;
+
+    // Only reported when 'plugin_cgroup' is set.
+    process::metrics::Gauge plugin_cgroup_cpu_usage_secs;
+
+    // Invocations waiting for admission.
+    process::metrics::Gauge ipam_queue_depth;
+    process::metrics::Gauge isolator_queue_depth;
+
+    // 1 while the circuit breaker of the plugin is open or half open.
+    process::metrics::Gauge ipam_breaker_open;
+    process::metrics::Gauge isolator_breaker_open;
+
+    // Allocations that were sent a second time, and how often the
+    // second request was answered first.
+    process::metrics::Counter ipam_hedged_allocations;
+    process::metrics::Counter ipam_hedge_wins;
+
+    // Duplicate allocations returned to IPAM.
+    process::metrics::Counter ipam_hedge_releases;
+
+    // Speculative allocations used by prepare(), and those released
+    // unused.
+    process::metrics::Counter ipam_speculation_hits;
+    process::metrics::Counter ipam_speculation_expirations;
+
+    // Pooled network namespaces ready for use, and containers that got
+    // one.
+    process::metrics::Gauge netns_pool_available;
+    process::metrics::Counter netns_pool_hits;
+
+    // Address blocks held, and claimed so far.
+    process::metrics::Gauge ipam_blocks;
+    process::metrics::Counter ipam_block_claims;
+
+    // Containers that got back the IPs held for them, and IPs given
+    // back after being held.
+    process::metrics::Counter ipam_sticky_hits;
+    process::metrics::Counter ipam_sticky_releases;
+  } metrics;
+
+  const process::Owned<Plugin> ipamPlugin;
+
+  // Set when 'ipam_command' selects the built-in IPAM.
+  const process::Owned<ipam::Allocator> builtinIpam;
+
+  // Set with 'ipam_block_size'.
+  const process::Owned<ipam::Blocks> blocks;
+
+  // Block claims under way, by netgroups.
+  hashmap<std::string, process::Future<Nothing>> claims;
+
+  const process::Owned<Plugin> isolatorPlugin;
+  const PluginPlacement placement;
+
+  // Set with 'plugin_io_backend' where io_uring is available. Whether a
+  // submission is scheduled, and whether completions are polled for.
+  const process::Owned<uring::Ring> ring;
+  bool ringSubmitting;
+  bool ringPolling;
+
+  const NetworkIsolatorOptions options;
+
+  // Latencies of the most recent successful IPAM allocations.
+  std::deque<Duration> allocationLatencies;
+
+  // By framework and executor ID, as executorContainerIds.
+  hashmap<std::string, SpeculativeAllocation> speculations;
+
+  // Most recently held back first, and by key.
+  std::list<StickyAddresses> sticky;
+  hashmap<std::string, std::list<StickyAddresses>::iterator> stickyKeys;
+  uint64_t stickyGeneration;
+
+  std::deque<PooledNamespace> pool;
+
+  // Namespaces being plumbed for the pool.
+  size_t filling;
+
+  // Whether namespaces pooled by an earlier agent have been discarded.
+  bool poolRecovered;
+
+  std::vector<PendingPlumbing> pendingPlumbings;
+
+  // The agent samples all containers at about the same time; those asked
+  // for meanwhile are read in one go.
+  std::vector<PendingUsage> pendingUsages;
+
+  // Netlink sockets opened in the namespaces of containers, which they
+  // keep operating in, so that a sample takes a single dump.
+  hashmap<ContainerID, process::Owned<netlink::Socket>> namespaceSockets;
+
+  hashmap<ContainerID, WatchedContainer> watches;
+
+  // Whether checkLimits() is due to run.
+  bool checkingLimits;
+
+  // Filter ids not in use on the 'traffic_class_device'.
+  std::vector<uint32_t> freeFilters;
+
+  // Filters an earlier agent added for containers still running, by the
+  // address they match. Each is taken over by the next container to get
+  // its address.
+  hashmap<std::string, uint32_t> recoveredFilters;
+
+  // Counters of the links on the host, by name, when last dumped. With
+  // the built-in virtualizer, those of the host side veths stand in for
+  // the ones in the containers.
+  process::Owned<netlink::Socket> hostSocket;
+  hashmap<std::string, struct rtnl_link_stats64> hostStatistics;
+  Option<process::Time> hostStatisticsTime;
+
+  // Plugin requests are reused from one call to the next, as Clear()
+  // keeps the memory of their strings, repeated fields and arguments.
+  // Each is to be handed to runIpam() or runIsolator() right after it is
+  // filled in, which turn it into JSON or copy what they need before
+  // returning. Allocations go through blocks, which may claim one in
+  // the middle of the call, hence they are not reused.
+  struct RecycledMessages
+  {
+    network_isolator::IPAMReserveIPMessage reserve;
+    network_isolator::IPAMReleaseIPMessage release;
+    network_isolator::IsolatorIsolateMessage isolate;
+    network_isolator::IsolatorCleanupMessage cleanup;
+  } recycled;
+
   const Parameters parameters;
   std::string hostname;
   SlaveInfo slaveInfo;
@@ -182,20 +1075,36 @@ public:
   virtual process::Future<mesos::slave::ContainerLimitation> watch(
       const ContainerID& containerId)
   {
-    return process::Future<mesos::slave::ContainerLimitation>();
+    if (!activated) {
+      return process::Future<mesos::slave::ContainerLimitation>();
+    }
+    return dispatch(process.get(),
+                    &NetworkIsolatorProcess::watch,
+                    containerId);
   }
 
   virtual process::Future<Nothing> update(
       const ContainerID& containerId,
       const Resources& resources)
   {
-    return Nothing();
+    if (!activated) {
+      return Nothing();
+    }
+    return dispatch(process.get(),
+                    &NetworkIsolatorProcess::update,
+                    containerId,
+                    resources);
   }
 
   virtual process::Future<ResourceStatistics> usage(
       const ContainerID& containerId)
   {
-    return ResourceStatistics();
+    if (!activated) {
+      return ResourceStatistics();
+    }
+    return dispatch(process.get(),
+                    &NetworkIsolatorProcess::usage,
+                    containerId);
   }
 
   virtual process::Future<Nothing> cleanup(
@@ -219,6 +1128,16 @@ public:
                     slaveInfo);
   }
 
+  void speculate(const ExecutorInfo& executorInfo)
+  {
+    if (!activated) {
+      return;
+    }
+    dispatch(process.get(),
+             &NetworkIsolatorProcess::speculate,
+             executorInfo);
+  }
+
 private:
   process::Owned<NetworkIsolatorProcess> process;
   bool activated;
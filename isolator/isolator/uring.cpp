@@ -0,0 +1,395 @@
+/**
+ * This file is © 2015 Mesosphere, Inc. ("Mesosphere"). Mesosphere
+ * licenses this file to you solely pursuant to the agreement between
+ * Mesosphere and you (if any).  If there is no such agreement between
+ * Mesosphere, the following terms apply (and you may not use this
+ * file except in compliance with such terms):
+ *
+ * 1) Subject to your compliance with the following terms, Mesosphere
+ * hereby grants you a nonexclusive, limited, personal,
+ * non-sublicensable, non-transferable, royalty-free license to use
+ * this file solely for your internal business purposes.
+ *
+ * 2) You may not (and agree not to, and not to authorize or enable
+ * others to), directly or indirectly:
+ *   (a) copy, distribute, rent, lease, timeshare, operate a service
+ *   bureau, or otherwise use for the benefit of a third party, this
+ *   file; or
+ *
+ *   (b) remove any proprietary notices from this file.  Except as
+ *   expressly set forth herein, as between you and Mesosphere,
+ *   Mesosphere retains all right, title and interest in and to this
+ *   file.
+ *
+ * 3) Unless required by applicable law or otherwise agreed to in
+ * writing, Mesosphere provides this file on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied,
+ * including, without limitation, any warranties or conditions of
+ * TITLE, NON-INFRINGEMENT, MERCHANTABILITY, or FITNESS FOR A
+ * PARTICULAR PURPOSE.
+ *
+ * 4) In no event and under no legal theory, whether in tort
+ * (including negligence), contract, or otherwise, unless required by
+ * applicable law (such as deliberate and grossly negligent acts) or
+ * agreed to in writing, shall Mesosphere be liable to you for
+ * damages, including any direct, indirect, special, incidental, or
+ * consequential damages of any character arising as a result of these
+ * terms or out of the use or inability to use this file (including
+ * but not limited to damages for loss of goodwill, work stoppage,
+ * computer failure or malfunction, or any and all other commercial
+ * damages or losses), even if Mesosphere has been advised of the
+ * possibility of such damages.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+#include <algorithm>
+#include <string>
+
+#include <stout/error.hpp>
+#include <stout/os.hpp>
+#include <stout/stringify.hpp>
+
+#include "uring.hpp"
+
+// Not all libc headers know about the io_uring system calls (Linux >=
+// 5.1) yet.
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register 427
+#endif
+
+using process::Owned;
+
+namespace mesos {
+namespace uring {
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+// Whether the kernel supports each of 'opcodes'. The probe itself came
+// with Linux 5.6, along with the read, write and close operations.
+static Try<Nothing> probe(int fd, const uint8_t* opcodes, size_t count)
+{
+  const size_t size =
+    sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+
+  std::string buffer(size, '\0');
+  struct io_uring_probe* probe =
+    reinterpret_cast<struct io_uring_probe*>(&buffer[0]);
+
+  if (::syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256)
+        < 0) {
+    return ErrnoError("Failed to probe io_uring operations");
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    if (opcodes[i] > probe->last_op ||
+        !(probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED)) {
+      return Error(
+          "io_uring operation " + stringify((int) opcodes[i]) +
+          " is not supported");
+    }
+  }
+
+  return Nothing();
+}
+
+
+Try<Owned<Ring>> Ring::create(unsigned entries)
+{
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  Owned<Ring> ring(new Ring());
+
+  ring->fd = ::syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->fd < 0) {
+    return ErrnoError("Failed to set up io_uring");
+  }
+
+  const uint8_t opcodes[] = {
+    IORING_OP_READ,
+    IORING_OP_WRITE,
+    IORING_OP_CLOSE
+  };
+
+  Try<Nothing> supported = probe(ring->fd, opcodes, sizeof(opcodes));
+  if (supported.isError()) {
+    return Error(supported.error());
+  }
+
+  // Both queues are in one mapping on Linux >= 5.4; older kernels lack
+  // the operations above anyway.
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+    return Error("io_uring does not map its queues together");
+  }
+
+  ring->ringsSize = std::max(
+      params.sq_off.array + params.sq_entries * sizeof(unsigned),
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+
+  ring->rings = ::mmap(
+      NULL,
+      ring->ringsSize,
+      PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE,
+      ring->fd,
+      IORING_OFF_SQ_RING);
+  if (ring->rings == MAP_FAILED) {
+    ring->rings = NULL;
+    return ErrnoError("Failed to map io_uring queues");
+  }
+
+  ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = ::mmap(
+      NULL,
+      ring->sqesSize,
+      PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE,
+      ring->fd,
+      IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    return ErrnoError("Failed to map io_uring submission entries");
+  }
+
+  char* base = static_cast<char*>(ring->rings);
+  ring->sqHead = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+  ring->sqTail = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+  ring->sqMask = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+  ring->sqEntries = params.sq_entries;
+  ring->sqArray = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+  ring->cqHead = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+  ring->cqTail = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+  ring->cqMask = *reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+  ring->cqes = base + params.cq_off.cqes;
+
+  ring->efd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (ring->efd < 0) {
+    return ErrnoError("Failed to create eventfd");
+  }
+
+  if (::syscall(
+          __NR_io_uring_register,
+          ring->fd,
+          IORING_REGISTER_EVENTFD,
+          &ring->efd,
+          1) < 0) {
+    return ErrnoError("Failed to register eventfd with io_uring");
+  }
+
+  return ring;
+}
+
+
+Ring::~Ring()
+{
+  if (sqes != NULL) {
+    ::munmap(sqes, sqesSize);
+  }
+  if (rings != NULL) {
+    ::munmap(rings, ringsSize);
+  }
+  if (efd != -1) {
+    os::close(efd);
+  }
+  if (fd != -1) {
+    os::close(fd);
+  }
+}
+
+
+Try<struct io_uring_sqe*> Ring::prepare(
+    uint8_t opcode,
+    int target,
+    const Callback& callback)
+{
+  // The kernel consumes entries only within submit().
+  if (queued == sqEntries) {
+    Try<Nothing> submitted = submit();
+    if (submitted.isError()) {
+      return Error(submitted.error());
+    }
+  }
+
+  const unsigned tail = *sqTail;
+  const unsigned index = tail & sqMask;
+
+  struct io_uring_sqe* sqe = static_cast<struct io_uring_sqe*>(sqes) + index;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = target;
+  sqe->user_data = next;
+
+  callbacks[next++] = callback;
+
+  sqArray[index] = index;
+  __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+  queued++;
+
+  return sqe;
+}
+
+
+Try<Nothing> Ring::read(
+    int target,
+    char* buffer,
+    size_t length,
+    const Callback& callback)
+{
+  Try<struct io_uring_sqe*> sqe = prepare(IORING_OP_READ, target, callback);
+  if (sqe.isError()) {
+    return Error(sqe.error());
+  }
+
+  sqe.get()->addr = reinterpret_cast<uint64_t>(buffer);
+  sqe.get()->len = length;
+
+  // Not a file with a position: always read from where the pipe is at.
+  sqe.get()->off = -1;
+
+  return Nothing();
+}
+
+
+Try<Nothing> Ring::write(
+    int target,
+    const char* buffer,
+    size_t length,
+    const Callback& callback)
+{
+  Try<struct io_uring_sqe*> sqe = prepare(IORING_OP_WRITE, target, callback);
+  if (sqe.isError()) {
+    return Error(sqe.error());
+  }
+
+  sqe.get()->addr = reinterpret_cast<uint64_t>(buffer);
+  sqe.get()->len = length;
+  sqe.get()->off = -1;
+
+  return Nothing();
+}
+
+
+Try<Nothing> Ring::close(int target, const Callback& callback)
+{
+  Try<struct io_uring_sqe*> sqe = prepare(IORING_OP_CLOSE, target, callback);
+  if (sqe.isError()) {
+    return Error(sqe.error());
+  }
+
+  return Nothing();
+}
+
+
+Try<Nothing> Ring::submit()
+{
+  while (queued > 0) {
+    calls++;
+    int submitted =
+      ::syscall(__NR_io_uring_enter, fd, queued, 0, 0, NULL, 0);
+    if (submitted < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return ErrnoError("Failed to submit to io_uring");
+    }
+    queued -= submitted;
+  }
+
+  return Nothing();
+}
+
+
+size_t Ring::reap()
+{
+  // Completions may have arrived after the counter was last reset, in
+  // which case it reads non-zero and we come back here for nothing.
+  uint64_t counter;
+  calls++;
+  ::read(efd, &counter, sizeof(counter));
+
+  size_t reaped = 0;
+
+  unsigned head = *cqHead;
+  while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+    const struct io_uring_cqe* cqe =
+      static_cast<struct io_uring_cqe*>(cqes) + (head & cqMask);
+
+    const uint64_t id = cqe->user_data;
+    const int result = cqe->res;
+
+    __atomic_store_n(cqHead, ++head, __ATOMIC_RELEASE);
+
+    // The callback may queue operations, and so add callbacks.
+    Callback callback = callbacks[id];
+    callbacks.erase(id);
+    callback(result);
+
+    reaped++;
+  }
+
+  return reaped;
+}
+
+#else // HAVE_LINUX_IO_URING_H
+
+Try<Owned<Ring>> Ring::create(unsigned entries)
+{
+  return Error("Built without io_uring support");
+}
+
+
+Ring::~Ring() {}
+
+
+Try<Nothing> Ring::read(int, char*, size_t, const Callback&)
+{
+  return Error("Built without io_uring support");
+}
+
+
+Try<Nothing> Ring::write(int, const char*, size_t, const Callback&)
+{
+  return Error("Built without io_uring support");
+}
+
+
+Try<Nothing> Ring::close(int, const Callback&)
+{
+  return Error("Built without io_uring support");
+}
+
+
+Try<Nothing> Ring::submit()
+{
+  return Nothing();
+}
+
+
+size_t Ring::reap()
+{
+  return 0;
+}
+
+#endif // HAVE_LINUX_IO_URING_H
+
+} // namespace uring {
+} // namespace mesos {
@@ -0,0 +1,169 @@
+/**
+ * This file is © 2015 Mesosphere, Inc. ("Mesosphere"). Mesosphere
+ * licenses this file to you solely pursuant to the agreement between
+ * Mesosphere and you (if any).  If there is no such agreement between
+ * Mesosphere, the following terms apply (and you may not use this
+ * file except in compliance with such terms):
+ *
+ * 1) Subject to your compliance with the following terms, Mesosphere
+ * hereby grants you a nonexclusive, limited, personal,
+ * non-sublicensable, non-transferable, royalty-free license to use
+ * this file solely for your internal business purposes.
+ *
+ * 2) You may not (and agree not to, and not to authorize or enable
+ * others to), directly or indirectly:
+ *   (a) copy, distribute, rent, lease, timeshare, operate a service
+ *   bureau, or otherwise use for the benefit of a third party, this
+ *   file; or
+ *
+ *   (b) remove any proprietary notices from this file.  Except as
+ *   expressly set forth herein, as between you and Mesosphere,
+ *   Mesosphere retains all right, title and interest in and to this
+ *   file.
+ *
+ * 3) Unless required by applicable law or otherwise agreed to in
+ * writing, Mesosphere provides this file on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied,
+ * including, without limitation, any warranties or conditions of
+ * TITLE, NON-INFRINGEMENT, MERCHANTABILITY, or FITNESS FOR A
+ * PARTICULAR PURPOSE.
+ *
+ * 4) In no event and under no legal theory, whether in tort
+ * (including negligence), contract, or otherwise, unless required by
+ * applicable law (such as deliberate and grossly negligent acts) or
+ * agreed to in writing, shall Mesosphere be liable to you for
+ * damages, including any direct, indirect, special, incidental, or
+ * consequential damages of any character arising as a result of these
+ * terms or out of the use or inability to use this file (including
+ * but not limited to damages for loss of goodwill, work stoppage,
+ * computer failure or malfunction, or any and all other commercial
+ * damages or losses), even if Mesosphere has been advised of the
+ * possibility of such damages.
+ */
+
+#ifndef __URING_HPP__
+#define __URING_HPP__
+
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+
+#include <process/owned.hpp>
+
+#include <stout/hashmap.hpp>
+#include <stout/nothing.hpp>
+#include <stout/try.hpp>
+
+// From <linux/io_uring.h>, which not all kernel headers we build
+// against have.
+struct io_uring_sqe;
+
+namespace mesos {
+namespace uring {
+
+// A minimal io_uring, set up with the raw system calls rather than
+// liburing. Reads, writes and closes are queued with the callback that
+// gets their result, a byte count or a negated errno, and go to the
+// kernel together with the next submit(). The ring signals completions
+// on eventfd(), which its owner polls, then calls reap(). Not thread
+// safe; meant to be driven by a single actor.
+class Ring
+{
+public:
+  typedef std::function<void(int)> Callback;
+
+  // Fails if the kernel or the headers the module was built with lack
+  // io_uring or any of the operations used here (Linux >= 5.6), or if
+  // it is disabled, e.g. by seccomp or 'kernel.io_uring_disabled'.
+  static Try<process::Owned<Ring>> create(unsigned entries);
+
+  ~Ring();
+
+  // The descriptors must stay open until their operation completes.
+  // Blocking descriptors are best: the kernel waits for them to become
+  // ready itself, where non-blocking ones may complete with -EAGAIN.
+  //
+  // With the submission queue full, the operations in it are submitted
+  // first. If the kernel turns them down for now, e.g. with EBUSY while
+  // completions wait to be reaped, the operation is not queued and its
+  // callback never runs.
+  Try<Nothing> read(
+      int fd,
+      char* buffer,
+      size_t length,
+      const Callback& callback);
+  Try<Nothing> write(
+      int fd,
+      const char* buffer,
+      size_t length,
+      const Callback& callback);
+  Try<Nothing> close(int fd, const Callback& callback);
+
+  // Hands all queued operations to the kernel with a single system call.
+  Try<Nothing> submit();
+
+  // Runs the callbacks of the completed operations, which may queue
+  // more, and returns how many there were.
+  size_t reap();
+
+  // Readable while there are completions to reap.
+  int eventfd() const { return efd; }
+
+  // Operations queued, or submitted and not reaped yet.
+  size_t pending() const { return callbacks.size(); }
+
+  // System calls made, other than those setting up the ring.
+  uint64_t syscalls() const { return calls; }
+
+private:
+  Ring()
+    : fd(-1),
+      efd(-1),
+      rings(NULL),
+      ringsSize(0),
+      sqes(NULL),
+      sqesSize(0),
+      queued(0),
+      next(0),
+      calls(0) {}
+
+  // The next free submission queue entry, submitting the ones queued so
+  // far if the queue is full.
+  Try<struct io_uring_sqe*> prepare(
+      uint8_t opcode,
+      int fd,
+      const Callback&);
+
+  int fd;
+  int efd;
+
+  void* rings;
+  size_t ringsSize;
+  void* sqes;
+  size_t sqesSize;
+
+  unsigned* sqHead;
+  unsigned* sqTail;
+  unsigned sqMask;
+  unsigned sqEntries;
+  unsigned* sqArray;
+
+  unsigned* cqHead;
+  unsigned* cqTail;
+  unsigned cqMask;
+  void* cqes;
+
+  unsigned queued;
+
+  // By the user data of their operation.
+  hashmap<uint64_t, Callback> callbacks;
+  uint64_t next;
+
+  uint64_t calls;
+};
+
+} // namespace uring {
+} // namespace mesos {
+
+#endif // __URING_HPP__